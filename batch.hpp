@@ -0,0 +1,222 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <omp.h>
+
+#include "progress.hpp"
+#include "utils.hpp"
+#include "vendor/json.hpp"
+
+namespace fs = std::filesystem;
+
+namespace FPCFilter
+{
+
+	struct BatchJob
+	{
+		std::string input;
+		std::string output;
+
+		// Input file size (bytes), 0 if it does not exist
+		uintmax_t size = 0;
+	};
+
+	// Input/output pairs processed in a single run, read from a JSON manifest:
+	//
+	//   [ { "input": "a.ply", "output": "a_out.ply" }, { "input": "b.ply", "output": "b_out.ply" } ]
+	//
+	// (or { "jobs": [ ... ] }). The large files are processed one at a time with all the threads, then the small
+	// ones are processed concurrently with one thread each. Every job keeps the same OpenMP thread pool
+	class Batch
+	{
+
+		// Input files at least this large use all the threads
+		static constexpr uintmax_t LARGE_FILE_SIZE = 32ull << 20;
+
+		std::vector<BatchJob> jobs;
+
+	public:
+		explicit Batch(const std::string& path)
+		{
+			std::ifstream reader(path);
+
+			if (!reader.is_open())
+				throw std::invalid_argument(std::string("Cannot open file ") + path);
+
+			nlohmann::json manifest;
+
+			try {
+				reader >> manifest;
+			}
+			catch (const nlohmann::json::exception& e) {
+				throw std::invalid_argument(string_format("Invalid batch manifest '%s': %s", path.c_str(), e.what()));
+			}
+
+			const auto& list = manifest.is_array() ? manifest : manifest["jobs"];
+
+			if (!list.is_array() || list.empty())
+				throw std::invalid_argument(string_format("Batch manifest '%s' does not contain any job", path.c_str()));
+
+			std::set<std::string> outputs;
+
+			for (size_t i = 0; i < list.size(); ++i)
+			{
+				const auto& j = list[i];
+
+				if (!j.is_object() || !j.contains("input") || !j.contains("output"))
+					throw std::invalid_argument(string_format("Batch job %zu must have an input and an output", i + 1));
+
+				BatchJob job;
+				job.input = j["input"].get<std::string>();
+				job.output = j["output"].get<std::string>();
+
+				if (job.input.empty() || job.output.empty())
+					throw std::invalid_argument(string_format("Batch job %zu has an empty input or output", i + 1));
+
+				if (!outputs.insert(job.output).second)
+					throw std::invalid_argument(string_format("Output file '%s' appears more than once in the batch manifest", job.output.c_str()));
+
+				std::error_code ec;
+				const auto size = fs::file_size(job.input, ec);
+				job.size = ec ? 0 : size;
+
+				this->jobs.push_back(job);
+			}
+		}
+
+		size_t size() const
+		{
+			return this->jobs.size();
+		}
+
+		// Runs process on every job: a failing job is reported and does not stop the others, a cancellation
+		// stops the batch (Cancelled). Returns the number of failed jobs, stats receives the stats of every job
+		size_t run(const std::function<void(const BatchJob&, std::ostream&, nlohmann::json&)>& process, std::ostream& log, nlohmann::json& stats) const
+		{
+			const auto start = std::chrono::steady_clock::now();
+
+			const auto threads = omp_get_max_threads();
+
+			std::vector<size_t> large;
+			std::vector<size_t> small;
+
+			for (size_t i = 0; i < this->jobs.size(); ++i)
+				(threads == 1 || this->jobs[i].size >= LARGE_FILE_SIZE ? large : small).push_back(i);
+
+			// Largest first, for a better balance of the concurrent ones
+			const auto bySize = [this](size_t a, size_t b) { return this->jobs[a].size > this->jobs[b].size; };
+			std::stable_sort(large.begin(), large.end(), bySize);
+			std::stable_sort(small.begin(), small.end(), bySize);
+
+			std::vector<nlohmann::json> results(this->jobs.size());
+			size_t failed = 0;
+			size_t done = 0;
+
+			const auto execute = [&](size_t i, std::ostream& out) {
+
+				const auto& job = this->jobs[i];
+				auto& result = results[i];
+
+				result = {
+					{"input", job.input},
+					{"output", job.output},
+					{"size", job.size}
+				};
+
+				nlohmann::json jobStats = nlohmann::json::object();
+
+				const auto jobStart = std::chrono::steady_clock::now();
+
+				try {
+
+					if (!fs::exists(job.input))
+						throw std::invalid_argument(string_format("Input file '%s' does not exist", job.input.c_str()));
+
+					process(job, out, jobStats);
+				}
+				catch (const std::exception& e) {
+					result["error"] = e.what();
+					out << " !> Failed: " << e.what() << std::endl;
+				}
+
+				const std::chrono::duration<double> diff = std::chrono::steady_clock::now() - jobStart;
+
+				result["time"] = diff.count();
+				result["stats"] = jobStats;
+			};
+
+			auto& progress = Progress::get();
+
+			for (const auto i : large)
+			{
+				if (progress.isCancelled())
+					break;
+
+				log << std::endl << " -> [" << ++done << "/" << this->jobs.size() << "] " << this->jobs[i].input << " (" << threads << (threads == 1 ? " thread)" : " threads)") << std::endl;
+
+				execute(i, log);
+
+				failed += results[i].contains("error");
+			}
+
+			if (!small.empty() && !progress.isCancelled())
+			{
+				// The stages of the concurrent jobs are not reported, only the number of jobs done
+				progress.begin("batch", small.size());
+
+				// Every job runs on its own thread: its parallel regions get a team of one
+				#pragma omp parallel for schedule(dynamic, 1) reduction(+ : failed)
+				for (long long s = 0; s < small.size(); ++s)
+				{
+					if (progress.isCancelled())
+						continue;
+
+					omp_set_num_threads(1);
+
+					const auto i = small[s];
+
+					std::ostringstream out;
+
+					{
+						Progress::Muted muted;
+						execute(i, out);
+					}
+
+					progress.local().add(1);
+
+					failed += results[i].contains("error");
+
+					#pragma omp critical
+					log << std::endl << " -> [" << ++done << "/" << this->jobs.size() << "] " << this->jobs[i].input << " (1 thread)" << std::endl << out.str();
+				}
+			}
+
+			progress.check();
+
+			const std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
+
+			stats["batch"] = {
+				{"jobs", this->jobs.size()},
+				{"large_files", large.size()},
+				{"small_files", small.size()},
+				{"failed", failed},
+				{"time", diff.count()}
+			};
+			stats["jobs"] = results;
+
+			log << std::endl << " ?> Batch done in " << diff.count() << "s (" << this->jobs.size() - failed << " processed, " << failed << " failed)" << std::endl << std::endl;
+
+			return failed;
+		}
+	};
+
+}
@@ -0,0 +1,287 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <omp.h>
+
+#include "FPCFilter.h"
+#include "common.hpp"
+#include "kdtree.hpp"
+#include "pipeline.hpp"
+#include "ply.hpp"
+#include "random.hpp"
+#include "synthetic.hpp"
+#include "vendor/cxxopts.hpp"
+#include "vendor/json.hpp"
+
+namespace fs = std::filesystem;
+
+using namespace FPCFilter;
+
+// Offline benchmark suite: every cloud is synthetic (seeded), so the results of two releases on the same
+// machine are comparable. Every benchmark runs --repeat times for every thread count, the results go to a JSON file
+
+namespace {
+
+	// Share of the points that are outliers
+	constexpr double NOISE = 0.01;
+
+	SyntheticScene makeScene(size_t n, uint64_t seed)
+	{
+		SceneOptions options;
+		options.points = n;
+		options.seed = seed;
+		options.noise = NOISE;
+
+		return SyntheticScene(options);
+	}
+
+	// PlyFile::write output layout
+	void writeOutput(const PlyFile& cloud, const std::string& path)
+	{
+		std::ofstream writer(path, std::ofstream::binary);
+		cloud.write(writer);
+	}
+
+	// Regular polygon inscribed in the central part of the terrain
+	Polygon makePolygon(size_t vertexes, double side)
+	{
+		Polygon polygon;
+
+		for (size_t i = 0; i < vertexes; ++i)
+		{
+			const auto angle = 2.0 * std::acos(-1.0) * i / vertexes;
+			polygon.addPoint(static_cast<float>(side * (0.5 + 0.45 * std::cos(angle))), static_cast<float>(side * (0.5 + 0.45 * std::sin(angle))));
+		}
+
+		return polygon;
+	}
+
+	class Suite
+	{
+		size_t repeat;
+		std::string filter;
+
+		nlohmann::json results = nlohmann::json::array();
+
+	public:
+		Suite(size_t repeat, const std::string& filter) : repeat(repeat), filter(filter) {}
+
+		// Times run (repeat times) with the given number of threads
+		void measure(const std::string& name, size_t points, int threads, const std::function<void()>& run)
+		{
+			if (!filter.empty() && name.find(filter) == std::string::npos)
+				return;
+
+			omp_set_num_threads(threads);
+
+			std::vector<double> times;
+
+			for (size_t r = 0; r < repeat; ++r)
+			{
+				const auto start = std::chrono::steady_clock::now();
+
+				run();
+
+				const std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
+				times.push_back(diff.count());
+			}
+
+			auto sorted = times;
+			std::sort(sorted.begin(), sorted.end());
+
+			const auto median = sorted[sorted.size() / 2];
+
+			results.push_back({
+				{"name", name},
+				{"points", points},
+				{"threads", threads},
+				{"times", times},
+				{"min", sorted.front()},
+				{"median", median},
+				{"throughput", median > 0 ? points / median : 0.0}
+			});
+
+			std::cout << " -> " << std::left << std::setw(28) << name << std::right << std::setw(11) << points << " points "
+				<< std::setw(3) << threads << " threads  " << std::fixed << std::setprecision(4) << median << "s  "
+				<< std::setprecision(0) << (median > 0 ? points / median : 0.0) << " points/s" << std::defaultfloat << std::setprecision(6) << std::endl;
+		}
+
+		const nlohmann::json& json() const
+		{
+			return results;
+		}
+	};
+}
+
+int main(const int argc, char** argv)
+{
+	cxxopts::Options options("fpcfilter_bench", "FPCFilter benchmark suite (synthetic clouds, no network)");
+
+	options.add_options()
+		("o,output", "Results file (JSON)", cxxopts::value<std::string>()->default_value("fpcfilter_bench.json"))
+		("sizes", "Points of the end to end pipelines (e.g. 1000000,10000000,100000000)", cxxopts::value<std::vector<size_t>>()->default_value("1000000"))
+		("micro-points", "Points of the micro benchmarks", cxxopts::value<size_t>()->default_value("1000000"))
+		("threads", "Thread counts (default: 1 and every power of 2 up to the number of processors)", cxxopts::value<std::vector<int>>())
+		("repeat", "Runs of every benchmark", cxxopts::value<size_t>()->default_value("3"))
+		("filter", "Only run the benchmarks whose name contains this text", cxxopts::value<std::string>()->default_value(""))
+		("seed", "Seed of the synthetic clouds", cxxopts::value<uint64_t>()->default_value(DEFAULT_SEED))
+		("dir", "Directory of the temporary files (default: system temporary directory)", cxxopts::value<std::string>())
+		("h,help", "Print usage");
+
+	try {
+
+		const auto result = options.parse(argc, argv);
+
+		if (result.count("help")) {
+			std::cout << options.help() << std::endl;
+			return EXIT_SUCCESS;
+		}
+
+		const auto sizes = result["sizes"].as<std::vector<size_t>>();
+		const auto microPoints = result["micro-points"].as<size_t>();
+		const auto repeat = result["repeat"].as<size_t>();
+		const auto seed = result["seed"].as<uint64_t>();
+
+		if (repeat < 1 || microPoints < 1000)
+			throw std::invalid_argument("Repeat must be at least 1 and micro benchmarks need at least 1000 points");
+
+		std::vector<int> threads;
+
+		if (result.count("threads"))
+			threads = result["threads"].as<std::vector<int>>();
+		else {
+			const auto procs = std::max(omp_get_num_procs(), 1);
+			for (int t = 1; t < procs; t *= 2)
+				threads.push_back(t);
+			threads.push_back(procs);
+		}
+
+		for (const auto t : threads)
+			if (t < 1)
+				throw std::invalid_argument("Thread counts must be at least 1");
+
+		const fs::path dir = result.count("dir") ? fs::path(result["dir"].as<std::string>()) : fs::temp_directory_path() / "fpcfilter_bench";
+		fs::create_directories(dir);
+
+		const auto binaryPath = (dir / "micro_binary.ply").string();
+		const auto asciiPath = (dir / "micro_ascii.ply").string();
+		const auto outputPath = (dir / "out.ply").string();
+
+		std::cout << " *** fpcfilter_bench - v" << FPCFilter_VERSION_MAJOR << "." << FPCFilter_VERSION_MINOR << " ***" << std::endl << std::endl;
+
+		Suite suite(repeat, result["filter"].as<std::string>());
+
+		std::ostream silent(nullptr);
+
+		const auto scene = makeScene(microPoints, seed);
+		const auto cloud = scene.cloud();
+		const auto side = scene.side();
+
+		scene.write(binaryPath, SyntheticFormat::Binary, true);
+		scene.write(asciiPath, SyntheticFormat::Ascii, false);
+
+		const auto smallPolygon = makePolygon(4, side);
+		const auto largePolygon = makePolygon(1024, side);
+
+		for (const auto t : threads)
+		{
+			suite.measure("ply_write_binary", microPoints, t, [&]() { writeOutput(*cloud, outputPath); });
+			suite.measure("ply_read_binary", microPoints, t, [&]() { PlyFile ply(binaryPath); });
+			suite.measure("ply_read_ascii", microPoints, t, [&]() { PlyFile ply(asciiPath); });
+
+			for (const auto& polygon : { std::make_pair("polygon_inside_4", &smallPolygon), std::make_pair("polygon_inside_1024", &largePolygon) })
+			{
+				std::vector<uint8_t> inside(microPoints);
+
+				suite.measure(polygon.first, microPoints, t, [&]() {
+					#pragma omp parallel for schedule(static)
+					for (long long i = 0; i < microPoints; ++i)
+						inside[i] = polygon.second->inside(cloud->points[i].x, cloud->points[i].y);
+				});
+			}
+
+			std::unique_ptr<KDTree> tree;
+
+			suite.measure("kdtree_build", microPoints, t, [&]() { tree = std::make_unique<KDTree>(cloud->points); });
+
+			if (!tree)
+				tree = std::make_unique<KDTree>(cloud->points);
+
+			for (const auto radius : { 0.05, 0.1, 0.2 })
+				suite.measure(string_format("sample_r%g", radius), microPoints, t, [&]() {
+					FastSampleFilter sampler(radius, silent, false);
+					sampler.run(*cloud, *tree);
+				});
+
+			suite.measure("knn_k17", microPoints, t, [&]() {
+				#pragma omp parallel
+				{
+					size_t indices[17];
+					float dists[17];
+
+					#pragma omp for schedule(static)
+					for (long long i = 0; i < microPoints; ++i)
+					{
+						const float q[3] = { cloud->points[i].x, cloud->points[i].y, cloud->points[i].z };
+						tree->knnSearch(q, 17, indices, dists);
+					}
+				}
+			});
+		}
+
+		fs::remove(binaryPath);
+		fs::remove(asciiPath);
+
+		// End to end: read time crop, sample, statistical filter, write
+		for (const auto n : sizes)
+		{
+			const auto path = (dir / string_format("pipeline_%zu.ply", n)).string();
+
+			const auto scene = makeScene(n, seed);
+			scene.write(path, SyntheticFormat::Binary, true);
+
+			const auto extent = static_cast<float>(scene.side());
+
+			for (const auto t : threads)
+				suite.measure("pipeline", n, t, [&]() {
+					nlohmann::json stats = nlohmann::json::object();
+					Pipeline pipeline(path, silent, false, &stats, seed);
+
+					pipeline.crop([extent](const float x, const float y, const float z) { return x > 0.05f * extent && x < 0.95f * extent; });
+					pipeline.sample(0.05);
+					pipeline.filter({ 2.5 }, 16);
+					pipeline.write(outputPath);
+				});
+
+			fs::remove(path);
+		}
+
+		fs::remove(outputPath);
+
+		const nlohmann::json report = {
+			{"version", string_format("%d.%d", FPCFilter_VERSION_MAJOR, FPCFilter_VERSION_MINOR)},
+			{"processors", omp_get_num_procs()},
+			{"seed", seed},
+			{"repeat", repeat},
+			{"results", suite.json()}
+		};
+
+		std::ofstream o(result["output"].as<std::string>());
+		o << report.dump(2) << std::endl;
+
+		std::cout << std::endl << " ?> Results written to " << result["output"].as<std::string>() << std::endl;
+	}
+	catch (const std::exception& e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
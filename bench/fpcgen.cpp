@@ -0,0 +1,122 @@
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <omp.h>
+
+#include "FPCFilter.h"
+#include "random.hpp"
+#include "synthetic.hpp"
+#include "vendor/cxxopts.hpp"
+#include "vendor/json.hpp"
+
+using namespace FPCFilter;
+
+// Synthetic cloud generator: seeded scenes of any size (terrain, buildings, density variation, duplicates,
+// outliers) for the benchmarks and to measure how well the filters remove the known noise
+
+int main(const int argc, char** argv)
+{
+	cxxopts::Options options("fpcgen", "FPCFilter synthetic point cloud generator");
+
+	options.add_options()
+		("o,output", "Output file (PLY)", cxxopts::value<std::string>())
+		("n,points", "Number of points", cxxopts::value<size_t>()->default_value("1000000"))
+		("seed", "Seed of the scene", cxxopts::value<uint64_t>()->default_value(DEFAULT_SEED))
+		("format", "File format (binary, ascii)", cxxopts::value<std::string>()->default_value("binary"))
+		("normals", "Write the normals (auto: binary only, the layouts read by FPCFilter; yes, no)", cxxopts::value<std::string>()->default_value("auto"))
+		("density", "Average points per square meter", cxxopts::value<double>()->default_value("100"))
+		("density-variation", "Density variation along x, in [0, 1) (0: uniform)", cxxopts::value<double>()->default_value("0"))
+		("buildings", "Approximate number of buildings", cxxopts::value<size_t>()->default_value("0"))
+		("noise", "Share of outlier points", cxxopts::value<double>()->default_value("0.01"))
+		("duplicates", "Share of exact duplicate points", cxxopts::value<double>()->default_value("0"))
+		("labels", "Ground truth file: one byte per point, in order (0 surface, 1 noise, 2 duplicate)", cxxopts::value<std::string>())
+		("label-views", "Give the noise points 0 views (1 or more otherwise), to count the outliers left in a filtered cloud", cxxopts::value<bool>())
+		("j,stats", "Summary file (JSON)", cxxopts::value<std::string>())
+		("c,concurrency", "Max concurrency", cxxopts::value<int>())
+		("h,help", "Print usage");
+
+	try {
+
+		const auto result = options.parse(argc, argv);
+
+		if (result.count("help") || !result.count("output")) {
+			std::cout << options.help() << std::endl;
+			return result.count("help") ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+
+		SceneOptions scene;
+		scene.points = result["points"].as<size_t>();
+		scene.seed = result["seed"].as<uint64_t>();
+		scene.density = result["density"].as<double>();
+		scene.densityVariation = result["density-variation"].as<double>();
+		scene.buildings = result["buildings"].as<size_t>();
+		scene.noise = result["noise"].as<double>();
+		scene.duplicates = result["duplicates"].as<double>();
+
+		const auto formatName = result["format"].as<std::string>();
+
+		if (formatName != "binary" && formatName != "ascii")
+			throw std::invalid_argument("Format must be binary or ascii");
+
+		const auto format = formatName == "binary" ? SyntheticFormat::Binary : SyntheticFormat::Ascii;
+
+		const auto normalsName = result["normals"].as<std::string>();
+
+		if (normalsName != "auto" && normalsName != "yes" && normalsName != "no")
+			throw std::invalid_argument("Normals must be auto, yes or no");
+
+		const auto normals = normalsName == "auto" ? format == SyntheticFormat::Binary : normalsName == "yes";
+
+		if (result.count("concurrency")) {
+			const auto concurrency = result["concurrency"].as<int>();
+
+			if (concurrency <= 0)
+				throw std::invalid_argument("Concurrency must be greater than 0");
+
+			omp_set_num_threads(concurrency);
+		}
+
+		const auto output = result["output"].as<std::string>();
+		const auto labels = result.count("labels") ? result["labels"].as<std::string>() : std::string();
+
+		const SyntheticScene generator(scene);
+
+		std::cout << " *** fpcgen - v" << FPCFilter_VERSION_MAJOR << "." << FPCFilter_VERSION_MINOR << " ***" << std::endl << std::endl;
+		std::cout << " -> Writing " << scene.points << " points (" << formatName << (normals ? ", normals" : "") << ") on a "
+			<< generator.side() << " x " << generator.side() << " m terrain to " << output << std::endl;
+
+		const auto start = std::chrono::steady_clock::now();
+
+		const auto written = generator.write(output, format, normals, labels, result.count("label-views") > 0);
+
+		const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+		std::cout << " ?> Done in " << elapsed.count() << "s: " << written.noise << " noise points, " << written.duplicates << " duplicates" << std::endl;
+
+		if (result.count("stats")) {
+			const nlohmann::json summary = {
+				{"points", scene.points},
+				{"seed", scene.seed},
+				{"format", formatName},
+				{"normals", normals},
+				{"side", generator.side()},
+				{"density", scene.density},
+				{"density_variation", scene.densityVariation},
+				{"buildings", scene.buildings},
+				{"noise", written.noise},
+				{"duplicates", written.duplicates},
+				{"time", elapsed.count()}
+			};
+
+			std::ofstream o(result["stats"].as<std::string>());
+			o << summary.dump(4) << std::endl;
+		}
+	}
+	catch (const std::exception& e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -112,6 +112,40 @@ namespace FPCFilter
 		{
 			return inside(point.x, point.y);
 		};
+
+		// First POLYGON of a GeoJSON feature collection
+		static std::optional<Polygon> fromGeoJSON(const std::string& path)
+		{
+
+			Polygon polygon;
+
+			std::ifstream i(path);
+			nlohmann::json j;
+			i >> j;
+
+			const auto features = j["features"];
+
+			if (features.empty())
+				return std::nullopt;
+
+			for (const auto& f : features)
+			{
+				const auto geometry = f["geometry"];
+
+				if (geometry["type"] != "Polygon")
+					continue;
+
+				const auto coordinates = geometry["coordinates"][0];
+
+				// Add the points
+				for (auto& coord : coordinates)
+					polygon.addPoint(coord[0], coord[1]);
+
+				return polygon;
+			}
+
+			return std::nullopt;
+		}
 	};
 
 	class NotImplementedException : public std::exception
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <omp.h>
+
+#include "ply.hpp"
+#include "random.hpp"
+
+namespace FPCFilter {
+
+    // Sidecar file storing the per-point mean neighbor distances computed by the statistical filter,
+    // so that a later run with a different threshold can skip the neighbors search.
+    //
+    // The key is a hash of the coordinates of the filtered points (the input file after the stages
+    // that come before the filter) combined with the search parameters (meanK and eps).
+    //
+    // Layout (little endian): magic, version, key, spacing, count, count * double
+    class DistanceCache {
+
+        static constexpr char MAGIC[8] = { 'F', 'P', 'C', 'D', 'I', 'S', 'T', '\0' };
+        static constexpr uint32_t VERSION = 1;
+
+        // Fixed block size, so that the hash does not depend on the number of threads
+        static constexpr size_t HASH_BLOCK = 1 << 16;
+
+        static uint64_t hashBlock(const std::vector<PlyPoint>& points, size_t begin, size_t end)
+        {
+            uint64_t h = 0xCBF29CE484222325ull;
+
+            for (size_t i = begin; i < end; ++i)
+            {
+                uint32_t bits[3];
+                std::memcpy(&bits[0], &points[i].x, sizeof(float));
+                std::memcpy(&bits[1], &points[i].y, sizeof(float));
+                std::memcpy(&bits[2], &points[i].z, sizeof(float));
+
+                h = SplitMix64::at(h, (static_cast<uint64_t>(bits[0]) << 32) | bits[1]);
+                h = SplitMix64::at(h, bits[2]);
+            }
+
+            return h;
+        }
+
+    public:
+
+        static uint64_t key(const std::vector<PlyPoint>& points, int meanK, double eps)
+        {
+            const size_t blocks = (points.size() + HASH_BLOCK - 1) / HASH_BLOCK;
+
+            std::vector<uint64_t> hashes(blocks);
+
+            #pragma omp parallel for
+            for (long long b = 0; b < blocks; ++b)
+                hashes[b] = hashBlock(points, b * HASH_BLOCK, std::min<size_t>(points.size(), (b + 1) * HASH_BLOCK));
+
+            uint64_t h = SplitMix64::at(points.size(), meanK);
+
+            uint64_t epsBits;
+            std::memcpy(&epsBits, &eps, sizeof(double));
+            h = SplitMix64::at(h, epsBits);
+
+            for (const auto hash : hashes)
+                h = SplitMix64::at(h, hash);
+
+            return h;
+        }
+
+        // Returns false if the file does not exist or was computed for other points / parameters
+        template <class Vector>
+        static bool load(const std::string& path, uint64_t key, Vector& distances, double& spacing)
+        {
+            std::ifstream reader(path, std::ifstream::binary);
+
+            if (!reader.is_open())
+                return false;
+
+            char magic[sizeof(MAGIC)];
+            uint32_t version;
+            uint64_t fileKey;
+            uint64_t count;
+            double fileSpacing;
+
+            reader.read(magic, sizeof(MAGIC));
+            reader.read(reinterpret_cast<char*>(&version), sizeof(uint32_t));
+            reader.read(reinterpret_cast<char*>(&fileKey), sizeof(uint64_t));
+            reader.read(reinterpret_cast<char*>(&fileSpacing), sizeof(double));
+            reader.read(reinterpret_cast<char*>(&count), sizeof(uint64_t));
+
+            if (!reader || std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 || version != VERSION || fileKey != key || count != distances.size())
+                return false;
+
+            reader.read(reinterpret_cast<char*>(distances.data()), count * sizeof(double));
+
+            if (!reader)
+                return false;
+
+            spacing = fileSpacing;
+
+            return true;
+        }
+
+        // Writes a temporary file next to the target and renames it over the target once complete, so a failed
+        // write (full disk) never leaves a truncated cache behind
+        template <class Vector>
+        static void save(const std::string& path, uint64_t key, const Vector& distances, double spacing)
+        {
+            const auto temporary = path + ".tmp";
+
+            std::ofstream writer(temporary, std::ofstream::binary);
+
+            if (!writer.is_open())
+                throw std::invalid_argument(std::string("Cannot open file ") + temporary);
+
+            const uint64_t count = distances.size();
+
+            writer.write(MAGIC, sizeof(MAGIC));
+            writer.write(reinterpret_cast<const char*>(&VERSION), sizeof(uint32_t));
+            writer.write(reinterpret_cast<const char*>(&key), sizeof(uint64_t));
+            writer.write(reinterpret_cast<const char*>(&spacing), sizeof(double));
+            writer.write(reinterpret_cast<const char*>(&count), sizeof(uint64_t));
+            writer.write(reinterpret_cast<const char*>(distances.data()), count * sizeof(double));
+
+            writer.close();
+
+            std::error_code error;
+
+            if (writer)
+                std::filesystem::rename(temporary, path, error);
+
+            if (!writer || error) {
+                std::filesystem::remove(temporary, error);
+                throw std::runtime_error(std::string("Cannot write file ") + path);
+            }
+        }
+    };
+
+}
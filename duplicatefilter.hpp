@@ -0,0 +1,346 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include <omp.h>
+
+#include "ply.hpp"
+#include "parallel.hpp"
+#include "progress.hpp"
+#include "trace.hpp"
+#include "metrics.hpp"
+
+namespace FPCFilter {
+
+    // Hash: a small open addressing table per partition, one scatter pass. Sort: the partitions are sorted instead
+    // (no table) and scattered in several passes over the cloud, which allocates a fraction of the partition indices
+    enum class DedupMethod { Hash, Sort };
+
+    // Removes the exact duplicates (same x, y and z bits; 0 and -0 are the same) and keeps the first point of
+    // every location. With merge, the kept point gets the mean color and the sum of the views (capped at 255)
+    // of its duplicates.
+    // The points are first scattered by the hash of their coordinates into partitions small enough for the
+    // cache (streaming passes over the cloud: per thread histograms, then a stable scatter of the indices of the
+    // partitions of every pass), then every partition is deduplicated by a single thread. The partitions keep the points in cloud order,
+    // so the kept point is the first one whatever the number of threads
+    class DuplicateFilter {
+
+        // Target number of points of a partition (its keys and table fit in the L2 cache)
+        static constexpr size_t PARTITION_POINTS = 1 << 15;
+
+        // Sort mode scatters the partitions in this many passes, so that only this fraction of the members is allocated
+        static constexpr size_t SORT_PASSES = 8;
+
+        DedupMethod method;
+        bool merge;
+
+        std::ostream& log;
+        bool isVerbose;
+
+        nlohmann::json *stats;
+
+        struct Key {
+            uint32_t x, y, z;
+
+            bool operator==(const Key& other) const { return x == other.x && y == other.y && z == other.z; }
+            bool operator<(const Key& other) const { return x != other.x ? x < other.x : (y != other.y ? y < other.y : z < other.z); }
+        };
+
+        static uint32_t bits(float value)
+        {
+            // -0 becomes 0
+            value += 0.0f;
+
+            uint32_t b;
+            std::memcpy(&b, &value, sizeof(b));
+            return b;
+        }
+
+        static Key key(const PlyPoint& p)
+        {
+            return { bits(p.x), bits(p.y), bits(p.z) };
+        }
+
+        static uint64_t hash(const Key& k)
+        {
+            uint64_t h = (static_cast<uint64_t>(k.x) << 32 | k.y) * 0x9E3779B97F4A7C15ull;
+            h ^= (h >> 29) ^ (static_cast<uint64_t>(k.z) * 0xBF58476D1CE4E5B9ull);
+            h ^= h >> 32;
+            return h * 0x94D049BB133111EBull;
+        }
+
+        // Sets keep for the first point of every location of the partition and, with merge, folds the others into it.
+        // Returns the number of duplicates
+        template <typename Index>
+        size_t dedupPartition(std::vector<PlyPoint>& points, const Index* members, size_t count, std::vector<uint8_t>& keep,
+            std::vector<Key>& keys, std::vector<uint32_t>& table, std::vector<uint32_t>& first, std::vector<uint32_t>& order) const
+        {
+            // The only random reads of the points: the rest works on the keys of the partition
+            keys.resize(count);
+            for (size_t m = 0; m < count; ++m)
+                keys[m] = key(points[members[m]]);
+
+            // Position (in the partition) of the kept point of every member
+            first.resize(count);
+
+            if (method == DedupMethod::Hash)
+            {
+                size_t size = 16;
+                while (size < count * 2)
+                    size <<= 1;
+
+                constexpr uint32_t EMPTY = UINT32_MAX;
+                table.assign(size, EMPTY);
+
+                for (size_t m = 0; m < count; ++m)
+                {
+                    const auto& k = keys[m];
+
+                    for (size_t slot = (hash(k) >> 7) & (size - 1); ; slot = (slot + 1) & (size - 1))
+                    {
+                        if (table[slot] == EMPTY) {
+                            table[slot] = static_cast<uint32_t>(m);
+                            first[m] = static_cast<uint32_t>(m);
+                            break;
+                        }
+
+                        if (keys[table[slot]] == k) {
+                            first[m] = table[slot];
+                            break;
+                        }
+                    }
+                }
+            }
+            else
+            {
+                order.resize(count);
+                for (size_t m = 0; m < count; ++m)
+                    order[m] = static_cast<uint32_t>(m);
+
+                // Stable: the first member of a run of equal keys is the first point in cloud order
+                std::stable_sort(order.begin(), order.end(), [&keys](const uint32_t a, const uint32_t b) {
+                    return keys[a] < keys[b];
+                });
+
+                for (size_t r = 0; r < count; ++r)
+                    first[order[r]] = r > 0 && keys[order[r]] == keys[order[r - 1]] ? first[order[r - 1]] : order[r];
+            }
+
+            size_t duplicates = 0;
+
+            for (size_t m = 0; m < count; ++m) {
+                keep[members[m]] = first[m] == m;
+                duplicates += first[m] != m;
+            }
+
+            if (!merge || duplicates == 0)
+                return duplicates;
+
+            // Sums of the colors and views of every location, in the slot of its kept point
+            struct Sum { uint32_t red, green, blue, views, count; };
+            std::vector<Sum> sums(count, Sum{ 0, 0, 0, 0, 0 });
+
+            for (size_t m = 0; m < count; ++m)
+            {
+                const auto& p = points[members[m]];
+                auto& s = sums[first[m]];
+
+                s.red += p.red; s.green += p.green; s.blue += p.blue; s.views += p.views;
+                s.count++;
+            }
+
+            for (size_t m = 0; m < count; ++m)
+            {
+                const auto& s = sums[m];
+
+                if (s.count < 2)
+                    continue;
+
+                auto& p = points[members[m]];
+
+                p.red = static_cast<uint8_t>((s.red + s.count / 2) / s.count);
+                p.green = static_cast<uint8_t>((s.green + s.count / 2) / s.count);
+                p.blue = static_cast<uint8_t>((s.blue + s.count / 2) / s.count);
+                p.views = static_cast<uint8_t>(std::min<uint32_t>(s.views, 255));
+            }
+
+            return duplicates;
+        }
+
+        // Partitions and deduplicates the cloud. Members are the indices of the points grouped by partition: 32 bits
+        // unless the cloud has more than 2^32 points
+        template <typename Index>
+        Compaction dedup(PlyFile& file, Progress& progress, size_t& partitions, size_t& passes, size_t& duplicates) const {
+
+            auto& points = file.points;
+            const size_t np = points.size();
+
+            size_t bitsCount = 0;
+            while ((np >> bitsCount) > PARTITION_POINTS && bitsCount < 16)
+                ++bitsCount;
+
+            partitions = size_t(1) << bitsCount;
+            passes = method == DedupMethod::Sort ? std::min(SORT_PASSES, partitions) : 1;
+
+            const int shift = 64 - static_cast<int>(bitsCount);
+
+            const auto partitionOf = [&](const PlyPoint& p) -> size_t {
+                return bitsCount == 0 ? 0 : static_cast<size_t>(hash(key(p)) >> shift);
+            };
+
+            // Partition sizes of every thread block, then where every thread writes its members in the current pass
+            const auto maxThreads = static_cast<size_t>(omp_get_max_threads());
+            std::vector<size_t> counts(maxThreads * partitions, 0);
+            std::vector<size_t> offsets(maxThreads * partitions, 0);
+            std::vector<size_t> begins(partitions + 1, 0);
+
+            // Members of the partitions of a single pass
+            std::vector<Index> members;
+
+            std::vector<uint8_t> keep(np, 0);
+            duplicates = 0;
+
+            size_t removed = 0;
+
+            #pragma omp parallel reduction(+ : removed)
+            {
+                const auto t = static_cast<size_t>(omp_get_thread_num());
+                const auto threads = static_cast<size_t>(omp_get_num_threads());
+                const auto blockBegin = np * t / threads;
+                const auto blockEnd = np * (t + 1) / threads;
+
+                {
+                    TraceSpan span("dedup histogram");
+
+                    size_t* local = counts.data() + t * partitions;
+
+                    for (size_t i = blockBegin; i < blockEnd; ++i)
+                        local[partitionOf(points[i])]++;
+                }
+
+                auto& counter = progress.local();
+
+                std::vector<Key> keys;
+                std::vector<uint32_t> table, first, order;
+
+                for (size_t pass = 0; pass < passes; ++pass)
+                {
+                    // The partitions of a pass are a contiguous range of hash prefixes
+                    const auto firstPartition = partitions * pass / passes;
+                    const auto lastPartition = partitions * (pass + 1) / passes;
+
+                    #pragma omp barrier
+
+                    #pragma omp single
+                    {
+                        // Partition major, thread minor: the blocks of a partition are in cloud order
+                        size_t offset = 0;
+
+                        for (size_t p = firstPartition; p < lastPartition; ++p)
+                        {
+                            begins[p] = offset;
+
+                            for (size_t th = 0; th < threads; ++th) {
+                                offsets[th * partitions + p] = offset;
+                                offset += counts[th * partitions + p];
+                            }
+                        }
+
+                        begins[lastPartition] = offset;
+
+                        // Sized for the largest pass
+                        if (offset > members.size())
+                            members.resize(offset);
+                    }
+
+                    {
+                        TraceSpan span("dedup scatter");
+
+                        size_t* local = offsets.data() + t * partitions;
+
+                        for (size_t i = blockBegin; i < blockEnd; ++i)
+                        {
+                            const auto p = partitionOf(points[i]);
+
+                            if (p >= firstPartition && p < lastPartition)
+                                members[local[p]++] = static_cast<Index>(i);
+                        }
+                    }
+
+                    #pragma omp barrier
+
+                    TraceSpan span("dedup");
+
+                    // The implicit barrier keeps the members until every partition of the pass is done
+                    #pragma omp for schedule(dynamic, 1)
+                    for (long long p = firstPartition; p < static_cast<long long>(lastPartition); ++p)
+                    {
+                        if (progress.isCancelled())
+                            continue;
+
+                        const auto count = begins[p + 1] - begins[p];
+
+                        removed += dedupPartition(points, members.data() + begins[p], count, keep, keys, table, first, order);
+
+                        counter.add(count);
+                    }
+                }
+            }
+
+            duplicates = removed;
+
+            return Compaction(std::move(keep));
+        }
+
+    public:
+        DuplicateFilter(DedupMethod method, bool merge, std::ostream &logstream, bool isVerbose, nlohmann::json *stats) :
+            method(method), merge(merge), log(logstream), isVerbose(isVerbose), stats(stats) {}
+
+        // Returns the compaction that removes the duplicates (and merges them into the kept points, with merge)
+        Compaction run(PlyFile& file) {
+
+            const size_t np = file.points.size();
+
+            if (np == 0)
+                return Compaction({});
+
+            const auto start = std::chrono::steady_clock::now();
+
+            auto& progress = Progress::get();
+            progress.begin("dedup", np);
+
+            StageMetrics metrics("dedup", np);
+
+            size_t partitions, passes, duplicates;
+
+            auto compaction = np <= UINT32_MAX ?
+                dedup<uint32_t>(file, progress, partitions, passes, duplicates) :
+                dedup<size_t>(file, progress, partitions, passes, duplicates);
+
+            progress.check();
+
+            const std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
+
+            metrics.record(stats, compaction.size(), { {"partitions", partitions}, {"passes", passes} });
+
+            (*stats)["dedup"] = {
+                {"method", method == DedupMethod::Hash ? "hash" : "sort"},
+                {"merge", merge},
+                {"removed", duplicates},
+                {"partitions", partitions},
+                {"passes", passes},
+                {"time", diff.count()}
+            };
+
+            if (this->isVerbose)
+                log << " ?> Found " << duplicates << " duplicates in " << diff.count() << "s (" << partitions << " partitions, " << passes << " passes)" << std::endl;
+
+            return compaction;
+        }
+
+    };
+
+}
@@ -1,295 +1,562 @@
 #pragma once
 
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <optional>
 #include <map>
 #include <tuple>
 #include <vector>
-#include <random>
 
 #include "ply.hpp"
-#include "vendor/nanoflann.hpp"
+#include "kdtree.hpp"
+#include "spacing.hpp"
+#include "random.hpp"
+#include "parallel.hpp"
+#include "distancecache.hpp"
+#include "numa.hpp"
+#include "progress.hpp"
+#include "metrics.hpp"
 
 namespace FPCFilter {
 
+    // How the threshold is derived from the neighbor distances:
+    //  - Stdev: mean + multiplier * standard deviation;
+    //  - Mad: median + multiplier * normalized median absolute deviation, which is not inflated by large noise blobs
+    enum class ThresholdMode { Stdev, Mad };
 
-    struct PointCloud {
-        std::vector<PlyPoint> &pts;
+    class FastOutlierFilter {
 
-        PointCloud(std::vector<PlyPoint>& points) : pts(points) {
-            this->pts = points;
-        }
+        std::vector<double> multipliers;
+        ThresholdMode mode;
+        int meanK;
+        double eps;
+        size_t verifySamples;
+        size_t boundedSamples;
+        uint64_t seed;
+        std::string cachePath;
+
+        std::ostream& log;
+        bool isVerbose;
 
-        // Must return the number of data points
-        inline size_t kdtree_get_point_count() const { return pts.size(); }
+        const KDTree* tree = nullptr;
 
-        // Returns the dim'th component of the idx'th point in the class:
-        // Since this is inlined and the "dim" argument is typically an immediate value, the
-        //  "if/else's" are actually solved at compile time.
-        inline float kdtree_get_pt(const size_t idx, const size_t dim) const
+        nlohmann::json *stats;
+
+    public:
+        // Every standard deviation multiplier produces its own set of inliers (threshold sweep)
+        FastOutlierFilter(const std::vector<double>& std, ThresholdMode mode, int meanK, double eps, size_t verifySamples, size_t boundedSamples, uint64_t seed, const std::string& cachePath, std::ostream &logstream, bool isVerbose, nlohmann::json *stats) : 
+            multipliers(std), mode(mode), meanK(meanK), eps(eps), verifySamples(verifySamples), boundedSamples(boundedSamples), seed(seed), cachePath(cachePath), isVerbose(isVerbose), log(logstream), stats(stats) {}
+
+        void knnSearch(const PlyPoint& point, size_t k,
+            std::vector<size_t>& indices, std::vector<float>& sqr_dists, double eps = 0) const
         {
-            if (dim == 0) return pts[idx].x;
-            else if (dim == 1) return pts[idx].y;
-            else return pts[idx].z;
+            const float pt[3] = {point.x, point.y, point.z};
+            tree->knnSearch(pt, k, &indices.front(), &sqr_dists.front(), static_cast<float>(eps));
         }
 
-        double kdtree_distance(const float* p1, const size_t p2_idx,
-            size_t /*numDims*/) const
+        // Average distance of the point to its count - 1 closest neighbors (the first result is the point itself)
+        double meanDistance(const PlyPoint& point, size_t count,
+            std::vector<size_t>& indices, std::vector<float>& sqr_dists, double eps = 0) const
         {
-            double d0 = p1[0] - pts[p2_idx].x;
-            double d1 = p1[1] - pts[p2_idx].y;
-            double d2 = p1[2] - pts[p2_idx].z;
+            knnSearch(point, count, indices, sqr_dists, eps);
 
-            return (d0 * d0 + d1 * d1 + d2 * d2);
+            double distance = 0.0;
+            for (size_t j = 1; j < count; ++j)
+            {
+                double delta = std::sqrt(sqr_dists[j]) - distance;
+                distance += (delta / j);
+            }
+
+            return distance;
         }
 
+        // Returns the compactions that remove the outliers, one for each multiplier. The distances are computed once.
+        // The index (built on demand, it is not needed when the distances are in the cache) must contain the points of the file
+        std::vector<Compaction> run(const PlyFile& file, const std::function<const KDTree&()>& getIndex) {
 
-        // Optional bounding-box computation: return false to default to a standard bbox computation loop.
-        //   Return true if the BBOX was already computed by the class and returned in "bb" so it can be avoided to redo it again.
-        //   Look at bb.size() to find out the expected dimensionality (e.g. 2 or 3 for point clouds)
-        template <class BBOX>
-        bool kdtree_get_bbox(BBOX& /* bb */) const { return false; }
-    };
+            size_t np = file.points.size();
 
-    class FastOutlierFilter {
+            // we increase the count by one because the query point itself will
+            // be included with a distance of 0
+            const size_t count = (size_t)meanK + 1;
 
-        typedef nanoflann::KDTreeSingleIndexAdaptor<nanoflann::L2_Simple_Adaptor<
-            double, PointCloud, double>, PointCloud, -1, std::size_t> KDTree;
+            // Not initialized: the pages are first touched by the threads that compute the distances
+            FirstTouchVector<double> distances(np);
+            double spacing = 0;
 
-        double multiplier;
-        int meanK;
+            uint64_t cacheKey = 0;
+            bool cached = false;
 
-        std::ostream& log;
-        bool isVerbose;
+            if (!cachePath.empty()) {
 
-        std::unique_ptr<KDTree> tree;
+                const auto start = std::chrono::steady_clock::now();
 
-        const nanoflann::SearchParams params;
-        nlohmann::json *stats;
+                cacheKey = DistanceCache::key(file.points, meanK, eps);
+                cached = DistanceCache::load(cachePath, cacheKey, distances, spacing);
 
-    public:
-        FastOutlierFilter(double std, int meanK, std::ostream &logstream, bool isVerbose, nlohmann::json *stats) : 
-            multiplier(std), meanK(meanK), isVerbose(isVerbose), log(logstream), params(nanoflann::SearchParams(10)), stats(stats) {}
+                if (this->isVerbose) {
+                    const std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
+                    log << " ?> " << (cached ? "Loaded" : "No valid") << " cached distances from " << cachePath << " in " << diff.count() << "s" << std::endl;
+                }
+            }
 
-        void knnSearch(PlyPoint& point, size_t k,
-            std::vector<size_t>& indices, std::vector<double>& sqr_dists) const
-        {
-            nanoflann::KNNResultSet<double, size_t, size_t> resultSet(k);
+            std::chrono::duration<double> knnTime(0);
 
-            resultSet.init(&indices.front(), &sqr_dists.front());
+            // In bounded mode the statistics are estimated on a sample
+            std::optional<Location> estimated;
 
-            std::array<double, 3> pt = {point.x, point.y, point.z};
-            tree->findNeighbors(resultSet, &pt[0], this->params);
+            if (!cached) {
 
-        }
+                tree = &getIndex();
 
-        void run(PlyFile& file) {
+                // Compute neighbor median distance over closest neighbors
+                // This could be part of a separate pipeline item
 
-            PointCloud pointCloud(file.points);
+                spacing = estimateSpacing(*tree, file.points, seed);
 
-            auto start = std::chrono::steady_clock::now();
+                std::vector<size_t> indices;
+                std::vector<float> sqr_dists;
 
-            tree = std::make_unique<KDTree>(3, pointCloud, nanoflann::KDTreeSingleIndexAdaptorParams(100));
-            tree->buildIndex();
+                std::vector<size_t> nodePoints(numa::Topology::get().nodeCount(), 0);
 
-            if (this->isVerbose) {
-                const std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
-                std::cout << " ?> Done building index in " << diff.count() << "s" << std::endl;
-            }
+                const auto start = std::chrono::steady_clock::now();
 
-            size_t np = file.points.size();
+                auto& progress = Progress::get();
+                progress.begin("knn", np);
 
-            // Compute neighbor median distance over closest neighbors
-            // This could be part of a separate pipeline item
+                StageMetrics metrics("knn", np);
 
-            std::vector<size_t> indices;
-            std::vector<double> sqr_dists;
-            size_t SAMPLES = std::min<size_t>(np, 10000);
+                if (boundedSamples > 0)
+                    estimated = boundedDistances(file, count, distances);
+                else
+                {
+                    #pragma omp parallel private (indices, sqr_dists)
+                    {
+                        indices.resize(count);
+                        sqr_dists.resize(count);
 
-            size_t count = 3;
-            std::vector<double> distances(SAMPLES, 0.0);
+                        TraceSpan span("knn");
 
-            std::unordered_map<uint64_t, size_t> dist_map;
+                        size_t processed = 0;
 
-            std::vector<double> all_distances;
-            std::random_device rd;
-            std::mt19937_64 gen(rd());
-            std::uniform_int_distribution<size_t> randomDis(
-                0, np - 1
-            );
+                        auto& counter = progress.local();
 
-            #pragma omp parallel private (indices, sqr_dists)
-            {
-                indices.resize(count);
-                sqr_dists.resize(count);
+                        const long long chunks = static_cast<long long>((np + Progress::CHUNK_POINTS - 1) / Progress::CHUNK_POINTS);
 
-                #pragma omp for
-                for (long long i = 0; i < SAMPLES; ++i)
-                {
-                    const size_t idx = randomDis(gen);
-                    knnSearch(file.points[idx], count, indices, sqr_dists);
+                        // We are using 'long long' instead of size_t (unsigned long long) because OpenMP parallel for needs a signed index
 
-                    double sum = 0.0;
-                    for (size_t j = 1; j < count; ++j)
-                    {
-                        sum += std::sqrt(sqr_dists[j]);
-                    }
-                    sum /= count;
+                        // Static, like the loops that first touched the points
+                        #pragma omp for schedule(static) nowait
+                        for (long long c = 0; c < chunks; ++c)
+                        {
+                            if (progress.isCancelled())
+                                continue;
 
-                    #pragma omp critical
-                    {
-                        uint64_t k = std::ceil(sum * 100);
-                        if (dist_map.find(k) == dist_map.end()){
-                            dist_map[k] = 1;
-                        }else{
-                            dist_map[k] += 1;
+                            const size_t begin = c * Progress::CHUNK_POINTS;
+                            const size_t end = std::min(begin + Progress::CHUNK_POINTS, np);
+
+                            for (size_t i = begin; i < end; ++i)
+                                distances[i] = meanDistance(file.points[i], count, indices, sqr_dists, eps);
+
+                            processed += end - begin;
+
+                            counter.add(end - begin);
                         }
+
+                        // The node the thread ended on (the same for the whole loop when the threads are pinned)
+                        const auto node = numa::currentNode();
+
+                        #pragma omp atomic
+                        nodePoints[node] += processed;
                     }
-                    indices.clear(); indices.resize(count);
-                    sqr_dists.clear(); sqr_dists.resize(count);
                 }
-            }
 
-            uint64_t max_val = std::numeric_limits<uint64_t>::min();
-            int d = 0;
-            for (auto it : dist_map){
-                if (it.second > max_val){
-                    d = it.first;
-                    max_val = it.second;
+                // The skipped points have no distance
+                progress.check();
+
+                knnTime = std::chrono::steady_clock::now() - start;
+
+                metrics.record(stats, np, { {"meank", meanK}, {"bounded", estimated.has_value()} });
+
+                if (this->isVerbose) {
+                    log << " ?> Done calculating point neighbors average distances in " << knnTime.count() << "s" << std::endl;
+
+                    for (size_t node = 0; node < nodePoints.size(); ++node)
+                        if (nodePoints[node] > 0)
+                            log << " ?> NUMA node " << node << ": " << nodePoints[node] << " points (" << nodePoints[node] / knnTime.count() << " points/s)" << std::endl;
                 }
+
+                // The bounded distances are not reusable with other thresholds
+                if (!cachePath.empty() && !estimated.has_value())
+                    DistanceCache::save(cachePath, cacheKey, distances, spacing);
             }
 
-            double spacing = static_cast<double>(d) / 100.0;
             (*stats)["spacing"] = spacing;
 
-            std::cout << " -> Spacing estimation completed (" << spacing << " meters)" << std::endl << std::endl;
+            log << " -> Spacing estimation completed (" << spacing << " meters)" << std::endl << std::endl;
 
             // Outlier filtering
 
-            std::vector<PlyPoint> newPoints;
-            newPoints.reserve(np);
+            auto start = std::chrono::steady_clock::now();
 
-            std::vector<PlyExtra> newExtras;
-            newExtras.reserve(np);
+            // Location of the distances, then the inliers of every threshold
+            StageMetrics reduction("reduction", np);
 
-            std::vector<size_t> inliers, outliers;
-            distances.resize(np, 0.0);
+            const auto location = estimated.has_value() ? estimated.value() : locate(distances);
 
-            // we increase the count by one because the query point itself will
-            // be included with a distance of 0
-            count = (size_t)meanK + 1;
+            std::vector<double> thresholds;
+            for (const auto multiplier : multipliers)
+                thresholds.push_back(location.threshold(multiplier));
 
-            indices.clear();
-            sqr_dists.clear();
+            if (this->isVerbose) {
+                const std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
+                log << " ?> Done calculating cloud average distance " << diff.count() << "s" << std::endl;
+            }
 
             start = std::chrono::steady_clock::now();
 
-            #pragma omp parallel private (indices, sqr_dists)
-            {
-                indices.resize(count);
-                sqr_dists.resize(count);
+            std::vector<Compaction> compactions;
 
-                // We are using 'long long' instead of size_t (unsigned long long) because OpenMP parallel for needs a signed index
+            nlohmann::json filterStats = {
+                {"query_time", knnTime.count()},
+                {"cached", cached}
+            };
 
-                #pragma omp for
-                for (long long i = 0; i < np; ++i)
-                {
-                    knnSearch(file.points[i], count, indices, sqr_dists);
+            if (mode == ThresholdMode::Mad) {
+                filterStats["mode"] = "mad";
+                filterStats["median"] = location.center;
+                filterStats["mad"] = location.spread / MAD_SCALE;
+            } else {
+                filterStats["mean"] = location.center;
+                filterStats["stdev"] = location.spread;
+            }
 
-                    for (size_t j = 1; j < count; ++j)
-                    {
-                        double delta = std::sqrt(sqr_dists[j]) - distances[i];
-                        distances[i] += (delta / j);
-                    }
-                    indices.clear(); indices.resize(count);
-                    sqr_dists.clear(); sqr_dists.resize(count);
+            for (size_t t = 0; t < thresholds.size(); ++t) {
+
+                const auto threshold = thresholds[t];
+
+                std::vector<uint8_t> keep(np);
+
+                #pragma omp parallel for schedule(static)
+                for (long long i = 0; i < np; ++i)
+                    keep[i] = distances[i] < threshold;
+
+                compactions.emplace_back(std::move(keep));
+
+                if (thresholds.size() == 1) {
+                    filterStats["threshold"] = threshold;
+                    filterStats["removed"] = compactions.back().removed();
+                } else {
+                    filterStats["sweep"].push_back({
+                        {"std", multipliers[t]},
+                        {"threshold", threshold},
+                        {"removed", compactions.back().removed()}
+                    });
                 }
             }
 
+            reduction.record(stats, compactions.front().size(), { {"thresholds", thresholds.size()} });
+
+            (*stats)["statistical_filter"] = filterStats;
+
             if (this->isVerbose) {
                 const std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
-                std::cout << " ?> Done calculating point neighbors average distances in " << diff.count() << "s" << std::endl;
+                log << " ?> Done filtering points in " << diff.count() << "s" << std::endl;
+            }
+
+            if (eps > 0 && verifySamples > 0) {
+                tree = &getIndex();
+                verify(file, distances, count, thresholds.front(), cached ? 0.0 : knnTime.count() / np);
             }
 
-            size_t n(0);
-            double M1(0.0);
-            double M2(0.0);
+            return compactions;
+        }
 
-            start = std::chrono::steady_clock::now();
+    private:
 
-            for (auto const& d : distances)
-            {
-                size_t n1(n);
-                n++;
-                double delta = d - M1;
-                double delta_n = delta / n;
-                M1 += delta_n;
-                M2 += delta * delta_n * n1;
-            }
-            double mean = M1;
-            double variance = M2 / (n - 1.0);
-            double stdev = std::sqrt(variance);
+        // Makes the median absolute deviation a consistent estimator of the standard deviation for normal data
+        static constexpr double MAD_SCALE = 1.4826;
 
-            double threshold = mean + multiplier * stdev;
+        // Center and spread of the distances according to the threshold mode
+        struct Location {
+            double center;
+            double spread;
 
-            if (this->isVerbose) {
-                const std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
-                std::cout << " ?> Done calculating cloud average distance " << diff.count() << "s" << std::endl;
+            double threshold(double multiplier) const { return center + multiplier * spread; }
+        };
+
+        template <class Vector>
+        Location locate(const Vector& values) const
+        {
+            if (mode == ThresholdMode::Stdev) {
+                const auto moments = parallelMoments(values);
+                return { moments.mean, moments.stdev() };
             }
 
-            if (file.hasNormals()) {
+            const auto median = parallelMedian(values);
 
-                start = std::chrono::steady_clock::now();
+            FirstTouchVector<double> deviations(values.size());
 
-                for (size_t i = 0; i < np; ++i)
-                {
-                    if (distances[i] < threshold) {
+            #pragma omp parallel for schedule(static)
+            for (long long i = 0; i < values.size(); ++i)
+                deviations[i] = std::abs(values[i] - median);
 
-                        const auto pt = file.points[i];
-                        const auto xs = file.extras[i];
+            return { median, MAD_SCALE * parallelMedian(deviations) };
+        }
 
-                        newPoints.emplace_back(pt.x, pt.y, pt.z, pt.red, pt.green, pt.blue, pt.views);
-                        newExtras.emplace_back(xs.nx, xs.ny, xs.nz);
-                    } 
-                    
-                }
+        // Number of leaf buckets scanned to get the candidate neighbors of a point in bounded mode
+        static constexpr size_t CANDIDATE_LEAVES = 2;
+
+        // Two-pass bounded mode.
+        // The first pass runs the exact search on a random sample to estimate the center and the spread
+        // of the distances, hence the thresholds. The second pass classifies every point:
+        //  - the mean distance to candidate neighbors found in the closest leaf buckets is an upper bound of the
+        //    exact one: if it is below the lowest threshold, the point is an inlier;
+        //  - otherwise the exact search is run within the highest threshold, seeded with the farthest candidate
+        //    (the meanK-th neighbor cannot be farther). If only m < meanK neighbors are within the threshold, the
+        //    missing ones are farther, so the mean distance is at least (sum of the m distances + (meanK - m) *
+        //    threshold) / meanK: if that is above the threshold, the point is an outlier;
+        //  - otherwise the exact distance is compared as usual (the bounded search found the exact neighbors,
+        //    or an unbounded one is run for the borderline points).
+        // The distances of the points resolved by the bounds are the upper bound (inliers) or infinity (outliers),
+        // so every decision matches the exact one against the estimated thresholds
+        Location boundedDistances(const PlyFile& file, size_t count, FirstTouchVector<double>& distances) const
+        {
+            const size_t np = file.points.size();
+            const size_t samples = std::min(boundedSamples, np);
 
-                newPoints.shrink_to_fit();
-                newExtras.shrink_to_fit();
+            std::vector<double> sampled(samples);
 
-                file.points = newPoints;
-                file.extras = newExtras;
+            std::vector<size_t> indices;
+            std::vector<float> sqr_dists;
 
-                if (this->isVerbose) {
-                    const std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
-                    std::cout << " ?> Done filtering points in " << diff.count() << "s" << std::endl;
-                }
+            // Use a different sequence than the spacing estimation and the verification
+            const auto sampleSeed = seed ^ 0xB0B0ull;
 
+            #pragma omp parallel private (indices, sqr_dists)
+            {
+                indices.resize(count);
+                sqr_dists.resize(count);
+
+                #pragma omp for
+                for (long long i = 0; i < samples; ++i)
+                    sampled[i] = meanDistance(file.points[SplitMix64::at(sampleSeed, i, np)], count, indices, sqr_dists);
             }
-            else {
 
-                start = std::chrono::steady_clock::now();
+            const auto location = locate(sampled);
+
+            const auto minMultiplier = *std::min_element(multipliers.begin(), multipliers.end());
+            const auto maxMultiplier = *std::max_element(multipliers.begin(), multipliers.end());
+
+            const auto lowThreshold = location.threshold(minMultiplier);
+            const auto highThreshold = location.threshold(maxMultiplier);
+
+            // Slightly enlarged to stay on the safe side of the float rounding: the points it misses are
+            // farther than highThreshold
+            const auto maxRadius = static_cast<float>(highThreshold * 1.0001);
+            const auto maxDist = maxRadius * maxRadius;
+
+            size_t inliers = 0;
+            size_t outliers = 0;
+            size_t exact = 0;
+
+            auto& progress = Progress::get();
+
+            #pragma omp parallel private (indices, sqr_dists) reduction(+ : inliers, outliers, exact)
+            {
+                indices.resize(count);
+                sqr_dists.resize(count);
+
+                TraceSpan span("bounded knn");
+
+                auto& counter = progress.local();
 
-                for (size_t i = 0; i < np; ++i)
+                const long long chunks = static_cast<long long>((np + Progress::CHUNK_POINTS - 1) / Progress::CHUNK_POINTS);
+
+                #pragma omp for nowait
+                for (long long c = 0; c < chunks; ++c)
                 {
-                    if (distances[i] < threshold) {
-                        const auto pt = file.points[i];
-                        newPoints.emplace_back(pt.x, pt.y, pt.z, pt.red, pt.green, pt.blue, pt.views);
+                    if (progress.isCancelled())
+                        continue;
+
+                    const size_t begin = c * Progress::CHUNK_POINTS;
+                    const size_t end = std::min(begin + Progress::CHUNK_POINTS, np);
+
+                    for (size_t i = begin; i < end; ++i)
+                    {
+                        const auto& point = file.points[i];
+                        const float pt[3] = { point.x, point.y, point.z };
+
+                        KNNResultSet candidates(count);
+                        candidates.init(&indices.front(), &sqr_dists.front());
+                        tree->findCandidates(candidates, pt, CANDIDATE_LEAVES);
+
+                        auto searchDist = maxDist;
+
+                        if (candidates.full())
+                        {
+                            double upperBound = 0.0;
+                            for (size_t j = 1; j < count; ++j)
+                                upperBound += (std::sqrt(sqr_dists[j]) - upperBound) / j;
+
+                            if (upperBound < lowThreshold)
+                            {
+                                distances[i] = upperBound;
+                                inliers++;
+                                continue;
+                            }
+
+                            // The neighbors are not farther than the candidates (the bound is inclusive)
+                            searchDist = std::min(searchDist, std::nextafter(candidates.worstDist(), std::numeric_limits<float>::max()));
+                        }
+
+                        KNNResultSet neighbors(count);
+                        neighbors.init(&indices.front(), &sqr_dists.front(), searchDist);
+                        tree->findNeighbors(neighbors, pt);
+
+                        if (!neighbors.full())
+                        {
+                            // Every missing neighbor is farther than highThreshold
+                            const auto found = neighbors.size();
+
+                            double lowerBound = (count - found) * highThreshold;
+                            for (size_t j = 1; j < found; ++j)
+                                lowerBound += std::sqrt(sqr_dists[j]);
+
+                            lowerBound /= count - 1;
+
+                            if (lowerBound >= highThreshold)
+                            {
+                                distances[i] = std::numeric_limits<double>::infinity();
+                                outliers++;
+                                continue;
+                            }
+
+                            neighbors.init(&indices.front(), &sqr_dists.front());
+                            tree->findNeighbors(neighbors, pt);
+                        }
+
+                        double distance = 0.0;
+                        for (size_t j = 1; j < count; ++j)
+                            distance += (std::sqrt(sqr_dists[j]) - distance) / j;
+
+                        distances[i] = distance;
+                        exact++;
                     }
 
+                    counter.add(end - begin);
                 }
+            }
 
-                newPoints.shrink_to_fit();
+            progress.check();
 
-                file.points = newPoints;
+            (*stats)["bounded_knn"] = {
+                {"samples", samples},
+                {"resolved_inliers", inliers},
+                {"resolved_outliers", outliers},
+                {"exact", exact}
+            };
 
-                if (this->isVerbose) {
-                    const std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
-                    std::cout << " ?> Done filtering points in " << diff.count() << "s" << std::endl;
-                }
+            if (this->isVerbose)
+                log << " ?> Bounded search: " << inliers << " inliers and " << outliers << " outliers resolved by the bounds, "
+                    << exact << " exact searches" << std::endl;
 
-            }
+            return location;
         }
 
+        // Runs the exact search on a random sample of points and reports how far the approximate
+        // mean distances are from the exact ones, and how many inlier / outlier decisions changed (for the given threshold).
+        // The speedup is only reported when the approximate search ran (approxTimePerPoint is 0 for cached distances)
+        void verify(const PlyFile& file, const FirstTouchVector<double>& distances, size_t count, double threshold, double approxTimePerPoint) const
+        {
+            const size_t np = file.points.size();
+            const size_t samples = std::min(verifySamples, np);
+
+            // Use a different sequence than the spacing estimation
+            SplitMix64 gen(seed ^ 0x5EEDull);
+
+            std::vector<size_t> sampleIndices(samples);
+            for (auto& idx : sampleIndices)
+                idx = gen.next(np);
+
+            std::vector<double> exact(samples, 0.0);
+
+            std::vector<size_t> indices;
+            std::vector<float> sqr_dists;
+
+            const auto start = std::chrono::steady_clock::now();
+
+            #pragma omp parallel private (indices, sqr_dists)
+            {
+                indices.resize(count);
+                sqr_dists.resize(count);
+
+                #pragma omp for
+                for (long long i = 0; i < samples; ++i)
+                    exact[i] = meanDistance(file.points[sampleIndices[i]], count, indices, sqr_dists);
+            }
+
+            const std::chrono::duration<double> exactTime = std::chrono::steady_clock::now() - start;
+            const double exactTimePerPoint = exactTime.count() / samples;
+
+            double errorSum = 0.0;
+            double relativeErrorSum = 0.0;
+            double maxError = 0.0;
+            size_t becameOutliers = 0;
+            size_t becameInliers = 0;
+
+            for (size_t i = 0; i < samples; ++i)
+            {
+                const auto approx = distances[sampleIndices[i]];
+                const auto error = std::abs(approx - exact[i]);
+
+                errorSum += error;
+                if (exact[i] > 0)
+                    relativeErrorSum += error / exact[i];
+                maxError = std::max(maxError, error);
+
+                const bool approxInlier = approx < threshold;
+                const bool exactInlier = exact[i] < threshold;
+
+                if (exactInlier && !approxInlier)
+                    becameOutliers++;
+                else if (!exactInlier && approxInlier)
+                    becameInliers++;
+            }
+
+            const auto meanError = samples > 0 ? errorSum / samples : 0.0;
+            const auto meanRelativeError = samples > 0 ? relativeErrorSum / samples : 0.0;
+            nlohmann::json report = {
+                {"eps", eps},
+                {"samples", samples},
+                {"mean_error", meanError},
+                {"mean_relative_error", meanRelativeError},
+                {"max_error", maxError},
+                {"changed_decisions", becameOutliers + becameInliers},
+                {"inliers_became_outliers", becameOutliers},
+                {"outliers_became_inliers", becameInliers},
+                {"exact_time_per_point", exactTimePerPoint}
+            };
+
+            log << " ?> Approximate kNN (eps = " << eps << ") verified on " << samples << " points: mean error " << meanError
+                << ", " << becameOutliers + becameInliers << " changed decisions";
+
+            if (approxTimePerPoint > 0) {
+                const auto speedup = exactTimePerPoint / approxTimePerPoint;
+
+                report["approx_time_per_point"] = approxTimePerPoint;
+                report["speedup"] = speedup;
+
+                log << ", " << speedup << "x faster";
+            }
+            else
+                log << " (cached distances, no speedup)";
+
+            log << std::endl;
+
+            (*stats)["knn_verification"] = report;
+        }
 
     };
 
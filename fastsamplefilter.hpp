@@ -1,205 +1,128 @@
 #pragma once
 
 #include <iostream>
-#include <map>
-#include <tuple>
 #include <vector>
 #include <omp.h>
 
 #include "ply.hpp"
 #include "common.hpp"
+#include "kdtree.hpp"
+#include "parallel.hpp"
+#include "progress.hpp"
+#include "trace.hpp"
 
 namespace FPCFilter {
 
+    // Poisson disk sampling: a point is kept when no point kept before it is closer than the radius.
+    // The kept points are found with radius queries on the shared index, filtered by the keep flags
+    // written during the run, so the sampler needs no structure of its own. The threads decide their
+    // points concurrently: two close points decided at the very same time do not see each other and
+    // can both be kept (never with a single thread, where the result is the sequential one)
     class FastSampleFilter {
-        using Voxel = PointXYZ<int>;
-        using Coord = PointXYZ<double>;
-        using CoordList = std::vector<Coord>;
 
         std::ostream& log;
 
-        std::map<Voxel, CoordList> voxels;
-
-        double cell;
         double radius;
         double radiusSqr;
-        double originX;
-        double originY;
-        double originZ;
+
+        // Search radius of the index: the single precision distances get a little slack, the exact test
+        // is done in double precision on the points
+        float searchRadiusSqr;
 
         bool isVerbose;
 
     public:
-        FastSampleFilter(double radius, std::ostream& logstream, bool isVerbose) : originX(0), originY(0), originZ(0), 
-                isVerbose(isVerbose), log(logstream), radius(radius), radiusSqr(radius * radius) {
+        FastSampleFilter(double radius, std::ostream& logstream, bool isVerbose) :
+                log(logstream), radius(radius), radiusSqr(radius * radius), isVerbose(isVerbose) {
 
-            cell = 2.0 * radius / std::sqrt(3.0);
+            searchRadiusSqr = static_cast<float>(radiusSqr * (1.0 + 1e-5));
         }
 
-        void run(PlyFile& file) {
-            
-            auto points = file.points;
-            auto extras = file.extras;
-            
-            const auto cnt = points.size();
+        // Returns the compaction that keeps the sampled points. The index must contain the points of the file.
+        // When a subset mask is given, only its points are candidates (a coarser level of detail sampled from
+        // a finer one)
+        Compaction run(const PlyFile& file, const KDTree& index, const std::vector<uint8_t>* subset = nullptr) {
 
-            if (cnt == 0) 
-                return;
-            
-            const auto hasNormals = file.hasNormals();
+            const auto& points = file.points;
 
-            originX = points[0].x;
-            originY = points[0].y;
-            originZ = points[0].z;
+            const auto cnt = points.size();
 
-            if (hasNormals) {
+            if (cnt == 0)
+                return Compaction({});
 
-                std::vector<PlyPoint> newPoints;
-                newPoints.reserve(cnt);
+            std::vector<uint8_t> keep(cnt, 0);
 
-                std::vector<PlyExtra> newExtras;
-                newExtras.reserve(cnt);
+            auto& progress = Progress::get();
+            progress.begin("sample", cnt);
 
-                std::vector<PlyPoint> tmpPoints;
-                tmpPoints.reserve(cnt / omp_get_max_threads());
-                std::vector<PlyExtra> tmpExtras;
-                tmpExtras.reserve(cnt / omp_get_max_threads());
+            #pragma omp parallel
+            {
+                TraceSpan span("sample");
 
-                #pragma omp parallel private (tmpPoints, tmpExtras)
-                {
-                    #pragma omp for
-                    for (auto n = 0; n < cnt; n++) {
+                size_t sampled = 0;
 
-                        const auto& point = points[n];
-                        const auto& extra = extras[n];
+                auto& counter = progress.local();
 
-                        if (this->safe_voxelize(point)) {
-                            tmpPoints.push_back(point);
-                            tmpExtras.push_back(extra);
-                        }
-                    }
+                const long long chunks = static_cast<long long>((cnt + Progress::CHUNK_POINTS - 1) / Progress::CHUNK_POINTS);
 
-                    #pragma omp critical
-                    {
-                        if (this->isVerbose)
-                            log << " ?> Sampled " << tmpPoints.size() << " points in thread " << omp_get_thread_num() << std::endl;
+                #pragma omp for nowait
+                for (long long c = 0; c < chunks; ++c) {
 
-                        newPoints.insert(newPoints.end(), tmpPoints.begin(), tmpPoints.end());
-                        newExtras.insert(newExtras.end(), tmpExtras.begin(), tmpExtras.end());
-                    }
-                }
+                    if (progress.isCancelled())
+                        continue;
+
+                    const size_t begin = c * Progress::CHUNK_POINTS;
+                    const size_t end = std::min(begin + Progress::CHUNK_POINTS, cnt);
 
-                newPoints.shrink_to_fit();
-                newExtras.shrink_to_fit();
+                    for (size_t n = begin; n < end; ++n) {
 
-                file.points = newPoints;
-                file.extras = newExtras;
+                        if (subset != nullptr && !(*subset)[n])
+                            continue;
 
-            } else {
+                        const auto& point = points[n];
+                        const float q[3] = { point.x, point.y, point.z };
 
-                auto res = std::remove_if(points.begin(), points.end(), [this](PlyPoint& point) { return !this->safe_voxelize(point); });
-                points.erase(res, points.end());
-                
-            }
-        }
+                        const auto isCovered = index.radiusAny(q, searchRadiusSqr, [&](size_t id) {
 
-    private:
+                            uint8_t isKept;
 
-        bool safe_voxelize(const PlyPoint& point) {
+                            #pragma omp atomic read
+                            isKept = keep[id];
 
-            double x = point.x;
-            double y = point.y;
-            double z = point.z;
+                            if (!isKept)
+                                return false;
 
-            // Get voxel indices for current point.
-            auto v = Voxel(static_cast<int>(std::floor((x - originX) / cell)), 
-                           static_cast<int>(std::floor((y - originY) / cell)), 
-                           static_cast<int>(std::floor((z - originZ) / cell)));
+                            const auto& other = points[id];
 
-            // Check current voxel before any of the neighbors. We will most often have
-            // points that are too close in the point's enclosing voxel, thus saving
-            // cycles.
-            if (voxels.find(v) != voxels.end())
-            {
-                // Get list of coordinates in candidate voxel.
-                CoordList coords = voxels[v];
-                for (Coord const& coord : coords)
-                {
-                    // Compute Euclidean distance between current point and
-                    // candidate voxel.
-                    double xv = coord.x;
-                    double yv = coord.y;
-                    double zv = coord.z;
-                    double distSqr =
-                        (xv - x) * (xv - x) + (yv - y) * (yv - y) + (zv - z) * (zv - z);
-
-                    // If any point is closer than the minimum radius, we can
-                    // immediately return false, as the minimum distance
-                    // criterion is violated.
-                    if (distSqr < radiusSqr)
-                        return false;
-                }
-            }
+                            const double dx = static_cast<double>(other.x) - point.x;
+                            const double dy = static_cast<double>(other.y) - point.y;
+                            const double dz = static_cast<double>(other.z) - point.z;
 
-            // Iterate over immediate neighbors of current voxel, computing minimum
-            // distance between any already added point and the current point.
-            for (int xi = v.x - 1; xi < v.x + 2; ++xi)
-            {
-                for (int yi = v.y - 1; yi < v.y + 2; ++yi)
-                {
-                    for (int zi = v.z - 1; zi < v.z + 2; ++zi)
-                    {
-                        auto candidate = Voxel(xi, yi, zi);
-
-                        // We have already visited the center voxel, and can skip it.
-                        if (v == candidate)
-                            continue;
+                            return dx * dx + dy * dy + dz * dz < radiusSqr;
+                        });
 
-                        // Check that candidate voxel is occupied.
-                        if (voxels.find(candidate) == voxels.end())
-                            continue;
+                        if (!isCovered) {
+                            #pragma omp atomic write
+                            keep[n] = 1;
 
-                        // Get list of coordinates in candidate voxel.
-                        CoordList coords = voxels[candidate];
-                        for (Coord const& coord : coords)
-                        {
-                            // Compute Euclidean distance between current point and
-                            // candidate voxel.
-                            double xv = coord.x;
-                            double yv = coord.y;
-                            double zv = coord.z;
-                            double distSqr = (xv - x) * (xv - x) + (yv - y) * (yv - y) +
-                                            (zv - z) * (zv - z);
-
-                            // If any point is closer than the minimum radius, we can
-                            // immediately return false, as the minimum distance
-                            // criterion is violated.
-                            if (distSqr < radiusSqr)
-                                return false;
+                            ++sampled;
                         }
                     }
-                }
-            }
 
-            auto coord = Coord(x, y, z);
-
-            #pragma omp critical
-            {
-                if (voxels.find(v) != voxels.end())
-                {
-                    voxels[v].push_back(coord);
+                    counter.add(end - begin);
                 }
-                else
-                {
-                    CoordList coords;
-                    coords.push_back(coord);
-                    voxels.emplace(v, coords);
+
+                if (this->isVerbose) {
+                    #pragma omp critical
+                    log << " ?> Sampled " << sampled << " points in thread " << omp_get_thread_num() << std::endl;
                 }
             }
 
-            return true;
+            progress.check();
+
+            return Compaction(std::move(keep));
         }
-        
+
     };
 
-}
\ No newline at end of file
+}
@@ -0,0 +1,552 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <map>
+#include <numeric>
+#include <vector>
+#include <omp.h>
+
+#include "ply.hpp"
+#include "simd.hpp"
+#include "parallel.hpp"
+
+#define DEFAULT_LEAF_SIZE 32
+
+namespace FPCFilter {
+
+    // Keeps the k closest candidates sorted by squared distance (same semantics of nanoflann::KNNResultSet)
+    class KNNResultSet {
+
+        size_t* indices;
+        float* dists;
+        size_t capacity;
+        size_t count;
+
+    public:
+        KNNResultSet(size_t capacity) : indices(nullptr), dists(nullptr), capacity(capacity), count(0) {}
+
+        // Only the points closer than maxDist (squared) are accepted
+        void init(size_t* indices, float* dists, float maxDist = std::numeric_limits<float>::max())
+        {
+            this->indices = indices;
+            this->dists = dists;
+            this->count = 0;
+
+            if (capacity)
+                dists[capacity - 1] = maxDist;
+        }
+
+        size_t size() const { return count; }
+
+        bool full() const { return count == capacity; }
+
+        float worstDist() const { return dists[capacity - 1]; }
+
+        void addPoint(float dist, size_t index)
+        {
+            size_t i;
+            for (i = count; i > 0; --i)
+            {
+                if (dists[i - 1] > dist)
+                {
+                    if (i < capacity)
+                    {
+                        dists[i] = dists[i - 1];
+                        indices[i] = indices[i - 1];
+                    }
+                }
+                else
+                    break;
+            }
+
+            if (i < capacity)
+            {
+                dists[i] = dist;
+                indices[i] = index;
+            }
+
+            if (count < capacity)
+                count++;
+        }
+    };
+
+    // Static 3D kd-tree working in single precision.
+    // The coordinates are copied in tree order and stored as structure of arrays, so every leaf bucket
+    // is a contiguous run of xs / ys / zs that is scanned with the SIMD kernels in simd.hpp.
+    // Nodes are laid out in depth-first order: the left child of a node always follows it.
+    class KDTree {
+
+    public:
+        static constexpr size_t MAX_LEAF_SIZE = 256;
+
+    private:
+        // Ranges bigger than this are split in parallel tasks
+        static constexpr size_t PARALLEL_BUILD_THRESHOLD = 65536;
+
+        struct Node {
+            float lo[3];
+            float hi[3];
+
+            // First point of the node in the SoA arrays
+            size_t begin;
+
+            // Number of live points in the node: the points of a leaf are [begin, begin + count)
+            size_t count;
+
+            // Index of the right child, 0 for leaves
+            size_t right;
+        };
+
+        std::vector<float> xs, ys, zs;
+        std::vector<size_t> ids;
+        std::vector<Node> nodes;
+
+        // Number of points the ids refer to (the size of the point array that is indexed)
+        size_t pointCount = 0;
+
+        size_t leafSize;
+
+        // Number of nodes of a subtree by range size, filled before building so that the tasks can
+        // place their children without synchronization. Only a couple of distinct sizes appear at each depth.
+        std::map<size_t, size_t> nodeCounts;
+
+        size_t countNodes(size_t size)
+        {
+            const auto it = nodeCounts.find(size);
+            if (it != nodeCounts.end())
+                return it->second;
+
+            const size_t cnt = size <= leafSize ? 1 : 1 + countNodes(size / 2) + countNodes(size - size / 2);
+            nodeCounts[size] = cnt;
+
+            return cnt;
+        }
+
+        static float coord(const PlyPoint& pt, int axis)
+        {
+            return axis == 0 ? pt.x : (axis == 1 ? pt.y : pt.z);
+        }
+
+        void split(const std::vector<PlyPoint>& points, size_t nodeIdx, size_t begin, size_t end, std::array<float, 3> lo, std::array<float, 3> hi)
+        {
+            auto& node = nodes[nodeIdx];
+
+            node.begin = begin;
+            node.count = end - begin;
+            node.right = 0;
+
+            const auto size = end - begin;
+
+            if (size <= leafSize)
+                return;
+
+            // Split along the widest extent of the (loose) bounding box
+            int axis = 0;
+            for (int d = 1; d < 3; ++d)
+                if (hi[d] - lo[d] > hi[axis] - lo[axis])
+                    axis = d;
+
+            const auto mid = begin + size / 2;
+
+            std::nth_element(ids.begin() + begin, ids.begin() + mid, ids.begin() + end, [&points, axis](size_t a, size_t b) {
+                return coord(points[a], axis) < coord(points[b], axis);
+            });
+
+            const auto value = coord(points[ids[mid]], axis);
+
+            const auto left = nodeIdx + 1;
+            const auto right = left + nodeCounts.at(mid - begin);
+            node.right = right;
+
+            auto leftHi = hi;
+            leftHi[axis] = value;
+            auto rightLo = lo;
+            rightLo[axis] = value;
+
+            if (size > PARALLEL_BUILD_THRESHOLD)
+            {
+                #pragma omp task
+                split(points, left, begin, mid, lo, leftHi);
+
+                #pragma omp task
+                split(points, right, mid, end, rightLo, hi);
+
+                #pragma omp taskwait
+            }
+            else
+            {
+                split(points, left, begin, mid, lo, leftHi);
+                split(points, right, mid, end, rightLo, hi);
+            }
+        }
+
+        // Computes the tight bounding boxes and the live counts bottom-up, once the coordinates are in tree order.
+        // The bounds of an empty node are inverted, so every distance to it is infinite
+        void fitBounds(size_t nodeIdx)
+        {
+            auto& node = nodes[nodeIdx];
+
+            if (node.right == 0)
+            {
+                node.lo[0] = node.lo[1] = node.lo[2] = std::numeric_limits<float>::max();
+                node.hi[0] = node.hi[1] = node.hi[2] = std::numeric_limits<float>::lowest();
+
+                for (size_t i = node.begin; i < node.begin + node.count; ++i)
+                {
+                    node.lo[0] = std::min(node.lo[0], xs[i]);
+                    node.lo[1] = std::min(node.lo[1], ys[i]);
+                    node.lo[2] = std::min(node.lo[2], zs[i]);
+                    node.hi[0] = std::max(node.hi[0], xs[i]);
+                    node.hi[1] = std::max(node.hi[1], ys[i]);
+                    node.hi[2] = std::max(node.hi[2], zs[i]);
+                }
+
+                return;
+            }
+
+            if (node.count > PARALLEL_BUILD_THRESHOLD)
+            {
+                #pragma omp task
+                fitBounds(nodeIdx + 1);
+
+                #pragma omp task
+                fitBounds(node.right);
+
+                #pragma omp taskwait
+            }
+            else
+            {
+                fitBounds(nodeIdx + 1);
+                fitBounds(node.right);
+            }
+
+            const auto& l = nodes[nodeIdx + 1];
+            const auto& r = nodes[node.right];
+
+            for (int d = 0; d < 3; ++d)
+            {
+                node.lo[d] = std::min(l.lo[d], r.lo[d]);
+                node.hi[d] = std::max(l.hi[d], r.hi[d]);
+            }
+
+            node.count = l.count + r.count;
+        }
+
+        static float boxDistance(const Node& node, const float* q)
+        {
+            float dist = 0;
+
+            for (int d = 0; d < 3; ++d)
+            {
+                const float delta = q[d] < node.lo[d] ? node.lo[d] - q[d] : (q[d] > node.hi[d] ? q[d] - node.hi[d] : 0.0f);
+                dist += delta * delta;
+            }
+
+            return dist;
+        }
+
+        template <class ResultSet>
+        void searchLevel(ResultSet& result, const float* q, size_t nodeIdx, float epsError, size_t* leafBudget) const
+        {
+            const auto& node = nodes[nodeIdx];
+
+            if (node.right == 0)
+            {
+                if (leafBudget != nullptr)
+                {
+                    if (*leafBudget == 0)
+                        return;
+
+                    --*leafBudget;
+                }
+
+                alignas(32) float dists[MAX_LEAF_SIZE];
+
+                const auto cnt = node.count;
+
+                simd::squaredDistances(&xs[node.begin], &ys[node.begin], &zs[node.begin], cnt, q[0], q[1], q[2], dists);
+
+                for (size_t j = 0; j < cnt; ++j)
+                {
+                    if (dists[j] < result.worstDist())
+                        result.addPoint(dists[j], ids[node.begin + j]);
+                }
+
+                return;
+            }
+
+            const auto left = nodeIdx + 1;
+            const auto right = node.right;
+
+            const auto leftDist = boxDistance(nodes[left], q);
+            const auto rightDist = boxDistance(nodes[right], q);
+
+            // Visit the closest child first
+            const auto first = leftDist <= rightDist ? left : right;
+            const auto second = leftDist <= rightDist ? right : left;
+            const auto firstDist = std::min(leftDist, rightDist);
+            const auto secondDist = std::max(leftDist, rightDist);
+
+            if (firstDist * epsError <= result.worstDist())
+                searchLevel(result, q, first, epsError, leafBudget);
+
+            if (secondDist * epsError <= result.worstDist())
+                searchLevel(result, q, second, epsError, leafBudget);
+        }
+
+        static float farBoxDistance(const Node& node, const float* q)
+        {
+            float dist = 0;
+
+            for (int d = 0; d < 3; ++d)
+            {
+                const float delta = std::max(q[d] - node.lo[d], node.hi[d] - q[d]);
+                dist += delta * delta;
+            }
+
+            return dist;
+        }
+
+        // Returns true as soon as maxCount points within the radius have been counted
+        bool countLevel(const float* q, size_t nodeIdx, float radiusSqr, size_t maxCount, size_t& count) const
+        {
+            const auto& node = nodes[nodeIdx];
+
+            // The whole node is inside the sphere, no need to look at its points
+            if (farBoxDistance(node, q) <= radiusSqr)
+            {
+                count += node.count;
+                return count >= maxCount;
+            }
+
+            if (node.right == 0)
+            {
+                alignas(32) float dists[MAX_LEAF_SIZE];
+
+                const auto cnt = node.count;
+
+                simd::squaredDistances(&xs[node.begin], &ys[node.begin], &zs[node.begin], cnt, q[0], q[1], q[2], dists);
+
+                for (size_t j = 0; j < cnt; ++j)
+                {
+                    if (dists[j] <= radiusSqr && ++count >= maxCount)
+                        return true;
+                }
+
+                return false;
+            }
+
+            const auto left = nodeIdx + 1;
+            const auto right = node.right;
+
+            const auto leftDist = boxDistance(nodes[left], q);
+            const auto rightDist = boxDistance(nodes[right], q);
+
+            const auto first = leftDist <= rightDist ? left : right;
+            const auto second = leftDist <= rightDist ? right : left;
+
+            if (std::min(leftDist, rightDist) <= radiusSqr && countLevel(q, first, radiusSqr, maxCount, count))
+                return true;
+
+            if (std::max(leftDist, rightDist) <= radiusSqr && countLevel(q, second, radiusSqr, maxCount, count))
+                return true;
+
+            return false;
+        }
+
+        // Returns true as soon as match accepts the id of a point within the radius
+        template <class Predicate>
+        bool anyLevel(const float* q, size_t nodeIdx, float radiusSqr, Predicate& match) const
+        {
+            const auto& node = nodes[nodeIdx];
+
+            if (node.right == 0)
+            {
+                alignas(32) float dists[MAX_LEAF_SIZE];
+
+                const auto cnt = node.count;
+
+                simd::squaredDistances(&xs[node.begin], &ys[node.begin], &zs[node.begin], cnt, q[0], q[1], q[2], dists);
+
+                for (size_t j = 0; j < cnt; ++j)
+                {
+                    if (dists[j] <= radiusSqr && match(ids[node.begin + j]))
+                        return true;
+                }
+
+                return false;
+            }
+
+            const auto left = nodeIdx + 1;
+            const auto right = node.right;
+
+            const auto leftDist = boxDistance(nodes[left], q);
+            const auto rightDist = boxDistance(nodes[right], q);
+
+            const auto first = leftDist <= rightDist ? left : right;
+            const auto second = leftDist <= rightDist ? right : left;
+
+            if (std::min(leftDist, rightDist) <= radiusSqr && anyLevel(q, first, radiusSqr, match))
+                return true;
+
+            return std::max(leftDist, rightDist) <= radiusSqr && anyLevel(q, second, radiusSqr, match);
+        }
+
+    public:
+
+        KDTree(const std::vector<PlyPoint>& points, size_t leafSize = DEFAULT_LEAF_SIZE) : leafSize(std::clamp<size_t>(leafSize, 1, MAX_LEAF_SIZE))
+        {
+            const auto n = points.size();
+
+            pointCount = n;
+
+            if (n == 0)
+                return;
+
+            ids.resize(n);
+            std::iota(ids.begin(), ids.end(), 0);
+
+            nodes.resize(countNodes(n));
+
+            std::array<float, 3> lo = { std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max() };
+            std::array<float, 3> hi = { std::numeric_limits<float>::lowest(), std::numeric_limits<float>::lowest(), std::numeric_limits<float>::lowest() };
+
+            for (const auto& pt : points)
+            {
+                lo[0] = std::min(lo[0], pt.x); hi[0] = std::max(hi[0], pt.x);
+                lo[1] = std::min(lo[1], pt.y); hi[1] = std::max(hi[1], pt.y);
+                lo[2] = std::min(lo[2], pt.z); hi[2] = std::max(hi[2], pt.z);
+            }
+
+            #pragma omp parallel
+            #pragma omp single
+            split(points, 0, 0, n, lo, hi);
+
+            xs.resize(n);
+            ys.resize(n);
+            zs.resize(n);
+
+            #pragma omp parallel for
+            for (long long i = 0; i < n; ++i)
+            {
+                const auto& pt = points[ids[i]];
+                xs[i] = pt.x;
+                ys[i] = pt.y;
+                zs[i] = pt.z;
+            }
+
+            #pragma omp parallel
+            #pragma omp single
+            fitBounds(0);
+        }
+
+        // Number of live points
+        size_t size() const { return nodes.empty() ? 0 : nodes[0].count; }
+
+        // Bytes allocated by the index
+        size_t memoryUsage() const
+        {
+            return (xs.capacity() + ys.capacity() + zs.capacity()) * sizeof(float) + ids.capacity() * sizeof(size_t) + nodes.capacity() * sizeof(Node);
+        }
+
+        // Applies to the index the compaction applied to the indexed points: the removed points are
+        // dropped from their leaf buckets (tombstoned, without rebuilding the tree) and the ids of
+        // the others are renumbered to their new position
+        void compact(const Compaction& compaction)
+        {
+            if (compaction.mask().size() != pointCount)
+                throw std::invalid_argument("The compaction does not match the indexed points");
+
+            pointCount = compaction.size();
+
+            if (nodes.empty())
+                return;
+
+            const auto remap = compaction.indexMap();
+
+            #pragma omp parallel for schedule(dynamic, 1024)
+            for (long long n = 0; n < nodes.size(); ++n)
+            {
+                auto& node = nodes[n];
+
+                if (node.right != 0)
+                    continue;
+
+                auto w = node.begin;
+                for (auto i = node.begin; i < node.begin + node.count; ++i)
+                {
+                    const auto id = remap[ids[i]];
+
+                    if (id == Compaction::REMOVED)
+                        continue;
+
+                    xs[w] = xs[i];
+                    ys[w] = ys[i];
+                    zs[w] = zs[i];
+                    ids[w] = id;
+                    ++w;
+                }
+
+                node.count = w - node.begin;
+            }
+
+            #pragma omp parallel
+            #pragma omp single
+            fitBounds(0);
+        }
+
+        // Finds the neighbors of the query point q. With eps > 0 the search is approximate: a subtree is
+        // skipped unless its squared distance times (1 + eps) can improve the current worst candidate
+        template <class ResultSet>
+        void findNeighbors(ResultSet& result, const float* q, float eps = 0) const
+        {
+            if (nodes.empty())
+                return;
+
+            searchLevel(result, q, 0, 1.0f + eps, nullptr);
+        }
+
+        // Same as findNeighbors, but gives up after scanning maxLeaves leaf buckets (the closest first).
+        // The result is then made of candidates: their distances are upper bounds of the true neighbors ones
+        template <class ResultSet>
+        void findCandidates(ResultSet& result, const float* q, size_t maxLeaves) const
+        {
+            if (nodes.empty())
+                return;
+
+            searchLevel(result, q, 0, 1.0f, &maxLeaves);
+        }
+
+        void knnSearch(const float* q, size_t k, size_t* indices, float* sqrDists, float eps = 0) const
+        {
+            KNNResultSet resultSet(k);
+            resultSet.init(indices, sqrDists);
+
+            findNeighbors(resultSet, q, eps);
+        }
+
+        // Counts the points within the radius (the query point included, if it belongs to the tree).
+        // The search stops as soon as maxCount points are found, so the result is capped to maxCount
+        size_t radiusCount(const float* q, float radiusSqr, size_t maxCount) const
+        {
+            size_t count = 0;
+
+            if (!nodes.empty() && maxCount > 0)
+                countLevel(q, 0, radiusSqr, maxCount, count);
+
+            return std::min(count, maxCount);
+        }
+
+        // Returns true if match(id) holds for a point within the radius. The points are visited closest
+        // subtree first and the search stops at the first match
+        template <class Predicate>
+        bool radiusAny(const float* q, float radiusSqr, Predicate match) const
+        {
+            return !nodes.empty() && anyLevel(q, 0, radiusSqr, match);
+        }
+    };
+
+}
@@ -0,0 +1,235 @@
+#include "libfpcfilter.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <omp.h>
+
+#include "FPCFilter.h"
+#include "pipeline.hpp"
+
+namespace {
+
+	thread_local std::string lastError;
+
+	int fail(int code, const char* message)
+	{
+		lastError = message;
+		return code;
+	}
+
+	// Serializes the runs: the progress and cancellation state is process wide and the stages size their
+	// per thread buffers on the number of threads set for the run
+	std::mutex runMutex;
+
+	// The pipeline works on its own point layout, so the caller buffers are copied in (in parallel, once)
+	std::unique_ptr<FPCFilter::PlyFile> copyCloud(const fpcfilter_cloud& cloud)
+	{
+		const auto count = cloud.count;
+
+		std::vector<FPCFilter::PlyPoint> points(count);
+
+		#pragma omp parallel for schedule(static)
+		for (long long i = 0; i < count; ++i)
+		{
+			const auto xyz = cloud.xyz + i * 3;
+			const auto rgb = cloud.rgb != nullptr ? cloud.rgb + i * 3 : nullptr;
+
+			points[i] = FPCFilter::PlyPoint(xyz[0], xyz[1], xyz[2],
+				rgb != nullptr ? rgb[0] : 0, rgb != nullptr ? rgb[1] : 0, rgb != nullptr ? rgb[2] : 0,
+				cloud.views != nullptr ? cloud.views[i] : 0);
+		}
+
+		std::vector<FPCFilter::PlyExtra> extras;
+
+		if (cloud.normals != nullptr)
+		{
+			extras.resize(count);
+
+			#pragma omp parallel for schedule(static)
+			for (long long i = 0; i < count; ++i)
+				extras[i] = FPCFilter::PlyExtra(cloud.normals[i * 3], cloud.normals[i * 3 + 1], cloud.normals[i * 3 + 2]);
+		}
+
+		return std::make_unique<FPCFilter::PlyFile>(std::move(points), std::move(extras));
+	}
+
+	// Copies the survivors back to the beginning of the caller buffers. They are read from the pipeline copy,
+	// so the positions are independent and the copy is parallel
+	void copySurvivors(const FPCFilter::PlyFile& file, fpcfilter_cloud& cloud)
+	{
+		const auto& points = file.points;
+		const auto count = points.size();
+
+		#pragma omp parallel for schedule(static)
+		for (long long k = 0; k < count; ++k)
+		{
+			const auto& point = points[k];
+
+			cloud.xyz[k * 3] = point.x;
+			cloud.xyz[k * 3 + 1] = point.y;
+			cloud.xyz[k * 3 + 2] = point.z;
+
+			if (cloud.rgb != nullptr) {
+				cloud.rgb[k * 3] = point.red;
+				cloud.rgb[k * 3 + 1] = point.green;
+				cloud.rgb[k * 3 + 2] = point.blue;
+			}
+
+			if (cloud.normals != nullptr) {
+				const auto& extra = file.extras[k];
+
+				cloud.normals[k * 3] = extra.nx;
+				cloud.normals[k * 3 + 1] = extra.ny;
+				cloud.normals[k * 3 + 2] = extra.nz;
+			}
+
+			if (cloud.views != nullptr)
+				cloud.views[k] = point.views;
+		}
+
+		cloud.count = count;
+	}
+
+	void runPipeline(FPCFilter::Pipeline& pipeline, const fpcfilter_options& options)
+	{
+		if (options.boundary_count > 0)
+		{
+			FPCFilter::Polygon polygon;
+
+			for (size_t i = 0; i < options.boundary_count; ++i)
+				polygon.addPoint(static_cast<float>(options.boundary[i * 2]), static_cast<float>(options.boundary[i * 2 + 1]));
+
+			pipeline.crop(polygon);
+		}
+
+		if (options.sample_radius > 0)
+			pipeline.sample(options.sample_radius);
+
+		if (options.min_neighbors > 0)
+			pipeline.radiusFilter(options.min_neighbors,
+				options.neighbors_radius > 0 ? std::optional<double>(options.neighbors_radius) : std::nullopt);
+
+		if (options.std > 0 && options.meank > 1)
+			pipeline.filter({ options.std }, options.meank, 0, 0, "", 0,
+				options.threshold_mode == FPCFILTER_THRESHOLD_MAD ? FPCFilter::ThresholdMode::Mad : FPCFilter::ThresholdMode::Stdev);
+	}
+}
+
+extern "C" {
+
+	void fpcfilter_default_options(fpcfilter_options* options)
+	{
+		if (options == nullptr)
+			return;
+
+		std::memset(options, 0, sizeof(fpcfilter_options));
+		options->threshold_mode = FPCFILTER_THRESHOLD_STDEV;
+	}
+
+	int fpcfilter_run(fpcfilter_cloud* cloud, const fpcfilter_options* options, size_t** survivors, char** stats)
+	{
+		lastError.clear();
+
+		if (cloud == nullptr || options == nullptr)
+			return fail(FPCFILTER_ERROR_INVALID_ARGUMENT, "Cloud and options cannot be NULL");
+
+		if (cloud->count > 0 && cloud->xyz == nullptr)
+			return fail(FPCFILTER_ERROR_INVALID_ARGUMENT, "Cloud coordinates cannot be NULL");
+
+		if (options->boundary_count > 0 && (options->boundary == nullptr || options->boundary_count < 3))
+			return fail(FPCFILTER_ERROR_INVALID_ARGUMENT, "Crop boundary must have at least 3 vertexes");
+
+		if (options->sample_radius < 0 || options->std < 0 || options->neighbors_radius < 0)
+			return fail(FPCFILTER_ERROR_INVALID_ARGUMENT, "Radius and standard deviation threshold cannot be less than 0");
+
+		if (options->min_neighbors < 0 || options->meank < 0 || options->concurrency < 0)
+			return fail(FPCFILTER_ERROR_INVALID_ARGUMENT, "Number of neighbors and concurrency cannot be less than 0");
+
+		std::lock_guard<std::mutex> lock(runMutex);
+
+		const auto threads = omp_get_max_threads();
+
+		if (options->concurrency > 0)
+			omp_set_num_threads(options->concurrency);
+
+		std::ostream silent(nullptr);
+		std::ostream& log = options->verbose ? std::cerr : silent;
+
+		int result = FPCFILTER_OK;
+
+		try {
+
+			nlohmann::json json = nlohmann::json::object();
+
+			FPCFilter::Pipeline pipeline(copyCloud(*cloud), log, options->verbose != 0, &json, options->seed);
+
+			runPipeline(pipeline, *options);
+
+			const auto& ids = pipeline.survivors();
+
+			// Allocate the outputs first: the caller buffers are left untouched on failure
+			size_t* survivorsOut = nullptr;
+			char* statsOut = nullptr;
+
+			if (survivors != nullptr)
+			{
+				survivorsOut = static_cast<size_t*>(std::malloc(std::max<size_t>(1, ids.size()) * sizeof(size_t)));
+
+				if (survivorsOut == nullptr)
+					throw std::bad_alloc();
+
+				std::copy(ids.begin(), ids.end(), survivorsOut);
+			}
+
+			if (stats != nullptr)
+			{
+				const auto dump = json.dump();
+				statsOut = static_cast<char*>(std::malloc(dump.size() + 1));
+
+				if (statsOut == nullptr) {
+					std::free(survivorsOut);
+					throw std::bad_alloc();
+				}
+
+				std::memcpy(statsOut, dump.c_str(), dump.size() + 1);
+			}
+
+			copySurvivors(pipeline.cloud(), *cloud);
+
+			if (survivors != nullptr)
+				*survivors = survivorsOut;
+
+			if (stats != nullptr)
+				*stats = statsOut;
+		}
+		catch (const std::invalid_argument& e) {
+			result = fail(FPCFILTER_ERROR_INVALID_ARGUMENT, e.what());
+		}
+		catch (const std::exception& e) {
+			result = fail(FPCFILTER_ERROR, e.what());
+		}
+
+		omp_set_num_threads(threads);
+
+		return result;
+	}
+
+	void fpcfilter_free(void* ptr)
+	{
+		std::free(ptr);
+	}
+
+	const char* fpcfilter_last_error(void)
+	{
+		return lastError.c_str();
+	}
+
+	const char* fpcfilter_version(void)
+	{
+		static const std::string version = std::to_string(FPCFilter_VERSION_MAJOR) + "." + std::to_string(FPCFilter_VERSION_MINOR);
+		return version.c_str();
+	}
+}
@@ -0,0 +1,97 @@
+#ifndef LIBFPCFILTER_H
+#define LIBFPCFILTER_H
+
+/*
+ * FPCFilter C API
+ *
+ * Runs the crop -> sample -> radius filter -> statistical filter pipeline on a point cloud that the caller
+ * already has in memory. The caller owns the buffers: on success they are compacted in place (order
+ * preserving) to the surviving points, and the original index of every survivor is returned.
+ *
+ * The pipeline works on its own point layout: the points are copied in (one copy, in parallel, no disk
+ * round trip) and the survivors are copied back into the caller buffers.
+ *
+ * fpcfilter_run is not reentrant (the progress state is process wide): concurrent calls from several
+ * threads are serialized, and every run uses the whole thread pool.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32) && defined(FPCFILTER_SHARED)
+#  ifdef FPCFILTER_EXPORTS
+#    define FPCFILTER_API __declspec(dllexport)
+#  else
+#    define FPCFILTER_API __declspec(dllimport)
+#  endif
+#elif defined(__GNUC__)
+#  define FPCFILTER_API __attribute__((visibility("default")))
+#else
+#  define FPCFILTER_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FPCFILTER_OK 0
+#define FPCFILTER_ERROR_INVALID_ARGUMENT 1
+#define FPCFILTER_ERROR 2
+
+#define FPCFILTER_THRESHOLD_STDEV 0
+#define FPCFILTER_THRESHOLD_MAD 1
+
+/* Caller owned buffers. Only xyz is required, the others can be NULL */
+typedef struct fpcfilter_cloud {
+    size_t count;
+    float* xyz;       /* 3 * count, x y z interleaved */
+    uint8_t* rgb;     /* 3 * count, r g b interleaved */
+    float* normals;   /* 3 * count, nx ny nz interleaved */
+    uint8_t* views;   /* count */
+} fpcfilter_cloud;
+
+/* A stage is skipped when its main parameter is 0 (see fpcfilter_default_options) */
+typedef struct fpcfilter_options {
+    const double* boundary;   /* crop polygon, x y interleaved */
+    size_t boundary_count;    /* number of polygon vertexes, 0 = no crop */
+
+    double sample_radius;     /* 0 = no sampling */
+
+    int min_neighbors;        /* radius filter, 0 = no radius filter */
+    double neighbors_radius;  /* 0 = estimated from the point spacing */
+
+    double std;               /* statistical filter, 0 = no statistical filter */
+    int meank;
+    int threshold_mode;       /* FPCFILTER_THRESHOLD_STDEV or FPCFILTER_THRESHOLD_MAD */
+
+    uint64_t seed;
+    int concurrency;          /* 0 = all the processors */
+    int verbose;              /* log to stderr */
+} fpcfilter_options;
+
+FPCFILTER_API void fpcfilter_default_options(fpcfilter_options* options);
+
+/*
+ * Filters the cloud in place: on success cloud->count is the number of survivors and the first
+ * cloud->count elements of every buffer are the surviving points.
+ *
+ * survivors (optional) receives the original index of every survivor, to be released with fpcfilter_free.
+ * stats (optional) receives the statistics as a JSON string, to be released with fpcfilter_free.
+ *
+ * Returns FPCFILTER_OK, or an error code (see fpcfilter_last_error). The buffers are left untouched on failure
+ */
+FPCFILTER_API int fpcfilter_run(fpcfilter_cloud* cloud, const fpcfilter_options* options, size_t** survivors, char** stats);
+
+FPCFILTER_API void fpcfilter_free(void* ptr);
+
+/* Message of the error of the last fpcfilter_run of the calling thread, empty if it succeeded */
+FPCFILTER_API const char* fpcfilter_last_error(void);
+
+/* Library version, as "major.minor" */
+FPCFILTER_API const char* fpcfilter_version(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -4,110 +4,303 @@
 #include "FPCFilter.h"
 #include "pipeline.hpp"
 #include "parameters.hpp"
-
-int main(const int argc, char** argv)
+#include "plan.hpp"
+#include "batch.hpp"
+#include "server.hpp"
+#include "perfcounters.hpp"
+#include "progress.hpp"
+#include "trace.hpp"
+
+// Runs the stages on one input (the stage options, or the pipeline description when plan is set)
+static void process(const FPCFilter::Parameters& parameters, const FPCFilter::Plan* plan, const std::string& input, const std::string& output, std::ostream& out, nlohmann::json& stats)
 {
-	std::cout << " *** FPCFilter - v" << FPCFilter_VERSION_MAJOR << "." << FPCFilter_VERSION_MINOR << " ***" << std::endl << std::endl;
-
-	try {
-
-		FPCFilter::Parameters parameters(argc, argv);
+	const auto pipelineStart = std::chrono::steady_clock::now();
 
-        std::cout << "?> Parameters:" << std::endl;
-        std::cout << "\tinput = " << parameters.input << std::endl;
-        std::cout << "\toutput = " << parameters.output << std::endl;
+	FPCFilter::Pipeline pipeline(input, out, parameters.verbose, &stats, parameters.seed);
 
-		if (!parameters.stats.empty()) std::cout << "\tstats = " << parameters.stats << std::endl;
-		nlohmann::json stats = nlohmann::json::object();
+	if (plan)
+		plan->run(pipeline, out, &stats);
+	else
+	{
+		if (parameters.isCropRequested)
+		{
 
-		if (parameters.std.has_value())
-			std::cout << "\tstd = " << std::setprecision(4) << parameters.std.value() << std::endl;
-		if (parameters.radius.has_value())
-			std::cout << "\tradius = " << std::setprecision(4) << parameters.radius.value() << std::endl;
-		if (parameters.meank.has_value())
-			std::cout << "\tmeanK = " << parameters.meank.value() << std::endl;
+			out << std::endl << " -> Cropping" << std::endl << std::endl;;
 
-		if (parameters.boundary.has_value()) 
-			std::cout << "\tboundary = " << parameters.boundary.value().getPoints().size() << " polygon vertexes" << std::endl;		
-		else 
-			std::cout << "\tboundary = auto" << std::endl;
-		
-        std::cout << "\tconcurrency = " << parameters.concurrency << std::endl;
-        std::cout << "\tverbose = " << (parameters.verbose ? "yes" : "no") << std::endl;
-		std::cout << std::endl;
+			const auto start = std::chrono::steady_clock::now();
 
-		std::cout << " -> Setting num_threads to " << parameters.concurrency << std::endl;
-		omp_set_num_threads(parameters.concurrency);
+			pipeline.crop(parameters.boundary.value());
 
-		const auto pipelineStart = std::chrono::steady_clock::now();
+			const std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
 
-		FPCFilter::Pipeline pipeline(parameters.input, std::cout, parameters.verbose, &stats);
+			out << " -> Done cropping in " << diff.count() << "s" << std::endl;
 
-		if (parameters.isCropRequested)
+		} else		
+			out << std::endl << " ?> Skipping crop" << std::endl;
+	
+		if (parameters.isDedupRequested)
 		{
 
-			std::cout << std::endl << " -> Cropping" << std::endl << std::endl;;
+			out << std::endl << " -> Removing duplicates" << std::endl << std::endl;
 
 			const auto start = std::chrono::steady_clock::now();
 
-			pipeline.crop(parameters.boundary.value());
+			pipeline.dedup(parameters.dedupMethod, parameters.dedupMerge);
 
 			const std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
 
-			std::cout << " -> Done cropping in " << diff.count() << "s" << std::endl;
+			out << " ?> Done in " << diff.count() << "s" << std::endl;
+
+		}
+		else
+			out << std::endl << " ?> Skipping duplicates removal" << std::endl;
 
-		} else		
-			std::cout << std::endl << " ?> Skipping crop" << std::endl;
-		
 		if (parameters.isSampleRequested)
 		{
 
-			std::cout << std::endl << " -> Sampling" << std::endl << std::endl;
+			out << std::endl << " -> Sampling" << std::endl << std::endl;
 
 			const auto start = std::chrono::steady_clock::now();
 
-			pipeline.sample(parameters.radius.value());
+			pipeline.sample(parameters.radius.front());
 
 			const std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
 
-			std::cout << " ?> Done in " << diff.count() << "s" << std::endl;
+			out << " ?> Done in " << diff.count() << "s" << std::endl;
 
 		}
 		else		
-			std::cout << std::endl << " ?> Skipping sampling" << std::endl;
-		
+			out << std::endl << " ?> Skipping sampling" << std::endl;
+	
+		if (parameters.isRadiusFilterRequested)
+		{
+
+			out << std::endl << " -> Radius filtering" << std::endl << std::endl;
+
+			const auto start = std::chrono::steady_clock::now();
+
+			pipeline.radiusFilter(parameters.minNeighbors.value(), parameters.neighborsRadius);
+
+			const std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
+
+			out << " ?> Done in " << diff.count() << "s" << std::endl;
+
+		}
+		else
+			out << std::endl << " ?> Skipping radius filtering" << std::endl;
+
 		if (parameters.isFilterRequested)
 		{
 
-			std::cout << std::endl << " -> Statistical filtering" << std::endl << std::endl;;
+			out << std::endl << " -> Statistical filtering" << std::endl << std::endl;;
 
 			const auto start = std::chrono::steady_clock::now();
 
-			pipeline.filter(parameters.std.value(), parameters.meank.value());
+			pipeline.filter(parameters.std, parameters.meank.value(), parameters.knnEps, parameters.knnVerify, parameters.distanceCache, parameters.boundedKnn, parameters.thresholdMode);
 
 			const std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
 
-			std::cout << " ?> Done in " << diff.count() << "s" << std::endl;
+			out << " ?> Done in " << diff.count() << "s" << std::endl;
 
 		}
 		else		
-			std::cout << std::endl << " ?> Skipping statistical filtering" << std::endl;
+			out << std::endl << " ?> Skipping statistical filtering" << std::endl;
 
+		if (parameters.isNormalsRequested)
 		{
-			std::cout << std::endl << " -> Writing output" << std::endl << std::endl;
+
+			out << std::endl << " -> Estimating normals" << std::endl << std::endl;
 
 			const auto start = std::chrono::steady_clock::now();
 
-			pipeline.write(parameters.output);
+			pipeline.estimateNormals(parameters.normalsNeighbors, parameters.normalsOrientation);
 
 			const std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
 
-			std::cout << " ?> Done in " << diff.count() << "s" << std::endl;
+			out << " ?> Done in " << diff.count() << "s" << std::endl;
+
 		}
+		else
+			out << std::endl << " ?> Skipping normals estimation" << std::endl;
+
+		if (parameters.radius.size() > 1)
+		{
+
+			out << std::endl << " -> Sampling levels of detail" << std::endl << std::endl;
+
+			const auto start = std::chrono::steady_clock::now();
+
+			pipeline.levelsOfDetail(parameters.radius);
+
+			const std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
+
+			out << " ?> Done in " << diff.count() << "s" << std::endl;
+
+		}
+	}
+
+	{
+		out << std::endl << " -> Writing output" << std::endl << std::endl;
+
+		const auto start = std::chrono::steady_clock::now();
 
-		const std::chrono::duration<double> pipelineDiff = std::chrono::steady_clock::now() - pipelineStart;
+		pipeline.write(output);
 
-		std::cout << std::endl << " ?> Pipeline done in " << pipelineDiff.count() << "s" << std::endl << std::endl;
+		const std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
+
+		out << " ?> Done in " << diff.count() << "s" << std::endl;
+	}
+
+	const std::chrono::duration<double> pipelineDiff = std::chrono::steady_clock::now() - pipelineStart;
+
+	out << std::endl << " ?> Pipeline done in " << pipelineDiff.count() << "s" << std::endl << std::endl;
+}
+
+int main(const int argc, char** argv)
+{
+	std::cout << " *** FPCFilter - v" << FPCFilter_VERSION_MAJOR << "." << FPCFilter_VERSION_MINOR << " ***" << std::endl << std::endl;
+
+	try {
+
+		FPCFilter::Parameters parameters(argc, argv);
+
+        std::cout << "?> Parameters:" << std::endl;
+		if (!parameters.serve.empty())
+			std::cout << "\tserve = " << parameters.serve << " (cache memory " << (parameters.cacheMemory >> 20) << " MB)" << std::endl;
+		else if (!parameters.batch.empty())
+			std::cout << "\tbatch = " << parameters.batch << std::endl;
+		else {
+			std::cout << "\tinput = " << parameters.input << std::endl;
+			std::cout << "\toutput = " << parameters.output << std::endl;
+		}
+
+		if (!parameters.stats.empty()) std::cout << "\tstats = " << parameters.stats << std::endl;
+		if (!parameters.trace.empty()) std::cout << "\ttrace = " << parameters.trace << std::endl;
+		nlohmann::json stats = nlohmann::json::object();
+
+		if (!parameters.std.empty()) {
+			std::cout << "\tstd = " << std::setprecision(4);
+			for (size_t i = 0; i < parameters.std.size(); ++i)
+				std::cout << (i > 0 ? ", " : "") << parameters.std[i];
+			std::cout << std::endl;
+		}
+		if (parameters.isDedupRequested)
+			std::cout << "\tdedup = " << (parameters.dedupMethod == FPCFilter::DedupMethod::Hash ? "hash" : "sort") << (parameters.dedupMerge ? " (merge)" : "") << std::endl;
+		if (!parameters.radius.empty()) {
+			std::cout << "\tradius = " << std::setprecision(4);
+			for (size_t i = 0; i < parameters.radius.size(); ++i)
+				std::cout << (i > 0 ? "," : "") << parameters.radius[i];
+			std::cout << std::endl;
+		}
+		if (parameters.meank.has_value())
+			std::cout << "\tmeanK = " << parameters.meank.value() << std::endl;
+		if (parameters.thresholdMode == FPCFilter::ThresholdMode::Mad)
+			std::cout << "\tthreshold mode = mad" << std::endl;
+		if (parameters.knnEps > 0)
+			std::cout << "\tknn eps = " << std::setprecision(4) << parameters.knnEps << " (verify on " << parameters.knnVerify << " points)" << std::endl;
+		if (parameters.boundedKnn > 0)
+			std::cout << "\tbounded knn = threshold estimated on " << parameters.boundedKnn << " points" << std::endl;
+		if (!parameters.distanceCache.empty())
+			std::cout << "\tdistance cache = " << parameters.distanceCache << std::endl;
+		if (parameters.minNeighbors.has_value())
+			std::cout << "\tmin neighbors = " << parameters.minNeighbors.value() << std::endl;
+		if (parameters.neighborsRadius.has_value())
+			std::cout << "\tneighbors radius = " << std::setprecision(4) << parameters.neighborsRadius.value() << std::endl;
+		if (parameters.isNormalsRequested) {
+			std::cout << "\tnormals neighbors = " << parameters.normalsNeighbors << std::endl;
+			if (parameters.normalsOrientation.viewpoint.has_value()) {
+				const auto& v = parameters.normalsOrientation.viewpoint.value();
+				std::cout << "\tnormals viewpoint = " << v[0] << "," << v[1] << "," << v[2] << std::endl;
+			}
+			else
+				std::cout << "\tnormals orientation = up" << std::endl;
+		}
+
+		std::unique_ptr<FPCFilter::Plan> plan;
+
+		if (!parameters.pipeline.empty()) {
+			plan = std::make_unique<FPCFilter::Plan>(parameters.pipeline);
+
+			std::cout << "\tpipeline = " << parameters.pipeline << std::endl;
+			plan->print(std::cout);
+		}
+		else if (parameters.boundary.has_value()) 
+			std::cout << "\tboundary = " << parameters.boundary.value().getPoints().size() << " polygon vertexes" << std::endl;		
+		else 
+			std::cout << "\tboundary = auto" << std::endl;
+		
+        std::cout << "\tseed = " << parameters.seed << std::endl;
+        std::cout << "\tconcurrency = " << parameters.concurrency << std::endl;
+        std::cout << "\tpin threads = " << (parameters.pinThreads ? "yes" : "no") << std::endl;
+		if (parameters.perfCounters)
+			std::cout << "\tperf counters = yes" << std::endl;
+		if (parameters.progress >= 0)
+			std::cout << "\tprogress = fd " << parameters.progress << std::endl;
+        std::cout << "\tverbose = " << (parameters.verbose ? "yes" : "no") << std::endl;
+		std::cout << std::endl;
+
+		std::cout << " -> Setting num_threads to " << parameters.concurrency << std::endl;
+		omp_set_num_threads(parameters.concurrency);
+
+		// Before the first parallel region, so that the counters follow the pool threads
+		if (parameters.perfCounters) {
+			auto& counters = FPCFilter::PerfCounters::get();
+
+			if (!counters.enable())
+				std::cout << " ?> Performance counters are not available (" << counters.lastError() << ")" << std::endl;
+			else if (!counters.lastError().empty())
+				std::cout << " ?> Some performance counters are not available (" << counters.lastError() << ")" << std::endl;
+		}
+
+		if (parameters.pinThreads) {
+			if (FPCFilter::numa::pinThreads())
+				std::cout << " -> Pinned the threads (" << FPCFilter::numa::Topology::get().nodeCount() << " NUMA nodes)" << std::endl;
+			else
+				std::cout << " ?> Thread pinning is not supported on this platform" << std::endl;
+		}
+
+		FPCFilter::Progress::installSignalHandlers();
+
+		std::unique_ptr<FPCFilter::ProgressReporter> reporter;
+
+		if (parameters.progress >= 0)
+			reporter = std::make_unique<FPCFilter::ProgressReporter>(parameters.progress);
+
+		// Written when the run ends, even if it fails
+		std::unique_ptr<FPCFilter::TraceFile> trace;
+
+		if (!parameters.trace.empty())
+			trace = std::make_unique<FPCFilter::TraceFile>(parameters.trace);
+
+		if (!parameters.serve.empty()) {
+
+			FPCFilter::Server server(parameters.serve, parameters.cacheMemory, parameters.seed, std::cout, parameters.verbose);
+
+			server.run();
+
+			return EXIT_SUCCESS;
+		}
+
+		if (!parameters.batch.empty()) {
+
+			FPCFilter::Batch batch(parameters.batch);
+
+			std::cout << " -> Processing " << batch.size() << " files" << std::endl;
+
+			const auto failed = batch.run([&](const FPCFilter::BatchJob& job, std::ostream& out, nlohmann::json& jobStats) {
+				process(parameters, plan.get(), job.input, job.output, out, jobStats);
+			}, std::cout, stats);
+
+			if (!parameters.stats.empty()){
+				std::ofstream o(parameters.stats);
+				o << stats;
+				o.close();
+			}
+
+			return failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+		}
+
+		process(parameters, plan.get(), parameters.input, parameters.output, std::cout, stats);
 
 		if (!parameters.stats.empty()){
 			std::ofstream o(parameters.stats);
@@ -115,6 +308,11 @@ int main(const int argc, char** argv)
 			o.close();
 		}
 	}
+	catch(const FPCFilter::Cancelled&) {
+		const auto signal = FPCFilter::Progress::get().cancelSignal();
+		std::cerr << "Cancelled" << std::endl;
+		return signal > 0 ? 128 + signal : EXIT_FAILURE;
+	}
 	catch(const std::invalid_argument& e) {
 		std::cerr << e.what() << std::endl;
 		return EXIT_FAILURE;
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <omp.h>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+#include "perfcounters.hpp"
+#include "progress.hpp"
+#include "trace.hpp"
+#include "vendor/json.hpp"
+
+namespace FPCFilter {
+
+    // CPU time of the threads that run a stage and peak resident set size of the process
+    struct ResourceUsage {
+        double cpuTime = 0;
+        size_t peakRss = 0;
+
+#ifndef _WIN32
+        static double seconds(const rusage& ru)
+        {
+            return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+        }
+#endif
+
+        // The CPU time is summed over the team a parallel region started by the caller gets: the whole thread
+        // pool outside of the parallel regions, the calling thread alone inside of one (a concurrent batch job or
+        // sweep output, whose own regions get a team of one), so concurrent stages do not count each other
+        static ResourceUsage now()
+        {
+            ResourceUsage usage;
+
+#ifdef _WIN32
+            usage.cpuTime = static_cast<double>(std::clock()) / CLOCKS_PER_SEC;
+#else
+            rusage ru = {};
+            getrusage(RUSAGE_SELF, &ru);
+
+#ifdef RUSAGE_THREAD
+            double cpuTime = 0;
+
+            #pragma omp parallel reduction(+ : cpuTime)
+            {
+                rusage thread = {};
+                getrusage(RUSAGE_THREAD, &thread);
+
+                cpuTime += seconds(thread);
+            }
+
+            usage.cpuTime = cpuTime;
+#else
+            usage.cpuTime = seconds(ru);
+#endif
+
+#ifdef __APPLE__
+            usage.peakRss = static_cast<size_t>(ru.ru_maxrss);
+#else
+            usage.peakRss = static_cast<size_t>(ru.ru_maxrss) * 1024;
+#endif
+#endif
+            return usage;
+        }
+
+        // True where the CPU time only counts the calling thread
+        static bool isPerThread()
+        {
+#if !defined(_WIN32) && defined(RUSAGE_THREAD)
+            return true;
+#else
+            return false;
+#endif
+        }
+    };
+
+    // Measures a stage from its construction to record, which appends an entry to the "stages" list of the stats:
+    // wall and CPU time, points in and out, throughput (input points per second), growth of the peak RSS and,
+    // for the stages that report their progress, the work imbalance of the threads (the largest share of the
+    // points processed by a thread over the fair share: 1 is a perfect balance) and, with the performance
+    // counters enabled, their counts over the stage.
+    // A stage that runs concurrently with others (created inside a parallel region) omits the measures that
+    // are process wide: the peak RSS, the imbalance, the performance counters and, where it cannot be measured
+    // per thread, the CPU time
+    class StageMetrics {
+
+        std::string name;
+        size_t pointsIn;
+
+        // Created inside a parallel region: other stages may run at the same time
+        bool isConcurrent;
+
+        std::chrono::steady_clock::time_point start;
+        ResourceUsage usage;
+        std::vector<uint64_t> work;
+        PerfCounters::Values counters;
+
+        // The stage in the trace timeline, ended by record
+        mutable TraceSpan span;
+
+    public:
+        // The name must be a string literal
+        StageMetrics(const char* name, size_t pointsIn) : name(name), pointsIn(pointsIn), isConcurrent(omp_in_parallel() != 0),
+            start(std::chrono::steady_clock::now()), usage(ResourceUsage::now()), work(Progress::get().work()), span(name, "stage")
+        {
+            if (PerfCounters::enabled() && !isConcurrent)
+                counters = PerfCounters::get().read();
+        }
+
+        // When the input size is only known at the end (reading)
+        void setPointsIn(size_t points)
+        {
+            pointsIn = points;
+        }
+
+        nlohmann::json finish(size_t pointsOut) const
+        {
+            const std::chrono::duration<double> wall = std::chrono::steady_clock::now() - start;
+            const auto end = ResourceUsage::now();
+
+            nlohmann::json metrics = {
+                {"stage", name},
+                {"wall_time", wall.count()}
+            };
+
+            if (!isConcurrent || ResourceUsage::isPerThread())
+                metrics["cpu_time"] = end.cpuTime - usage.cpuTime;
+
+            metrics["points_in"] = pointsIn;
+            metrics["points_out"] = pointsOut;
+            metrics["throughput"] = wall.count() > 0 ? pointsIn / wall.count() : 0.0;
+
+            if (isConcurrent)
+                return metrics;
+
+            metrics["peak_rss_delta"] = end.peakRss - std::min(end.peakRss, usage.peakRss);
+
+            const auto current = Progress::get().work();
+
+            uint64_t total = 0;
+            uint64_t largest = 0;
+
+            for (size_t i = 0; i < current.size(); ++i) {
+                const auto done = current[i] - work[i];
+                total += done;
+                largest = std::max(largest, done);
+            }
+
+            if (total > 0)
+                metrics["imbalance"] = static_cast<double>(largest) * omp_get_max_threads() / total;
+
+            if (PerfCounters::enabled())
+                metrics["counters"] = PerfCounters::difference(counters, PerfCounters::get().read());
+
+            return metrics;
+        }
+
+        // Appends the metrics (and the extra fields) to stats["stages"]
+        void record(nlohmann::json* stats, size_t pointsOut, const nlohmann::json& extra = nlohmann::json::object()) const
+        {
+            span.end();
+
+            if (stats == nullptr)
+                return;
+
+            auto metrics = finish(pointsOut);
+            metrics.update(extra);
+
+            (*stats)["stages"].push_back(metrics);
+        }
+    };
+
+}
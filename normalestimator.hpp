@@ -0,0 +1,226 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <iostream>
+#include <optional>
+#include <vector>
+
+#include "ply.hpp"
+#include "kdtree.hpp"
+#include "progress.hpp"
+#include "metrics.hpp"
+
+#define DEFAULT_NORMALS_NEIGHBORS 16
+
+namespace FPCFilter {
+
+    // Normals oriented toward a viewpoint (camera position), or upward (+z) when there is none
+    struct NormalOrientation {
+        std::optional<std::array<double, 3>> viewpoint;
+    };
+
+    // Estimates the normal of every point as the direction of least variance of its k nearest neighbors
+    // (PCA), using the shared index, and stores it in the extras of the cloud so that the writer emits it.
+    // The points are processed in blocks: the neighbors search fills the covariance matrices of a block,
+    // then a closed form 3x3 eigen solver (no iterations, no data dependent loop) runs over the block as
+    // a SIMD loop
+    class NormalEstimator {
+
+        static constexpr size_t BLOCK = 64;
+
+        int k;
+        NormalOrientation orientation;
+
+        std::ostream& log;
+        bool isVerbose;
+
+        nlohmann::json *stats;
+
+        // Covariance matrices of a block (symmetric: 6 terms)
+        struct alignas(64) Block {
+            double c00[BLOCK], c01[BLOCK], c02[BLOCK], c11[BLOCK], c12[BLOCK], c22[BLOCK];
+            double nx[BLOCK], ny[BLOCK], nz[BLOCK];
+        };
+
+        // Unit eigenvector of the smallest eigenvalue of every matrix of the block (Smith's trigonometric
+        // method for the eigenvalue, then the largest cross product of two rows of A - lambda I).
+        // Isotropic or degenerate neighborhoods get (0, 0, 1)
+        static void solve(Block& b, size_t count)
+        {
+            const double twoThirdsPi = 2.0 * std::acos(-1.0) / 3.0;
+
+            #pragma omp simd
+            for (size_t i = 0; i < count; ++i)
+            {
+                const double a00 = b.c00[i], a01 = b.c01[i], a02 = b.c02[i];
+                const double a11 = b.c11[i], a12 = b.c12[i], a22 = b.c22[i];
+
+                const double q = (a00 + a11 + a22) / 3.0;
+                const double p1 = a01 * a01 + a02 * a02 + a12 * a12;
+                const double p2 = (a00 - q) * (a00 - q) + (a11 - q) * (a11 - q) + (a22 - q) * (a22 - q) + 2.0 * p1;
+                const double p = std::sqrt(p2 / 6.0);
+                const double ip = p > 0 ? 1.0 / p : 0.0;
+
+                // B = (A - qI) / p, r = det(B) / 2
+                const double b00 = (a00 - q) * ip, b11 = (a11 - q) * ip, b22 = (a22 - q) * ip;
+                const double b01 = a01 * ip, b02 = a02 * ip, b12 = a12 * ip;
+
+                double r = (b00 * (b11 * b22 - b12 * b12) - b01 * (b01 * b22 - b12 * b02) + b02 * (b01 * b12 - b11 * b02)) / 2.0;
+                r = r < -1.0 ? -1.0 : (r > 1.0 ? 1.0 : r);
+
+                const double phi = std::acos(r) / 3.0;
+                const double lambda = q + 2.0 * p * std::cos(phi + twoThirdsPi);
+
+                // Rows of A - lambda I
+                const double r00 = a00 - lambda, r01 = a01, r02 = a02;
+                const double r10 = a01, r11 = a11 - lambda, r12 = a12;
+                const double r20 = a02, r21 = a12, r22 = a22 - lambda;
+
+                // Their cross products are orthogonal to the row space, so parallel to the eigenvector
+                const double x0 = r01 * r12 - r02 * r11, y0 = r02 * r10 - r00 * r12, z0 = r00 * r11 - r01 * r10;
+                const double x1 = r01 * r22 - r02 * r21, y1 = r02 * r20 - r00 * r22, z1 = r00 * r21 - r01 * r20;
+                const double x2 = r11 * r22 - r12 * r21, y2 = r12 * r20 - r10 * r22, z2 = r10 * r21 - r11 * r20;
+
+                const double d0 = x0 * x0 + y0 * y0 + z0 * z0;
+                const double d1 = x1 * x1 + y1 * y1 + z1 * z1;
+                const double d2 = x2 * x2 + y2 * y2 + z2 * z2;
+
+                const bool use1 = d1 > d0;
+                double x = use1 ? x1 : x0, y = use1 ? y1 : y0, z = use1 ? z1 : z0, d = use1 ? d1 : d0;
+
+                const bool use2 = d2 > d;
+                x = use2 ? x2 : x; y = use2 ? y2 : y; z = use2 ? z2 : z; d = use2 ? d2 : d;
+
+                const bool valid = p > 0 && d > 0;
+                const double inv = valid ? 1.0 / std::sqrt(d) : 0.0;
+
+                b.nx[i] = valid ? x * inv : 0.0;
+                b.ny[i] = valid ? y * inv : 0.0;
+                b.nz[i] = valid ? z * inv : 1.0;
+            }
+        }
+
+    public:
+        NormalEstimator(int k, const NormalOrientation& orientation, std::ostream &logstream, bool isVerbose, nlohmann::json *stats) :
+            k(k), orientation(orientation), log(logstream), isVerbose(isVerbose), stats(stats) {}
+
+        // Replaces the normals of the file. The index must contain the points of the file
+        void run(PlyFile& file, const KDTree& index) {
+
+            const size_t np = file.points.size();
+
+            file.extras.resize(np);
+
+            if (np == 0)
+                return;
+
+            // The query point is one of its own neighbors
+            const size_t neighbors = std::min(static_cast<size_t>(k) + 1, np);
+
+            const auto start = std::chrono::steady_clock::now();
+
+            auto& progress = Progress::get();
+            progress.begin("normals", np);
+
+            StageMetrics metrics("normals", np);
+
+            size_t flipped = 0;
+
+            #pragma omp parallel reduction(+ : flipped)
+            {
+                TraceSpan span("normals");
+
+                auto& counter = progress.local();
+
+                std::vector<size_t> indices(neighbors);
+                std::vector<float> dists(neighbors);
+
+                Block block;
+
+                const long long blocks = static_cast<long long>((np + BLOCK - 1) / BLOCK);
+
+                #pragma omp for schedule(dynamic, 16) nowait
+                for (long long blk = 0; blk < blocks; ++blk)
+                {
+                    if (progress.isCancelled())
+                        continue;
+
+                    const size_t first = blk * BLOCK;
+                    const size_t count = std::min(BLOCK, np - first);
+
+                    for (size_t j = 0; j < count; ++j)
+                    {
+                        const auto& point = file.points[first + j];
+                        const float pt[3] = { point.x, point.y, point.z };
+
+                        index.knnSearch(pt, neighbors, indices.data(), dists.data());
+
+                        double mx = 0, my = 0, mz = 0;
+
+                        for (size_t n = 0; n < neighbors; ++n) {
+                            const auto& q = file.points[indices[n]];
+                            mx += q.x; my += q.y; mz += q.z;
+                        }
+
+                        mx /= neighbors; my /= neighbors; mz /= neighbors;
+
+                        double c00 = 0, c01 = 0, c02 = 0, c11 = 0, c12 = 0, c22 = 0;
+
+                        for (size_t n = 0; n < neighbors; ++n) {
+                            const auto& q = file.points[indices[n]];
+                            const double dx = q.x - mx, dy = q.y - my, dz = q.z - mz;
+
+                            c00 += dx * dx; c01 += dx * dy; c02 += dx * dz;
+                            c11 += dy * dy; c12 += dy * dz; c22 += dz * dz;
+                        }
+
+                        block.c00[j] = c00; block.c01[j] = c01; block.c02[j] = c02;
+                        block.c11[j] = c11; block.c12[j] = c12; block.c22[j] = c22;
+                    }
+
+                    solve(block, count);
+
+                    for (size_t j = 0; j < count; ++j)
+                    {
+                        const auto& point = file.points[first + j];
+
+                        double nx = block.nx[j], ny = block.ny[j], nz = block.nz[j];
+
+                        // Toward the viewpoint, or up
+                        const double facing = orientation.viewpoint.has_value() ?
+                            nx * (orientation.viewpoint.value()[0] - point.x) + ny * (orientation.viewpoint.value()[1] - point.y) + nz * (orientation.viewpoint.value()[2] - point.z) :
+                            nz;
+
+                        if (facing < 0) {
+                            nx = -nx; ny = -ny; nz = -nz;
+                            ++flipped;
+                        }
+
+                        file.extras[first + j] = PlyExtra(static_cast<float>(nx), static_cast<float>(ny), static_cast<float>(nz));
+                    }
+
+                    counter.add(count);
+                }
+            }
+
+            progress.check();
+
+            const std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
+
+            metrics.record(stats, np, { {"neighbors", k} });
+
+            (*stats)["normals"] = {
+                {"neighbors", k},
+                {"orientation", orientation.viewpoint.has_value() ? "viewpoint" : "up"},
+                {"flipped", flipped},
+                {"time", diff.count()}
+            };
+
+            if (this->isVerbose)
+                log << " ?> Estimated " << np << " normals in " << diff.count() << "s (" << flipped << " flipped)" << std::endl;
+        }
+
+    };
+
+}
@@ -0,0 +1,201 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <omp.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace FPCFilter {
+
+    // Allocator that default-initializes the elements: a vector of trivial elements can be sized without
+    // writing them, so that its pages are first touched (and placed on their NUMA node) by the threads of
+    // the static loop that fills it
+    template <class T, class A = std::allocator<T>>
+    class DefaultInitAllocator : public A {
+
+        using Traits = std::allocator_traits<A>;
+
+    public:
+        template <class U>
+        struct rebind {
+            using other = DefaultInitAllocator<U, typename Traits::template rebind_alloc<U>>;
+        };
+
+        using A::A;
+
+        template <class U>
+        void construct(U* ptr) noexcept(std::is_nothrow_default_constructible<U>::value)
+        {
+            ::new (static_cast<void*>(ptr)) U;
+        }
+
+        template <class U, class... Args>
+        void construct(U* ptr, Args&&... args)
+        {
+            Traits::construct(static_cast<A&>(*this), ptr, std::forward<Args>(args)...);
+        }
+    };
+
+    template <class T>
+    using FirstTouchVector = std::vector<T, DefaultInitAllocator<T>>;
+
+    namespace numa {
+
+        // NUMA node of every CPU, read from sysfs (a single node when it is not available)
+        class Topology {
+
+            std::vector<int> nodeOfCpu;
+            int nodes = 1;
+
+            static std::vector<int> parseList(const std::string& list)
+            {
+                std::vector<int> cpus;
+                std::stringstream ss(list);
+                std::string range;
+
+                while (std::getline(ss, range, ','))
+                {
+                    const auto dash = range.find('-');
+
+                    const int first = std::stoi(range.substr(0, dash));
+                    const int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+
+                    for (int cpu = first; cpu <= last; ++cpu)
+                        cpus.push_back(cpu);
+                }
+
+                return cpus;
+            }
+
+            Topology()
+            {
+                namespace fs = std::filesystem;
+
+                const fs::path root("/sys/devices/system/node");
+
+                std::error_code ec;
+                if (!fs::is_directory(root, ec))
+                    return;
+
+                int maxNode = -1;
+
+                for (const auto& entry : fs::directory_iterator(root, ec))
+                {
+                    const auto name = entry.path().filename().string();
+
+                    if (name.rfind("node", 0) != 0 || name.size() == 4 || !std::isdigit(name[4]))
+                        continue;
+
+                    const int node = std::stoi(name.substr(4));
+
+                    std::ifstream reader(entry.path() / "cpulist");
+                    std::string list;
+
+                    if (!std::getline(reader, list) || list.empty())
+                        continue;
+
+                    for (const auto cpu : parseList(list))
+                    {
+                        if (cpu >= static_cast<int>(nodeOfCpu.size()))
+                            nodeOfCpu.resize(cpu + 1, 0);
+
+                        nodeOfCpu[cpu] = node;
+                    }
+
+                    maxNode = std::max(maxNode, node);
+                }
+
+                nodes = std::max(1, maxNode + 1);
+            }
+
+        public:
+            static const Topology& get()
+            {
+                static const Topology topology;
+                return topology;
+            }
+
+            int nodeCount() const { return nodes; }
+
+            int node(int cpu) const
+            {
+                return cpu >= 0 && cpu < static_cast<int>(nodeOfCpu.size()) ? nodeOfCpu[cpu] : 0;
+            }
+        };
+
+        // CPU the calling thread runs on (-1 if unknown)
+        inline int currentCpu()
+        {
+#ifdef __linux__
+            return sched_getcpu();
+#else
+            return -1;
+#endif
+        }
+
+        inline int currentNode()
+        {
+            return Topology::get().node(currentCpu());
+        }
+
+        // Pins the OpenMP threads to the allowed CPUs, ordered by NUMA node: the contiguous blocks of the
+        // static loops (thread 0 first) stay on one node and the data they first touch is local.
+        // The pool threads are reused by the following parallel regions of the same size.
+        // Returns false when pinning is not supported
+        inline bool pinThreads()
+        {
+#ifdef __linux__
+            cpu_set_t allowed;
+            CPU_ZERO(&allowed);
+
+            if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+                return false;
+
+            const auto& topology = Topology::get();
+
+            std::vector<int> cpus;
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+                if (CPU_ISSET(cpu, &allowed))
+                    cpus.push_back(cpu);
+
+            if (cpus.empty())
+                return false;
+
+            std::stable_sort(cpus.begin(), cpus.end(), [&topology](int a, int b) { return topology.node(a) < topology.node(b); });
+
+            bool pinned = true;
+
+            #pragma omp parallel reduction(&& : pinned)
+            {
+                const auto t = static_cast<size_t>(omp_get_thread_num());
+                const auto threads = static_cast<size_t>(omp_get_num_threads());
+
+                // Spread the threads over all the CPUs when there are fewer threads than CPUs
+                const auto cpu = cpus[(t * cpus.size() / threads) % cpus.size()];
+
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(cpu, &set);
+
+                pinned = pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+            }
+
+            return pinned;
+#else
+            return false;
+#endif
+        }
+
+    }
+
+}
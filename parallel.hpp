@@ -0,0 +1,336 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+#include <omp.h>
+
+namespace FPCFilter {
+
+    // Running mean and sum of squared deviations (Welford). Partial results computed over
+    // separate ranges are combined with merge (Chan et al.)
+    struct alignas(64) Moments {
+        size_t n = 0;
+        double mean = 0.0;
+        double m2 = 0.0;
+
+        void add(double x)
+        {
+            const size_t n1 = n;
+            n++;
+            const double delta = x - mean;
+            const double delta_n = delta / n;
+            mean += delta_n;
+            m2 += delta * delta_n * n1;
+        }
+
+        void merge(const Moments& other)
+        {
+            if (other.n == 0)
+                return;
+
+            if (n == 0) {
+                *this = other;
+                return;
+            }
+
+            const double total = static_cast<double>(n + other.n);
+            const double delta = other.mean - mean;
+
+            mean += delta * other.n / total;
+            m2 += other.m2 + delta * delta * (static_cast<double>(n) * other.n / total);
+            n += other.n;
+        }
+
+        double variance() const { return m2 / (n - 1.0); }
+
+        double stdev() const { return std::sqrt(variance()); }
+    };
+
+    // Computes the moments of the values in parallel: every thread reduces its static block, then the
+    // partial results are merged in thread order
+    template <class Vector>
+    Moments parallelMoments(const Vector& values)
+    {
+        std::vector<Moments> partials(omp_get_max_threads());
+
+        #pragma omp parallel
+        {
+            auto& partial = partials[omp_get_thread_num()];
+
+            #pragma omp for schedule(static)
+            for (long long i = 0; i < values.size(); ++i)
+                partial.add(values[i]);
+        }
+
+        Moments moments;
+        for (const auto& partial : partials)
+            moments.merge(partial);
+
+        return moments;
+    }
+
+    // Selection of the k-th smallest value (0 based) without sorting.
+    // The values are counted in a histogram between their minimum and maximum (every thread fills its own
+    // histogram), then the search continues only on the values of the bin that contains the k-th one, until
+    // few enough are left for nth_element. Infinite values are counted in an overflow bin
+    inline double parallelSelect(const double* values, size_t size, size_t k)
+    {
+        if (k >= size)
+            throw std::invalid_argument("Selection index out of range");
+
+        constexpr size_t BINS = 4096;
+        constexpr size_t CUTOFF = 1 << 14;
+
+        const int threads = omp_get_max_threads();
+
+        std::vector<double> candidates;
+
+        const double* current = values;
+        size_t n = size;
+
+        while (true)
+        {
+            if (n <= CUTOFF)
+            {
+                std::vector<double> rest(current, current + n);
+                std::nth_element(rest.begin(), rest.begin() + k, rest.end());
+                return rest[k];
+            }
+
+            double lo = std::numeric_limits<double>::infinity();
+            double hi = -std::numeric_limits<double>::infinity();
+
+            #pragma omp parallel for schedule(static) reduction(min : lo) reduction(max : hi)
+            for (long long i = 0; i < n; ++i)
+            {
+                const auto v = current[i];
+                if (std::isfinite(v))
+                {
+                    lo = std::min(lo, v);
+                    hi = std::max(hi, v);
+                }
+            }
+
+            // All the finite values are equal
+            if (lo >= hi)
+            {
+                size_t finite = 0;
+
+                #pragma omp parallel for schedule(static) reduction(+ : finite)
+                for (long long i = 0; i < n; ++i)
+                    finite += std::isfinite(current[i]);
+
+                return k < finite ? lo : std::numeric_limits<double>::infinity();
+            }
+
+            const double scale = BINS / (hi - lo);
+
+            const auto binOf = [&](double v) -> size_t {
+                if (!std::isfinite(v))
+                    return BINS;
+                return std::min(BINS - 1, static_cast<size_t>((v - lo) * scale));
+            };
+
+            std::vector<std::vector<size_t>> histograms(threads, std::vector<size_t>(BINS + 1, 0));
+
+            #pragma omp parallel
+            {
+                auto& histogram = histograms[omp_get_thread_num()];
+
+                #pragma omp for schedule(static)
+                for (long long i = 0; i < n; ++i)
+                    histogram[binOf(current[i])]++;
+            }
+
+            size_t bin = 0;
+            size_t before = 0;
+
+            for (; bin <= BINS; ++bin)
+            {
+                size_t cnt = 0;
+                for (const auto& histogram : histograms)
+                    cnt += histogram[bin];
+
+                if (before + cnt > k)
+                    break;
+
+                before += cnt;
+            }
+
+            if (bin == BINS)
+                return std::numeric_limits<double>::infinity();
+
+            std::vector<std::vector<double>> gathered(threads);
+
+            #pragma omp parallel
+            {
+                auto& local = gathered[omp_get_thread_num()];
+
+                #pragma omp for schedule(static)
+                for (long long i = 0; i < n; ++i)
+                    if (binOf(current[i]) == bin)
+                        local.push_back(current[i]);
+            }
+
+            std::vector<double> next;
+            for (const auto& local : gathered)
+                next.insert(next.end(), local.begin(), local.end());
+
+            candidates.swap(next);
+            current = candidates.data();
+            n = candidates.size();
+            k -= before;
+        }
+    }
+
+    template <class Vector>
+    double parallelSelect(const Vector& values, size_t k)
+    {
+        return parallelSelect(values.data(), values.size(), k);
+    }
+
+    template <class Vector>
+    double parallelMedian(const Vector& values)
+    {
+        const size_t n = values.size();
+
+        if (n % 2 == 1)
+            return parallelSelect(values, n / 2);
+
+        return (parallelSelect(values, n / 2 - 1) + parallelSelect(values, n / 2)) / 2.0;
+    }
+
+    // Order preserving, in place, parallel compaction.
+    // The plan is computed once from the keep mask and can then be applied to every array that is
+    // parallel to it (points, extras, distances...).
+    //
+    // The range is split in one block per thread. Applying the plan:
+    //  1. every block compacts its survivors at its own beginning (no overlap between blocks);
+    //  2. the survivors of a block that the blocks after it are going to overwrite are saved aside:
+    //     they are at most as many as the points removed before the block;
+    //  3. every block moves its survivors to their final offset (exclusive prefix sum of the survivors).
+    class Compaction {
+
+        std::vector<uint8_t> keep;
+
+        std::vector<size_t> begins;
+        std::vector<size_t> kept;
+        std::vector<size_t> offsets;
+
+        size_t total = 0;
+
+    public:
+        static constexpr size_t REMOVED = std::numeric_limits<size_t>::max();
+
+        explicit Compaction(std::vector<uint8_t> keepMask) : keep(std::move(keepMask))
+        {
+            const size_t n = keep.size();
+            const size_t blocks = std::max<size_t>(1, std::min<size_t>(omp_get_max_threads(), n));
+
+            begins.resize(blocks + 1);
+            for (size_t b = 0; b <= blocks; ++b)
+                begins[b] = n * b / blocks;
+
+            kept.assign(blocks, 0);
+
+            #pragma omp parallel for schedule(static)
+            for (long long b = 0; b < blocks; ++b)
+            {
+                size_t cnt = 0;
+                for (size_t i = begins[b]; i < begins[b + 1]; ++i)
+                    cnt += keep[i] != 0;
+                kept[b] = cnt;
+            }
+
+            offsets.resize(blocks);
+            for (size_t b = 0; b < blocks; ++b)
+            {
+                offsets[b] = total;
+                total += kept[b];
+            }
+        }
+
+        // Number of survivors
+        size_t size() const { return total; }
+
+        size_t removed() const { return keep.size() - total; }
+
+        const std::vector<uint8_t>& mask() const { return keep; }
+
+        // New position of every element, REMOVED for the ones that are dropped
+        std::vector<size_t> indexMap() const
+        {
+            std::vector<size_t> map(keep.size());
+
+            #pragma omp parallel for schedule(static)
+            for (long long b = 0; b < kept.size(); ++b)
+            {
+                auto next = offsets[b];
+                for (auto i = begins[b]; i < begins[b + 1]; ++i)
+                    map[i] = keep[i] ? next++ : REMOVED;
+            }
+
+            return map;
+        }
+
+        // Moves the survivors to the front of v, in order, and drops the others. When more than half of the
+        // elements are removed, the capacity is released too (the survivors are copied to a smaller buffer)
+        template <class T>
+        void apply(std::vector<T>& v) const
+        {
+            if (v.size() != keep.size())
+                throw std::invalid_argument("Compaction size mismatch");
+
+            const size_t blocks = kept.size();
+
+            std::vector<std::vector<T>> saved(blocks);
+
+            #pragma omp parallel
+            {
+                #pragma omp for schedule(static)
+                for (long long b = 0; b < blocks; ++b)
+                {
+                    const auto begin = begins[b];
+
+                    auto w = begin;
+                    for (auto i = begin; i < begins[b + 1]; ++i)
+                    {
+                        if (keep[i])
+                        {
+                            if (w != i)
+                                v[w] = std::move(v[i]);
+                            ++w;
+                        }
+                    }
+
+                    const auto shift = begin - offsets[b];
+                    const auto toSave = std::min(kept[b], shift);
+
+                    saved[b].reserve(toSave);
+                    saved[b].insert(saved[b].end(), std::make_move_iterator(v.begin() + (w - toSave)), std::make_move_iterator(v.begin() + w));
+                }
+
+                #pragma omp for schedule(static)
+                for (long long b = 0; b < blocks; ++b)
+                {
+                    const auto begin = begins[b];
+                    const auto direct = kept[b] - saved[b].size();
+
+                    if (offsets[b] != begin)
+                        std::move(v.begin() + begin, v.begin() + (begin + direct), v.begin() + offsets[b]);
+
+                    std::move(saved[b].begin(), saved[b].end(), v.begin() + (offsets[b] + direct));
+                }
+            }
+
+            v.erase(v.begin() + total, v.end());
+
+            if (total < keep.size() / 2)
+                v.shrink_to_fit();
+        }
+    };
+
+}
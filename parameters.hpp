@@ -8,6 +8,10 @@
 #include "vendor/cxxopts.hpp"
 #include "utils.hpp"
 #include "vendor/json.hpp"
+#include "random.hpp"
+#include "fastoutlierfilter.hpp"
+#include "normalestimator.hpp"
+#include "duplicatefilter.hpp"
 
 #define DEFAULT_STD_DEV "2.5"
 #define DEFAULT_MEANK "16"
@@ -21,55 +25,48 @@ namespace FPCFilter
 	class Parameters
 	{
 
-		std::optional<Polygon> extractPolygon(const std::string& boundary)
-		{
-
-			Polygon polygon;
-
-			std::ifstream i(boundary);
-			nlohmann::json j;
-			i >> j;
-
-			const auto features = j["features"];
-
-			if (features.empty())
-				return std::nullopt;
-
-			for (const auto& f : features)
-			{
-				const auto geometry = f["geometry"];
-
-				if (geometry["type"] != "Polygon")
-					continue;
-
-				const auto coordinates = geometry["coordinates"][0];
-
-				// Add the points
-				for (auto& coord : coordinates)
-					polygon.addPoint(coord[0], coord[1]);
-
-				return polygon;
-			}
-
-			return std::nullopt;
-		}
-
 	public:
 		std::string input;
 		std::string output;
 		std::string stats;
+		std::string trace;
+		std::string pipeline;
+		std::string batch;
+		std::string serve;
+		size_t cacheMemory = 0;
 		
 		bool isCropRequested = false;
 		std::optional<Polygon> boundary;
 		
 		bool isFilterRequested = false;
-		std::optional<double> std;
+		std::vector<double> std;
 		std::optional<int> meank;
+		ThresholdMode thresholdMode = ThresholdMode::Stdev;
+		double knnEps = 0;
+		size_t knnVerify = 0;
+		std::string distanceCache;
+		size_t boundedKnn = 0;
+
+		bool isDedupRequested = false;
+		DedupMethod dedupMethod = DedupMethod::Hash;
+		bool dedupMerge = false;
 
 		bool isSampleRequested = false;
-		std::optional<double> radius;
+		std::vector<double> radius;
+
+		bool isRadiusFilterRequested = false;
+		std::optional<int> minNeighbors;
+		std::optional<double> neighborsRadius;
+
+		bool isNormalsRequested = false;
+		int normalsNeighbors = DEFAULT_NORMALS_NEIGHBORS;
+		NormalOrientation normalsOrientation;
 		
+		uint64_t seed;
 		int concurrency;
+		bool pinThreads;
+		bool perfCounters;
+		int progress = -1;
 		bool verbose;
 
 		Parameters(const int argc, char** argv)
@@ -83,61 +80,259 @@ namespace FPCFilter
 				("i,input", "Input point cloud", cxxopts::value<std::string>())
 				("o,output", "Output point cloud", cxxopts::value<std::string>())
 				("j,stats", "Output statistics file (JSON)", cxxopts::value<std::string>())
+				("batch", "Batch manifest (JSON list of input/output pairs), processed in a single run", cxxopts::value<std::string>())
+				("serve", "Worker mode: answer JSON job requests on this Unix socket", cxxopts::value<std::string>())
+				("cache-memory", "Worker mode: memory limit of the cached clouds and indices (MB)", cxxopts::value<int>()->default_value("4096"))
+				("p,pipeline", "Pipeline description (JSON), replacing the stage options", cxxopts::value<std::string>())
 				("b,boundary", "Crop boundary (GeoJSON POLYGON)", cxxopts::value<std::string>())
-				("s,std", "Standard deviation threshold", cxxopts::value<double>())
+				("s,std", "Standard deviation threshold (a comma separated list writes one output for each threshold)", cxxopts::value<std::vector<double>>())
 				("m,meank", "Mean number of neighbors", cxxopts::value<int>())
-				("r,radius", "Sample radius", cxxopts::value<double>())
+				("threshold-mode", "Statistical filter threshold: stdev (mean + std * standard deviation) or mad (median + std * median absolute deviation)", cxxopts::value<std::string>()->default_value("stdev"))
+				("knn-eps", "Approximate neighbors search error bound (0 = exact search)", cxxopts::value<double>())
+				("distance-cache", "Statistical filter neighbor distances cache file (reused when the points and meanK match)", cxxopts::value<std::string>())
+				("bounded-knn", "Two-pass bounded neighbors search, estimating the threshold on this number of random points", cxxopts::value<int>())
+				("knn-verify", "Number of random points used to compare the approximate search with the exact one", cxxopts::value<int>())
+				("dedup", "Remove the exact duplicate points before the other stages (hash, or sort: slower, an eighth of the index memory)", cxxopts::value<std::string>()->implicit_value("hash"))
+				("dedup-merge", "Give the kept duplicate the mean color and the sum of the views of the removed ones", cxxopts::value<bool>())
+				("r,radius", "Sample radius (an increasing comma separated list writes one nested level of detail for each radius)", cxxopts::value<std::vector<double>>())
+				("min-neighbors", "Radius filter: minimum number of neighbors within the neighbors radius", cxxopts::value<int>())
+				("neighbors-radius", "Radius filter: neighbors radius (default: 4 times the estimated spacing)", cxxopts::value<double>())
+				("estimate-normals", "Estimate the normals (PCA) from this number of nearest neighbors", cxxopts::value<int>()->implicit_value(std::to_string(DEFAULT_NORMALS_NEIGHBORS)))
+				("normals-viewpoint", "Orient the estimated normals toward this point (x,y,z, e.g. the camera position) instead of up", cxxopts::value<std::vector<double>>())
+				("seed", "Seed of the random sampling (spacing estimation, verification)", cxxopts::value<uint64_t>()->default_value(DEFAULT_SEED))
 				("c,concurrency", "Max concurrency", cxxopts::value<int>())
+				("pin-threads", "Pin the threads to the CPUs, grouped by NUMA node", cxxopts::value<bool>())
+				("perf-counters", "Record the hardware performance counters of every stage in the stats (Linux)", cxxopts::value<bool>())
+				("trace", "Timeline of the stages and of the threads work (Chrome trace event JSON, for chrome://tracing or Perfetto)", cxxopts::value<std::string>())
+				("progress", "Write a JSON progress line every second to this file descriptor (default: 2, stderr)", cxxopts::value<int>()->implicit_value("2"))
 				("v,verbose", "Verbose output", cxxopts::value<bool>());
 
 			options.parse_positional({ "input", "output" });
 
 			const auto result = options.parse(argc, argv);
 
-			if (!result.count("input") || !result.count("output"))
-				throw std::invalid_argument(options.help());
+			if (result.count("batch")) {
+
+				batch = result["batch"].as<std::string>();
+
+				if (result.count("input") || result.count("output"))
+					throw std::invalid_argument("Input and output files cannot be combined with a batch manifest");
+
+				if (result.count("distance-cache"))
+					throw std::invalid_argument("Option '--distance-cache' cannot be combined with a batch manifest");
+
+			} else if (result.count("serve")) {
+
+				serve = result["serve"].as<std::string>();
+
+				if (result.count("input") || result.count("output") || result.count("pipeline"))
+					throw std::invalid_argument("Input, output and pipeline cannot be combined with the worker mode (they are part of the requests)");
+
+				for (const auto option : { "boundary", "std", "meank", "radius", "min-neighbors", "neighbors-radius", "knn-eps", "knn-verify", "bounded-knn", "distance-cache", "estimate-normals", "normals-viewpoint", "dedup", "dedup-merge" })
+					if (result.count(option))
+						throw std::invalid_argument(string_format("Option '--%s' cannot be combined with the worker mode (the stages are part of the requests)", option));
+
+				const auto megabytes = result["cache-memory"].as<int>();
 
-			input = result["input"].as<std::string>();
+				if (megabytes < 0)
+					throw std::invalid_argument("Cache memory limit cannot be less than 0");
 
-			if (input.empty())
-				throw std::invalid_argument("Input file is empty");
+				cacheMemory = static_cast<size_t>(megabytes) << 20;
 
-			if (!fs::exists(input))
-				throw std::invalid_argument(string_format("Input file '%s' does not exist", input.c_str()));
+			} else {
 
-			output = result["output"].as<std::string>();
+				if (!result.count("input") || !result.count("output"))
+					throw std::invalid_argument(options.help());
 
-			if (output.empty())
-				throw std::invalid_argument("Output file is empty");
+				input = result["input"].as<std::string>();
+
+				if (input.empty())
+					throw std::invalid_argument("Input file is empty");
+
+				if (!fs::exists(input))
+					throw std::invalid_argument(string_format("Input file '%s' does not exist", input.c_str()));
+
+				output = result["output"].as<std::string>();
+
+				if (output.empty())
+					throw std::invalid_argument("Output file is empty");
+			}
 
 			stats = result.count("stats") ? result["stats"].as<std::string>() : "";
 
+			if (result.count("pipeline")) {
+
+				pipeline = result["pipeline"].as<std::string>();
+
+				for (const auto option : { "boundary", "std", "meank", "radius", "min-neighbors", "neighbors-radius", "knn-eps", "knn-verify", "bounded-knn", "distance-cache", "estimate-normals", "normals-viewpoint", "dedup", "dedup-merge" })
+					if (result.count(option))
+						throw std::invalid_argument(string_format("Option '--%s' cannot be combined with a pipeline description", option));
+			}
+
+			distanceCache = result.count("distance-cache") ? result["distance-cache"].as<std::string>() : "";
+
 			if (result.count("std") && result.count("meank")) {
 
-				std = result["std"].as<double>();
+				std = result["std"].as<std::vector<double>>();
+
+				if (std.empty())
+					throw std::invalid_argument("Standard deviation threshold is empty");
+
+				for (const auto s : std)
+					if (s < 0)
+						throw std::invalid_argument("Standard deviation threshold cannot be less than 0");
 
-				if (std < 0)
-					throw std::invalid_argument("Standard deviation threshold cannot be less than 0");
+				// A single 0 disables the filter, a 0 in a list would disable every threshold of the sweep
+				if (std.size() > 1 && *std::min_element(std.begin(), std.end()) == 0)
+					throw std::invalid_argument("Standard deviation thresholds of a list must be greater than 0");
+
+				if (hasFormattedDuplicates(std, "%g"))
+					throw std::invalid_argument("Standard deviation thresholds must be distinct (they name the outputs)");
 
 				meank = result["meank"].as<int>();
 
 				if (meank < 1)
 					throw std::invalid_argument("Mean number of neighbors cannot be less than 1");
 
-				isFilterRequested = std > 0 && meank > 1;
+				isFilterRequested = std.front() > 0 && meank > 1;
+			}
+
+			const auto mode = result["threshold-mode"].as<std::string>();
+
+			if (mode == "stdev")
+				thresholdMode = ThresholdMode::Stdev;
+			else if (mode == "mad")
+				thresholdMode = ThresholdMode::Mad;
+			else
+				throw std::invalid_argument(string_format("Unknown threshold mode '%s'", mode.c_str()));
+
+			if (result.count("knn-eps")) {
+
+				knnEps = result["knn-eps"].as<double>();
+
+				if (knnEps < 0)
+					throw std::invalid_argument("Approximate neighbors search error bound cannot be less than 0");
+			}
+
+			if (result.count("bounded-knn")) {
+
+				const auto samples = result["bounded-knn"].as<int>();
+
+				if (samples < 0)
+					throw std::invalid_argument("Number of threshold estimation points cannot be less than 0");
+
+				if (samples > 0 && knnEps > 0)
+					throw std::invalid_argument("Bounded neighbors search cannot be combined with the approximate search");
+
+				boundedKnn = samples;
+			}
+
+			if (result.count("knn-verify")) {
+
+				const auto samples = result["knn-verify"].as<int>();
+
+				if (samples < 0)
+					throw std::invalid_argument("Number of verification points cannot be less than 0");
+
+				if (samples > 0 && knnEps == 0)
+					throw std::invalid_argument("Neighbors search verification needs the approximate search (--knn-eps)");
+
+				knnVerify = samples;
+			}
+
+			if (result.count("dedup")) {
+
+				const auto method = result["dedup"].as<std::string>();
+
+				if (method == "hash")
+					dedupMethod = DedupMethod::Hash;
+				else if (method == "sort")
+					dedupMethod = DedupMethod::Sort;
+				else
+					throw std::invalid_argument("Deduplication method must be hash or sort");
+
+				isDedupRequested = true;
+			}
+
+			if (result.count("dedup-merge")) {
+
+				if (!isDedupRequested)
+					throw std::invalid_argument("Option '--dedup-merge' requires '--dedup'");
+
+				dedupMerge = true;
 			}
 
 			if (result.count("radius")) {
 
-				radius = result["radius"].as<double>();
+				radius = result["radius"].as<std::vector<double>>();
 
-				if (radius < 0)
+				if (radius.empty())
+					throw std::invalid_argument("Sample radius is empty");
+
+				if (radius.front() < 0)
 					throw std::invalid_argument("Sample radius cannot be less than 0");
 
+				for (size_t i = 1; i < radius.size(); ++i)
+					if (radius[i] <= radius[i - 1])
+						throw std::invalid_argument("Sample radii must be in increasing order");
+
+				if (hasFormattedDuplicates(radius, "%g"))
+					throw std::invalid_argument("Sample radii must be distinct (they name the outputs)");
+
+				if (radius.size() > 1 && result.count("std") && result["std"].as<std::vector<double>>().size() > 1)
+					throw std::invalid_argument("Multiple sampling radii cannot be combined with multiple standard deviation thresholds");
+
 				isSampleRequested = true;
 
 			}
 			
+			if (result.count("min-neighbors")) {
+
+				minNeighbors = result["min-neighbors"].as<int>();
+
+				if (minNeighbors < 1)
+					throw std::invalid_argument("Minimum number of neighbors cannot be less than 1");
+
+				isRadiusFilterRequested = true;
+			}
+
+			if (result.count("neighbors-radius")) {
+
+				neighborsRadius = result["neighbors-radius"].as<double>();
+
+				if (neighborsRadius <= 0)
+					throw std::invalid_argument("Neighbors radius must be greater than 0");
+
+			}
+
+			if (result.count("estimate-normals")) {
+
+				normalsNeighbors = result["estimate-normals"].as<int>();
+
+				if (normalsNeighbors < 3)
+					throw std::invalid_argument("Normals estimation needs at least 3 neighbors");
+
+				if (result.count("std") && result["std"].as<std::vector<double>>().size() > 1)
+					throw std::invalid_argument("Normals estimation cannot be combined with multiple standard deviation thresholds");
+
+				isNormalsRequested = true;
+			}
+
+			if (result.count("normals-viewpoint")) {
+
+				const auto viewpoint = result["normals-viewpoint"].as<std::vector<double>>();
+
+				if (viewpoint.size() != 3)
+					throw std::invalid_argument("Normals viewpoint must be x,y,z");
+
+				if (!isNormalsRequested)
+					throw std::invalid_argument("Option '--normals-viewpoint' requires '--estimate-normals'");
+
+				normalsOrientation.viewpoint = std::array<double, 3>{ viewpoint[0], viewpoint[1], viewpoint[2] };
+			}
+
+			seed = result["seed"].as<uint64_t>();
+
 			if (result.count("concurrency")) {
 
 				concurrency = result["concurrency"].as<int>();
@@ -149,13 +344,27 @@ namespace FPCFilter
 				concurrency = std::max(omp_get_num_procs(), 1);
 			
 
+			pinThreads = result.count("pin-threads") != 0;
+			perfCounters = result.count("perf-counters") != 0;
+
+			if (result.count("trace"))
+				trace = result["trace"].as<std::string>();
+
+			if (result.count("progress")) {
+
+				progress = result["progress"].as<int>();
+
+				if (progress < 0)
+					throw std::invalid_argument("Progress file descriptor cannot be less than 0");
+			}
+
 			verbose = result.count("verbose") != 0;
 
 			if (result.count("boundary")) {
 
 				const auto boundaryFile = result["boundary"].as<std::string>();
 
-				boundary = extractPolygon(boundaryFile);
+				boundary = Polygon::fromGeoJSON(boundaryFile);
 
 				if (!boundary.has_value())
 					throw std::invalid_argument(string_format("Boundary file '%s' does not contain a valid GeoJSON POLYGON", boundaryFile.c_str()));
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "vendor/json.hpp"
+
+namespace FPCFilter {
+
+    // Hardware performance counters of the process (Linux perf_event_open): cycles, instructions, last level
+    // cache misses and branch misses, in user space, summed over all the threads.
+    // Every counter is opened by the main thread with inherit set, so the threads it creates afterwards (the
+    // OpenMP pool) are counted too: enable must run before the first parallel region. A counter that cannot be
+    // opened (no PMU in a VM, perf_event_paranoid, other OS) is reported as unavailable and the run goes on
+    class PerfCounters {
+
+    public:
+        static constexpr size_t COUNT = 4;
+
+        // Counter values, scaled when the kernel multiplexed them; -1 when unavailable
+        struct Values {
+            int64_t values[COUNT] = { -1, -1, -1, -1 };
+        };
+
+    private:
+        struct Counter {
+            const char* name;
+            uint32_t type;
+            uint64_t config;
+        };
+
+        int fds[COUNT] = { -1, -1, -1, -1 };
+        std::atomic<bool> isEnabled{ false };
+        std::string error;
+
+        static const Counter* counters()
+        {
+#ifdef __linux__
+            static const Counter list[COUNT] = {
+                { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+                { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+                { "llc_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+                { "branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES }
+            };
+#else
+            static const Counter list[COUNT] = {
+                { "cycles", 0, 0 }, { "instructions", 0, 0 }, { "llc_misses", 0, 0 }, { "branch_misses", 0, 0 }
+            };
+#endif
+            return list;
+        }
+
+        PerfCounters() = default;
+
+        ~PerfCounters()
+        {
+#ifdef __linux__
+            for (const auto fd : fds)
+                if (fd >= 0)
+                    close(fd);
+#endif
+        }
+
+    public:
+        static PerfCounters& get()
+        {
+            static PerfCounters counters;
+            return counters;
+        }
+
+        static bool enabled()
+        {
+            return get().isEnabled.load(std::memory_order_relaxed);
+        }
+
+        // Opens the counters. Returns false when none is available (see lastError)
+        bool enable()
+        {
+#ifdef __linux__
+            size_t opened = 0;
+
+            for (size_t i = 0; i < COUNT; ++i)
+            {
+                if (fds[i] >= 0) {
+                    ++opened;
+                    continue;
+                }
+
+                perf_event_attr attr;
+                std::memset(&attr, 0, sizeof(attr));
+
+                attr.size = sizeof(attr);
+                attr.type = counters()[i].type;
+                attr.config = counters()[i].config;
+                attr.exclude_kernel = 1;
+                attr.exclude_hv = 1;
+                attr.inherit = 1;
+                attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+                // This process and its future threads, on any CPU
+                fds[i] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC));
+
+                if (fds[i] < 0) {
+                    error = std::string(counters()[i].name) + ": " + std::strerror(errno);
+                    continue;
+                }
+
+                ++opened;
+            }
+
+            isEnabled.store(opened > 0, std::memory_order_relaxed);
+
+            return opened > 0;
+#else
+            error = "not supported on this platform";
+            return false;
+#endif
+        }
+
+        // Why the last counter failed to open (empty if all of them are available)
+        const std::string& lastError() const
+        {
+            return error;
+        }
+
+        Values read() const
+        {
+            Values values;
+
+#ifdef __linux__
+            for (size_t i = 0; i < COUNT; ++i)
+            {
+                if (fds[i] < 0)
+                    continue;
+
+                // value, time enabled, time running
+                uint64_t data[3] = { 0, 0, 0 };
+
+                if (::read(fds[i], data, sizeof(data)) != sizeof(data))
+                    continue;
+
+                if (data[2] == 0)
+                    values.values[i] = 0;
+                else if (data[2] < data[1])
+                    values.values[i] = static_cast<int64_t>(static_cast<double>(data[0]) * data[1] / data[2]);
+                else
+                    values.values[i] = static_cast<int64_t>(data[0]);
+            }
+#endif
+            return values;
+        }
+
+        // Counts between two reads, null for the unavailable counters, plus the instructions per cycle
+        static nlohmann::json difference(const Values& start, const Values& end)
+        {
+            nlohmann::json result = nlohmann::json::object();
+
+            for (size_t i = 0; i < COUNT; ++i)
+            {
+                if (start.values[i] < 0 || end.values[i] < 0)
+                    result[counters()[i].name] = nullptr;
+                else
+                    result[counters()[i].name] = end.values[i] - start.values[i];
+            }
+
+            if (result["cycles"].is_number() && result["instructions"].is_number() && result["cycles"].get<int64_t>() > 0)
+                result["ipc"] = result["instructions"].get<double>() / result["cycles"].get<double>();
+
+            return result;
+        }
+    };
+
+}
@@ -5,16 +5,24 @@
 #include <functional>
 #include <filesystem>
 #include <map>
+#include <set>
 
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <exception>
 
 #include "ply.hpp"
 #include "common.hpp"
+#include "utils.hpp"
 
 #include "fastsamplefilter.hpp"
 #include "fastoutlierfilter.hpp"
+#include "radiusoutlierfilter.hpp"
+#include "normalestimator.hpp"
+#include "duplicatefilter.hpp"
+#include "kdtree.hpp"
+#include "metrics.hpp"
 
 namespace fs = std::filesystem;
 
@@ -26,43 +34,165 @@ namespace FPCFilter
 
 		std::unique_ptr<PlyFile> ply;
 
+		// Spatial index shared by the stages: built when the first stage needs it, and then compacted
+		// along with the points by the stages that remove them (or rebuilt, when they remove most of them)
+		std::unique_ptr<KDTree> index;
+
+		// Inliers of every threshold of a statistical filter sweep
+		std::vector<std::pair<double, Compaction>> sweep;
+
+		// Points of every level of detail (nested: every level is sampled from the previous one)
+		std::vector<std::pair<double, Compaction>> levels;
+
+		// Original index of every point of an in memory cloud
+		std::vector<size_t> ids;
+
 		std::ostream& log;
 
 		std::string source;
 		bool isLoaded = false;
 		bool isVerbose = false;
 		nlohmann::json *stats;
+		uint64_t seed;
 
 	public:
-		Pipeline(const std::string &source, std::ostream& logstream, const bool verbose, nlohmann::json *stats) : 
-			source(source), isVerbose(verbose), log(logstream), stats(stats) {}
+		Pipeline(const std::string &source, std::ostream& logstream, const bool verbose, nlohmann::json *stats, uint64_t seed = 0) : 
+			source(source), isVerbose(verbose), log(logstream), stats(stats), seed(seed) {}
+
+		// In memory cloud: every stage keeps track of the original index of the surviving points (see survivors)
+		// The index, if any, must contain the points of the cloud
+		Pipeline(std::unique_ptr<PlyFile> cloud, std::ostream& logstream, const bool verbose, nlohmann::json *stats, uint64_t seed = 0, std::unique_ptr<KDTree> cloudIndex = nullptr) :
+			ply(std::move(cloud)), index(std::move(cloudIndex)), isLoaded(true), isVerbose(verbose), log(logstream), stats(stats), seed(seed)
+		{
+			this->ids.resize(this->ply->points.size());
+
+			#pragma omp parallel for schedule(static)
+			for (long long i = 0; i < this->ids.size(); ++i)
+				this->ids[i] = i;
+		}
 
 		void load()
 		{
 			const auto start = std::chrono::steady_clock::now();
 
+			StageMetrics metrics("load", 0);
+
 			this->ply = std::make_unique<PlyFile>(this->source);
 
 			this->isLoaded = true;
 
+			metrics.setPointsIn(this->ply->vertexCount);
+			metrics.record(stats, this->ply->points.size());
+
 			if (this->isVerbose) {
 				const std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
 				log << " ?> Loaded " << this->ply->points.size() << " points in " << diff.count() << "s" << std::endl;
 			}
 		}
 
+		// Removes the points from the cloud and from the index
+		void compact(const Compaction& compaction)
+		{
+			if (!this->sweep.empty())
+				throw std::invalid_argument("A statistical filter with multiple thresholds must be the last stage");
+
+			if (!this->levels.empty())
+				throw std::invalid_argument("A sampling with multiple radii must be the last stage");
+
+			StageMetrics metrics("compaction", this->ply->points.size());
+
+			this->ply->compact(compaction);
+
+			if (!this->ids.empty())
+				compaction.apply(this->ids);
+
+			// Most of the leaves of a tree that lost more than half of its points are sparse: a new tree over the
+			// survivors (built on the next use) costs less than the searches it saves
+			if (this->index && compaction.size() * 2 < compaction.mask().size())
+				this->index.reset();
+			else if (this->index)
+				this->index->compact(compaction);
+
+			metrics.record(stats, this->ply->points.size());
+		}
+
+		KDTree& getIndex()
+		{
+			if (!this->isLoaded)
+				this->load();
+
+			if (!this->index)
+			{
+				const auto start = std::chrono::steady_clock::now();
+
+				Progress::get().begin("index", this->ply->points.size());
+
+				StageMetrics metrics("index", this->ply->points.size());
+
+				this->index = std::make_unique<KDTree>(this->ply->points);
+
+				metrics.record(stats, this->index->size(), { {"memory", this->index->memoryUsage()} });
+
+				const std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
+
+				(*stats)["index"] = {
+					{"build_time", diff.count()},
+					{"points", this->index->size()}
+				};
+
+				if (this->isVerbose)
+					log << " ?> Built index of " << this->index->size() << " points in " << diff.count() << "s (" << simd::kernel().name << " distance kernels)" << std::endl;
+			}
+
+			return *this->index;
+		}
+
+		bool loaded() const
+		{
+			return this->isLoaded;
+		}
+
+		// Original index of the surviving points of an in memory cloud
+		const std::vector<size_t>& survivors() const
+		{
+			return this->ids;
+		}
+
+		// Surviving points (the cloud must be loaded)
+		const PlyFile& cloud() const
+		{
+			return *this->ply;
+		}
+
+		// Number of points in the cloud (0 until it is loaded)
+		size_t size() const
+		{
+			return this->isLoaded ? this->ply->points.size() : 0;
+		}
+
 		void crop(const Polygon &p)
+		{
+			crop([&p](const float x, const float y, const float z) { return p.inside(x, y); });
+		}
+
+		// Keeps the points that satisfy the predicate. Before the cloud is loaded, the predicate is
+		// evaluated by the reader
+		void crop(const std::function<bool(const float x, const float y, const float z)>& inside)
 		{
 
 			if (!this->isLoaded)
 			{
 				const auto start = std::chrono::steady_clock::now();
 
-				this->ply = std::make_unique<PlyFile>(this->source, [&p](const float x, const float y, const float z)
-													  { return p.inside(x, y); });
+				StageMetrics metrics("load", 0);
+
+				this->ply = std::make_unique<PlyFile>(this->source, inside);
 
 				this->isLoaded = true;
 
+				metrics.setPointsIn(this->ply->vertexCount);
+				metrics.record(stats, this->ply->points.size(), { {"read_time_filter", true} });
+
 				if (this->isVerbose) {
 					const std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
 					log << " ?> Loaded " << this->ply->points.size() << " points (cropped) in " << diff.count() << "s" << std::endl;
@@ -71,7 +201,49 @@ namespace FPCFilter
 				return;
 			}
 
-			throw NotImplementedException("Filtering loaded ply is not supported");
+			const auto start = std::chrono::steady_clock::now();
+
+			auto& points = this->ply->points;
+
+			StageMetrics metrics("crop", points.size());
+
+			std::vector<uint8_t> keep(points.size());
+
+			#pragma omp parallel for schedule(static)
+			for (long long i = 0; i < points.size(); ++i)
+				keep[i] = inside(points[i].x, points[i].y, points[i].z);
+
+			const Compaction compaction(std::move(keep));
+
+			metrics.record(stats, compaction.size());
+
+			this->compact(compaction);
+
+			if (this->isVerbose) {
+				const std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
+				log << " ?> Cropped " << compaction.size() << " points (" << compaction.removed() << " removed) in " << diff.count() << "s" << std::endl;
+			}
+		}
+
+		// Drops the normals from the cloud (and from the output)
+		void dropNormals()
+		{
+			if (!this->isLoaded)
+				this->load();
+
+			this->ply->extras.clear();
+			this->ply->extras.shrink_to_fit();
+		}
+
+		// Removes the exact duplicates: meant to run before the spatial stages
+		void dedup(DedupMethod method, bool merge)
+		{
+			if (!this->isLoaded)
+				this->load();
+
+			DuplicateFilter filter(method, merge, this->log, this->isVerbose, stats);
+
+			this->compact(filter.run(*this->ply));
 		}
 
 		void sample(double radius)
@@ -81,17 +253,102 @@ namespace FPCFilter
 
 			FastSampleFilter filter(radius, this->log, this->isVerbose);
 
-			filter.run(*this->ply);
+			const auto& index = this->getIndex();
+
+			StageMetrics metrics("sample", this->ply->points.size());
+
+			const auto compaction = filter.run(*this->ply, index);
+
+			metrics.record(stats, compaction.size());
+
+			this->compact(compaction);
 		}
 
-		void filter(double std, int meank)
+		// Levels of detail, written as one output for every radius (see suffixedTarget). The first level is the cloud
+		// itself, sampled with the first radius by a previous stage; every following level is sampled from the
+		// survivors of the previous one, so the levels are nested and only the points of the finer level are candidates
+		void levelsOfDetail(const std::vector<double>& radii)
 		{
 			if (!this->isLoaded)
 				this->load();
 
-			FastOutlierFilter filter(std, meank, this->log, this->isVerbose, stats);
+			if (!this->sweep.empty())
+				throw std::invalid_argument("Multiple sampling radii cannot be combined with multiple statistical filter thresholds");
+
+			const auto np = this->ply->points.size();
+
+			this->levels.clear();
+			this->levels.emplace_back(radii.front(), Compaction(std::vector<uint8_t>(np, 1)));
+
+			(*stats)["lod"] = nlohmann::json::array();
+			(*stats)["lod"].push_back({ {"radius", radii.front()}, {"points", np} });
+
+			for (size_t i = 1; i < radii.size(); ++i)
+			{
+				const auto& finer = this->levels.back();
+
+				FastSampleFilter filter(radii[i], this->log, this->isVerbose);
+
+				const auto& index = this->getIndex();
+
+				StageMetrics metrics("sample", finer.second.size());
+
+				auto compaction = filter.run(*this->ply, index, &finer.second.mask());
+
+				metrics.record(stats, compaction.size(), { {"level", i} });
 
-			filter.run(*this->ply);
+				(*stats)["lod"].push_back({ {"radius", radii[i]}, {"points", compaction.size()} });
+
+				if (this->isVerbose)
+					log << " ?> Level " << i << " (radius " << radii[i] << "): " << compaction.size() << " points" << std::endl;
+
+				this->levels.emplace_back(radii[i], std::move(compaction));
+			}
+		}
+
+		// With more than one standard deviation threshold, the cloud is left untouched and write
+		// produces one output for every threshold (see suffixedTarget)
+		void filter(const std::vector<double>& std, int meank, double eps = 0, size_t verifySamples = 0, const std::string& cachePath = "", size_t boundedSamples = 0, ThresholdMode mode = ThresholdMode::Stdev)
+		{
+			if (!this->isLoaded)
+				this->load();
+
+			FastOutlierFilter filter(std, mode, meank, eps, verifySamples, boundedSamples, this->seed, cachePath, this->log, this->isVerbose, stats);
+
+			auto compactions = filter.run(*this->ply, [this]() -> const KDTree& { return this->getIndex(); });
+
+			if (compactions.size() == 1) {
+				this->compact(compactions.front());
+				return;
+			}
+
+			for (size_t i = 0; i < compactions.size(); ++i)
+				this->sweep.emplace_back(std[i], std::move(compactions[i]));
+		}
+
+		void radiusFilter(int minNeighbors, std::optional<double> radius)
+		{
+			if (!this->isLoaded)
+				this->load();
+
+			RadiusOutlierFilter filter(minNeighbors, radius, this->seed, this->log, this->isVerbose, stats);
+
+			this->compact(filter.run(*this->ply, this->getIndex()));
+		}
+
+		// Replaces the normals with the ones estimated from the k nearest neighbors of every point
+		void estimateNormals(int k, const NormalOrientation& orientation)
+		{
+			if (!this->isLoaded)
+				this->load();
+
+			// The cloud still holds the points of every threshold: the neighborhoods would include the outliers
+			if (!this->sweep.empty())
+				throw std::invalid_argument("Normals estimation cannot be combined with multiple statistical filter thresholds");
+
+			NormalEstimator estimator(k, orientation, this->log, this->isVerbose, stats);
+
+			estimator.run(*this->ply, this->getIndex());
 		}
 
 		void write(const std::string &target)
@@ -100,6 +357,65 @@ namespace FPCFilter
 			if (!this->isLoaded)
 				this->load();
 
+			if (this->sweep.empty() && this->levels.empty()) {
+				writeFile(target, nullptr);
+				return;
+			}
+
+			// One file for every threshold of the sweep or every level of detail, written concurrently
+
+			const auto isSweep = !this->sweep.empty();
+			const auto& outputs = isSweep ? this->sweep : this->levels;
+
+			std::vector<std::string> targets;
+			for (const auto& o : outputs)
+				targets.push_back(suffixedTarget(target, string_format(isSweep ? "_std%g" : "_r%g", o.first)));
+
+			// Every output is written by its own thread
+			if (std::set<std::string>(targets.begin(), targets.end()).size() != targets.size())
+				throw std::invalid_argument(isSweep ? "Standard deviation thresholds must be distinct (they name the outputs)" : "Sample radii must be distinct (they name the outputs)");
+
+			std::vector<std::exception_ptr> errors(targets.size());
+
+			#pragma omp parallel for schedule(dynamic, 1)
+			for (long long i = 0; i < targets.size(); ++i)
+			{
+				try {
+					writeFile(targets[i], &outputs[i].second.mask());
+				}
+				catch (...) {
+					errors[i] = std::current_exception();
+				}
+			}
+
+			for (const auto& error : errors)
+				if (error)
+					std::rethrow_exception(error);
+
+			for (size_t i = 0; i < targets.size(); ++i) {
+
+				if (isSweep)
+					(*stats)["statistical_filter"]["sweep"][i]["output"] = targets[i];
+				else
+					(*stats)["lod"][i]["output"] = targets[i];
+
+				if (this->isVerbose)
+					log << " ?> Wrote " << outputs[i].second.size() << " points (" << (isSweep ? "std" : "radius") << " = " << outputs[i].first << ") to " << targets[i] << std::endl;
+			}
+		};
+
+	private:
+
+		// Output path of a sweep threshold (<stem>_std<value><extension>) or of a level of detail (<stem>_r<radius><extension>)
+		static std::string suffixedTarget(const std::string& target, const std::string& suffix)
+		{
+			const fs::path path(target);
+
+			return (path.parent_path() / (path.stem().string() + suffix + path.extension().string())).string();
+		}
+
+		void writeFile(const std::string& target, const std::vector<uint8_t>* mask)
+		{
 			if (fs::exists(target))
 				fs::remove(target);
 
@@ -108,10 +424,25 @@ namespace FPCFilter
 			if (!writer.is_open())
 				throw std::invalid_argument(std::string("Cannot open file ") + target);
 
-			this->ply->write(writer);
+			StageMetrics metrics("write", this->ply->points.size());
+
+			try {
+				this->ply->write(writer, mask);
+			}
+			catch (const Cancelled&) {
+				// No partial output
+				writer.close();
+				fs::remove(target);
+				throw;
+			}
 
 			writer.close();
-		};
+
+			const auto written = mask != nullptr ? static_cast<size_t>(std::count_if(mask->begin(), mask->end(), [](const uint8_t m) { return m != 0; })) : this->ply->points.size();
+
+			#pragma omp critical
+			metrics.record(stats, written, { {"output", target} });
+		}
 	};
 
 }
\ No newline at end of file
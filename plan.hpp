@@ -0,0 +1,423 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "common.hpp"
+#include "utils.hpp"
+#include "pipeline.hpp"
+
+namespace FPCFilter
+{
+
+	// Ordered list of stages read from a JSON pipeline description:
+	//
+	//   { "stages": [
+	//       { "type": "crop", "boundary": "area.geojson" },
+	//       { "type": "bbox", "min": [0, 0, -10], "max": [100, 100, 50] },
+	//       { "type": "project", "normals": false },
+	//       { "type": "dedup", "method": "hash", "merge": false },
+	//       { "type": "sample", "radius": 0.1 },
+	//       { "type": "radius_filter", "min_neighbors": 4 },
+	//       { "type": "filter", "std": 2.5, "meank": 16 },
+	//       { "type": "normals", "neighbors": 16, "viewpoint": [0, 0, 100] }
+	//   ] }
+	//
+	// Adjacent per point stages (crop, bbox, project) are fused in a single pass over the points. When they
+	// come first, their predicates are evaluated by the reader, so the discarded points are never stored
+	class Plan
+	{
+
+		using Predicate = std::function<bool(const float x, const float y, const float z)>;
+
+		struct Stage
+		{
+			std::string type;
+
+			// Per point stages
+			Predicate predicate;
+			bool dropNormals = false;
+
+			// Whole cloud stages
+			std::function<void(Pipeline&)> action;
+			bool needsIndex = false;
+
+			// Set when the stage writes several outputs (a list of thresholds or radii): no stage can follow it
+			std::string lastOnly;
+
+			bool isPerPoint() const
+			{
+				return !this->action;
+			}
+		};
+
+		struct Step
+		{
+			std::vector<Stage> stages;
+			bool isFused = false;
+			bool isReadTime = false;
+
+			// True if a stage of the step discards points (a projection alone does not)
+			bool hasPredicate() const
+			{
+				for (const auto& stage : this->stages)
+					if (stage.predicate)
+						return true;
+
+				return false;
+			}
+
+			std::string name() const
+			{
+				std::string name;
+				for (const auto& stage : this->stages)
+					name += (name.empty() ? "" : " + ") + stage.type;
+				return name;
+			}
+		};
+
+		std::vector<Step> steps;
+
+		template <class T>
+		static T required(const nlohmann::json& stage, const char* key)
+		{
+			if (!stage.contains(key))
+				throw std::invalid_argument(string_format("Missing '%s'", key));
+
+			return stage[key].get<T>();
+		}
+
+		static Stage parseStage(const nlohmann::json& j)
+		{
+			Stage stage;
+			stage.type = required<std::string>(j, "type");
+
+			if (stage.type == "crop") {
+
+				const auto boundary = required<std::string>(j, "boundary");
+				const auto polygon = Polygon::fromGeoJSON(boundary);
+
+				if (!polygon.has_value())
+					throw std::invalid_argument(string_format("Boundary file '%s' does not contain a valid GeoJSON POLYGON", boundary.c_str()));
+
+				stage.predicate = [p = polygon.value()](const float x, const float y, const float z) { return p.inside(x, y); };
+
+			} else if (stage.type == "bbox") {
+
+				const auto min = required<std::vector<float>>(j, "min");
+				const auto max = required<std::vector<float>>(j, "max");
+
+				if (min.size() != 3 || max.size() != 3)
+					throw std::invalid_argument("Bounding box corners must be [x, y, z]");
+
+				stage.predicate = [min, max](const float x, const float y, const float z) {
+					return x >= min[0] && x <= max[0] && y >= min[1] && y <= max[1] && z >= min[2] && z <= max[2];
+				};
+
+			} else if (stage.type == "project") {
+
+				stage.dropNormals = !j.value("normals", true);
+
+			} else if (stage.type == "dedup") {
+
+				const auto methodName = j.value("method", std::string("hash"));
+
+				DedupMethod method;
+				if (methodName == "hash")
+					method = DedupMethod::Hash;
+				else if (methodName == "sort")
+					method = DedupMethod::Sort;
+				else
+					throw std::invalid_argument(string_format("Unknown deduplication method '%s'", methodName.c_str()));
+
+				const auto merge = j.value("merge", false);
+
+				stage.action = [method, merge](Pipeline& pipeline) { pipeline.dedup(method, merge); };
+
+			} else if (stage.type == "sample") {
+
+				const auto radii = j.contains("radius") && j["radius"].is_array() ? j["radius"].get<std::vector<double>>() : std::vector<double>{ required<double>(j, "radius") };
+
+				if (radii.empty())
+					throw std::invalid_argument("Sample radius is empty");
+
+				for (size_t i = 0; i < radii.size(); ++i)
+					if (radii[i] <= 0 || (i > 0 && radii[i] <= radii[i - 1]))
+						throw std::invalid_argument("Sample radii must be greater than 0 and in increasing order");
+
+				if (hasFormattedDuplicates(radii, "%g"))
+					throw std::invalid_argument("Sample radii must be distinct (they name the outputs)");
+
+				stage.action = [radii](Pipeline& pipeline) {
+					pipeline.sample(radii.front());
+
+					if (radii.size() > 1)
+						pipeline.levelsOfDetail(radii);
+				};
+				stage.needsIndex = true;
+
+				if (radii.size() > 1)
+					stage.lastOnly = "A sampling with multiple radii must be the last stage";
+
+			} else if (stage.type == "radius_filter") {
+
+				const auto minNeighbors = required<int>(j, "min_neighbors");
+
+				if (minNeighbors < 1)
+					throw std::invalid_argument("Minimum number of neighbors cannot be less than 1");
+
+				std::optional<double> radius;
+
+				if (j.contains("radius")) {
+
+					radius = j["radius"].get<double>();
+
+					if (radius <= 0)
+						throw std::invalid_argument("Neighbors radius must be greater than 0");
+				}
+
+				stage.action = [minNeighbors, radius](Pipeline& pipeline) { pipeline.radiusFilter(minNeighbors, radius); };
+				stage.needsIndex = true;
+
+			} else if (stage.type == "filter") {
+
+				const auto std = j.contains("std") && j["std"].is_array() ? j["std"].get<std::vector<double>>() : std::vector<double>{ required<double>(j, "std") };
+
+				if (std.empty())
+					throw std::invalid_argument("Standard deviation threshold is empty");
+
+				for (const auto s : std)
+					if (s <= 0)
+						throw std::invalid_argument("Standard deviation threshold must be greater than 0");
+
+				if (hasFormattedDuplicates(std, "%g"))
+					throw std::invalid_argument("Standard deviation thresholds must be distinct (they name the outputs)");
+
+				const auto meank = required<int>(j, "meank");
+
+				if (meank < 1)
+					throw std::invalid_argument("Mean number of neighbors cannot be less than 1");
+
+				const auto modeName = j.value("mode", std::string("stdev"));
+
+				ThresholdMode mode;
+				if (modeName == "stdev")
+					mode = ThresholdMode::Stdev;
+				else if (modeName == "mad")
+					mode = ThresholdMode::Mad;
+				else
+					throw std::invalid_argument(string_format("Unknown threshold mode '%s'", modeName.c_str()));
+
+				const auto eps = j.value("knn_eps", 0.0);
+				const auto verify = j.value("knn_verify", 0);
+				const auto bounded = j.value("bounded_knn", 0);
+				const auto cache = j.value("distance_cache", std::string());
+
+				if (eps < 0)
+					throw std::invalid_argument("Approximate neighbors search error bound cannot be less than 0");
+
+				if (verify < 0 || bounded < 0)
+					throw std::invalid_argument("Number of sampled points cannot be less than 0");
+
+				if (bounded > 0 && eps > 0)
+					throw std::invalid_argument("Bounded neighbors search cannot be combined with the approximate search");
+
+				if (verify > 0 && eps == 0)
+					throw std::invalid_argument("Neighbors search verification needs the approximate search (knn_eps)");
+
+				stage.action = [=](Pipeline& pipeline) {
+					pipeline.filter(std, meank, eps, static_cast<size_t>(verify), cache, static_cast<size_t>(bounded), mode);
+				};
+				stage.needsIndex = true;
+
+				if (std.size() > 1)
+					stage.lastOnly = "A statistical filter with multiple thresholds must be the last stage";
+
+			} else if (stage.type == "normals") {
+
+				const auto neighbors = j.value("neighbors", DEFAULT_NORMALS_NEIGHBORS);
+
+				if (neighbors < 3)
+					throw std::invalid_argument("Normals estimation needs at least 3 neighbors");
+
+				NormalOrientation orientation;
+
+				if (j.contains("viewpoint")) {
+
+					const auto viewpoint = j["viewpoint"].get<std::vector<double>>();
+
+					if (viewpoint.size() != 3)
+						throw std::invalid_argument("Normals viewpoint must be [x, y, z]");
+
+					orientation.viewpoint = std::array<double, 3>{ viewpoint[0], viewpoint[1], viewpoint[2] };
+				}
+
+				stage.action = [neighbors, orientation](Pipeline& pipeline) { pipeline.estimateNormals(neighbors, orientation); };
+				stage.needsIndex = true;
+
+			} else
+				throw std::invalid_argument(string_format("Unknown stage type '%s'", stage.type.c_str()));
+
+			return stage;
+		}
+
+		static nlohmann::json readSpec(const std::string& path)
+		{
+			std::ifstream reader(path);
+
+			if (!reader.is_open())
+				throw std::invalid_argument(std::string("Cannot open file ") + path);
+
+			nlohmann::json spec;
+
+			try {
+				reader >> spec;
+			}
+			catch (const nlohmann::json::exception& e) {
+				throw std::invalid_argument(string_format("Invalid pipeline description '%s': %s", path.c_str(), e.what()));
+			}
+
+			return spec;
+		}
+
+	public:
+		explicit Plan(const std::string& path) : Plan(readSpec(path)) {}
+
+		// Stage list, or object with a "stages" list
+		explicit Plan(const nlohmann::json& spec)
+		{
+			const auto& list = spec.is_array() ? spec : spec.value("stages", nlohmann::json());
+
+			if (!list.is_array() || list.empty())
+				throw std::invalid_argument("Pipeline description does not contain any stage");
+
+			for (size_t i = 0; i < list.size(); ++i)
+			{
+				Stage stage;
+
+				try {
+					stage = parseStage(list[i]);
+				}
+				catch (const std::exception& e) {
+					throw std::invalid_argument(string_format("Invalid pipeline stage %zu: %s", i + 1, e.what()));
+				}
+
+				// Checked here rather than by the pipeline, which would only fail after running the stages before
+				if (!stage.lastOnly.empty() && i + 1 < list.size())
+					throw std::invalid_argument(string_format("Invalid pipeline stage %zu: %s", i + 1, stage.lastOnly.c_str()));
+
+				// Fusion: a per point stage joins the previous step when that one is per point as well
+				if (stage.isPerPoint() && !this->steps.empty() && this->steps.back().isFused)
+				{
+					this->steps.back().stages.push_back(std::move(stage));
+					continue;
+				}
+
+				Step step;
+				step.isFused = stage.isPerPoint();
+				step.stages.push_back(std::move(stage));
+
+				this->steps.push_back(std::move(step));
+			}
+
+			// Predicate push down: nothing has been loaded before the first step. A projection alone has nothing to push
+			if (this->steps.front().isFused && this->steps.front().hasPredicate())
+				this->steps.front().isReadTime = true;
+		}
+
+		// True if a stage searches the spatial index
+		bool needsIndex() const
+		{
+			for (const auto& step : this->steps)
+				for (const auto& stage : step.stages)
+					if (stage.needsIndex)
+						return true;
+
+			return false;
+		}
+
+		void print(std::ostream& o) const
+		{
+			for (size_t i = 0; i < this->steps.size(); ++i)
+			{
+				const auto& step = this->steps[i];
+
+				o << "\t" << (i + 1) << ". " << step.name();
+
+				if (step.isReadTime)
+					o << " (read time)";
+				else if (step.isFused && step.stages.size() > 1)
+					o << " (fused)";
+
+				o << std::endl;
+			}
+		}
+
+		void run(Pipeline& pipeline, std::ostream& log, nlohmann::json* stats) const
+		{
+			auto& planStats = (*stats)["plan"] = nlohmann::json::array();
+
+			for (const auto& step : this->steps)
+			{
+				log << std::endl << " -> " << step.name() << std::endl << std::endl;
+
+				// An in memory cloud is already loaded
+				const auto isReadTime = step.isReadTime && !pipeline.loaded();
+
+				const auto start = std::chrono::steady_clock::now();
+
+				if (step.isFused)
+					runFused(pipeline, step);
+				else
+					step.stages.front().action(pipeline);
+
+				const std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
+
+				log << " ?> Done in " << diff.count() << "s" << std::endl;
+
+				planStats.push_back({
+					{"stages", step.name()},
+					{"fused", step.isFused},
+					{"read_time", isReadTime},
+					{"time", diff.count()},
+					{"points", pipeline.size()}
+				});
+			}
+		}
+
+	private:
+
+		// All the predicates of the step are evaluated in a single pass
+		static void runFused(Pipeline& pipeline, const Step& step)
+		{
+			std::vector<Predicate> predicates;
+			bool dropNormals = false;
+
+			for (const auto& stage : step.stages)
+			{
+				if (stage.predicate)
+					predicates.push_back(stage.predicate);
+
+				dropNormals |= stage.dropNormals;
+			}
+
+			if (predicates.size() == 1)
+				pipeline.crop(predicates.front());
+			else if (!predicates.empty())
+				pipeline.crop([&predicates](const float x, const float y, const float z) {
+					for (const auto& predicate : predicates)
+						if (!predicate(x, y, z))
+							return false;
+					return true;
+				});
+
+			if (dropNormals)
+				pipeline.dropNormals();
+		}
+	};
+
+}
@@ -4,7 +4,14 @@
 #include <iostream>
 #include <filesystem>
 #include <vector>
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <memory>
 #include "FPCFilter.h"
+#include "parallel.hpp"
+#include "progress.hpp"
+#include "trace.hpp"
 
 namespace FPCFilter {
 
@@ -20,6 +27,9 @@ namespace FPCFilter {
 
 		uint8_t views;
 
+		// Leaves the point uninitialized, so that a vector can be sized without touching its pages (see readBinaryBody)
+		PlyPoint() {}
+
 		PlyPoint(float x, float y, float z, uint8_t red, uint8_t green, uint8_t blue, uint8_t views) : x(x), y(y), z(z), red(red), green(green), blue(blue), views(views) {}
 
 	};
@@ -30,6 +40,8 @@ namespace FPCFilter {
 		float ny;
 		float nz;
 
+		PlyExtra() {}
+
 		PlyExtra(float nx, float ny, float nz) : nx(nx), ny(ny), nz(nz) {}
 	};
 
@@ -77,10 +89,31 @@ namespace FPCFilter {
 		std::vector<PlyExtra> extras;
 		std::vector<PlyPoint> points;
 
-        bool hasNormals() {
+		// Points in the source, before the read time filter
+		size_t vertexCount = 0;
+
+        bool hasNormals() const {
             return !extras.empty();
         }
 
+		// Removes the points (and their extras) discarded by the compaction plan, preserving the order
+		void compact(const Compaction& compaction) {
+
+			compaction.apply(points);
+
+			if (hasNormals())
+				compaction.apply(extras);
+		}
+
+		// In memory cloud (extras empty or parallel to the points)
+		PlyFile(std::vector<PlyPoint> points, std::vector<PlyExtra> extras) : points(std::move(points)), extras(std::move(extras)) {
+
+			vertexCount = this->points.size();
+
+			if (!this->extras.empty() && this->extras.size() != this->points.size())
+				throw std::invalid_argument("Normals count does not match points count");
+		}
+
 		PlyFile(const std::string& path, const std::function<bool(const float x, const float y, const float z)> filter = nullptr) {
 
 			std::ifstream reader(path);
@@ -114,6 +147,7 @@ namespace FPCFilter {
 
 				const auto vertexLine = getVertexLine(reader);
 				const auto count = getVertexCount(vertexLine);
+				vertexCount = count;
 
 				std::getline(reader, line);
 				if (line != "property float x")
@@ -149,11 +183,27 @@ namespace FPCFilter {
 
 				points.reserve(count);
 
+				auto& progress = Progress::get();
+				auto& counter = progress.local();
+
+				progress.begin("read", count);
+
+				size_t reported = 0;
+
+				const auto report = [&](size_t read) {
+					counter.add(read - reported);
+					reported = read;
+					progress.check();
+				};
+
 				if (filter) {
 
 					// Read points
 					for (auto i = 0; i < count; i++) {
 
+						if ((i & PROGRESS_MASK) == 0)
+							report(i);
+
 						float x, y, z;
 						int red, green, blue;
 						int views;
@@ -169,6 +219,9 @@ namespace FPCFilter {
 					// Read points
 					for (auto i = 0; i < count; i++) {
 
+						if ((i & PROGRESS_MASK) == 0)
+							report(i);
+
 						float x, y, z;
 						int red, green, blue;
 						int views;
@@ -177,7 +230,9 @@ namespace FPCFilter {
 
 						points.emplace_back(x, y, z, red, green, blue, views);						
 					}
-				}				
+				}
+
+				report(count);
 
 
 			// Otherwise it's a binary ply
@@ -201,6 +256,7 @@ namespace FPCFilter {
 
 				const auto vertexLine = getVertexLine(reader);
 				const auto count = getVertexCount(vertexLine);
+				vertexCount = count;
 
 				std::getline(reader, line);
 				if (line != "property float32 x")
@@ -251,69 +307,7 @@ namespace FPCFilter {
 				for (auto n = 0; n < 14; n++)
 					std::getline(reader, line);
 
-				points.reserve(count);
-				extras.reserve(count);
-
-				if (filter) {
-
-					// Read points
-					for (auto i = 0; i < count; i++) {
-
-						float x, y, z;
-						float nx, ny, nz;
-						uint8_t red, green, blue;
-						uint8_t views;
-
-						reader.read(reinterpret_cast<char*>(&x), sizeof(float));
-						reader.read(reinterpret_cast<char*>(&y), sizeof(float));
-						reader.read(reinterpret_cast<char*>(&z), sizeof(float));
-
-						reader.read(reinterpret_cast<char*>(&red), sizeof(uint8_t));
-						reader.read(reinterpret_cast<char*>(&green), sizeof(uint8_t));
-						reader.read(reinterpret_cast<char*>(&blue), sizeof(uint8_t));
-
-						reader.read(reinterpret_cast<char*>(&nx), sizeof(float));
-						reader.read(reinterpret_cast<char*>(&ny), sizeof(float));
-						reader.read(reinterpret_cast<char*>(&nz), sizeof(float));
-
-						reader.read(reinterpret_cast<char*>(&views), sizeof(uint8_t));
-
-						if (filter(x, y, z)) {
-							points.emplace_back(x, y, z, red, green, blue, views);
-							extras.emplace_back(nx, ny, nz);
-						}
-					}
-
-				}
-				else {
-
-					// Read points
-					for (auto i = 0; i < count; i++) {
-
-						float x, y, z;
-						float nx, ny, nz;
-						uint8_t red, green, blue;
-						uint8_t views;
-
-						reader.read(reinterpret_cast<char*>(&x), sizeof(float));
-						reader.read(reinterpret_cast<char*>(&y), sizeof(float));
-						reader.read(reinterpret_cast<char*>(&z), sizeof(float));
-
-						reader.read(reinterpret_cast<char*>(&red), sizeof(uint8_t));
-						reader.read(reinterpret_cast<char*>(&green), sizeof(uint8_t));
-						reader.read(reinterpret_cast<char*>(&blue), sizeof(uint8_t));
-
-						reader.read(reinterpret_cast<char*>(&nx), sizeof(float));
-						reader.read(reinterpret_cast<char*>(&ny), sizeof(float));
-						reader.read(reinterpret_cast<char*>(&nz), sizeof(float));
-
-						reader.read(reinterpret_cast<char*>(&views), sizeof(uint8_t));
-
-						points.emplace_back(x, y, z, red, green, blue, views);
-						extras.emplace_back(nx, ny, nz);
-
-					}
-				}
+				readBinaryBody(reader, count, filter);
 
 			} else
 				throw std::invalid_argument("Invalid PLY file");
@@ -322,14 +316,22 @@ namespace FPCFilter {
 
 		}
 
-		void write(std::ostream& o) {
+		// Writes the points as binary PLY. When a mask is given, only the points with a non zero mask are written.
+		// The points are encoded in chunks by parallel tasks and every chunk is written as soon as it is ready
+		// (in order), so the output overlaps the encoding of the following chunks. At most a window of chunks
+		// is encoded ahead of the writes
+		void write(std::ostream& o, const std::vector<uint8_t>* mask = nullptr) const {
 
 			const auto cnt = this->points.size();
 
+			size_t written = cnt;
+			if (mask != nullptr)
+				written = std::count_if(mask->begin(), mask->end(), [](const uint8_t m) { return m != 0; });
+
 			o << "ply" << std::endl;
 			o << "format binary_little_endian 1.0" << std::endl;
 			o << "comment Generated by FPCFilter v" << FPCFilter_VERSION_MAJOR << "." << FPCFilter_VERSION_MINOR << std::endl;
-			o << "element vertex " << cnt << std::endl;
+			o << "element vertex " << written << std::endl;
 
 			o << "property float x" << std::endl;
 			o << "property float y" << std::endl;
@@ -351,48 +353,222 @@ namespace FPCFilter {
 
 			o << "end_header" << std::endl;
 
-			if (hasNormals)
+			const size_t stride = hasNormals ? 28 : 16;
+			const size_t chunks = (cnt + CHUNK_POINTS - 1) / CHUNK_POINTS;
+			const size_t window = 2 * static_cast<size_t>(omp_get_max_threads());
+
+			std::vector<std::vector<char>> buffers(chunks);
+
+			auto& progress = Progress::get();
+			progress.begin("write", cnt);
+
+			#pragma omp parallel
+			#pragma omp single
+			for (size_t c = 0; c < chunks; ++c)
 			{
-				for (auto n = 0; n < cnt; n++)
+				// No new chunk once cancelled, the ones in flight are completed
+				if (progress.isCancelled())
+					break;
+
+				// Bounds the memory: encoding is much faster than writing, so without it almost every chunk would
+				// be encoded (a second copy of the output) before reaching the disk. The chunks of the previous
+				// window are written before the next one starts
+				if (c > 0 && c % window == 0) {
+					#pragma omp taskwait
+				}
+
+				auto& buffer = buffers[c];
+
+				#pragma omp task default(shared) firstprivate(c) depend(out: buffer)
 				{
-					const auto point = this->points[n];
-					const auto extra = this->extras[n];
+					TraceSpan span("encode");
 
-                    o.write(reinterpret_cast<const char*>(&point.x), sizeof(float));
-                    o.write(reinterpret_cast<const char*>(&point.y), sizeof(float));
-                    o.write(reinterpret_cast<const char*>(&point.z), sizeof(float));
+					const auto begin = c * CHUNK_POINTS;
+					const auto end = std::min(cnt, begin + CHUNK_POINTS);
 
-                    o.write(reinterpret_cast<const char*>(&extra.nx), sizeof(float));
-                    o.write(reinterpret_cast<const char*>(&extra.ny), sizeof(float));
-                    o.write(reinterpret_cast<const char*>(&extra.nz), sizeof(float));
+					buffer.resize((end - begin) * stride);
 
-                    o.write(reinterpret_cast<const char*>(&point.red), sizeof(uint8_t));
-                    o.write(reinterpret_cast<const char*>(&point.blue), sizeof(uint8_t));
-                    o.write(reinterpret_cast<const char*>(&point.green), sizeof(uint8_t));
+					char* out = buffer.data();
 
-                    o.write(reinterpret_cast<const char*>(&point.views), sizeof(uint8_t));
+					for (size_t n = begin; n < end; n++)
+					{
+						if (mask != nullptr && !(*mask)[n])
+							continue;
 
+						const auto& point = this->points[n];
+
+						std::memcpy(out, &point.x, sizeof(float) * 3);
+						out += sizeof(float) * 3;
+
+						if (hasNormals)
+						{
+							const auto& extra = this->extras[n];
+
+							std::memcpy(out, &extra.nx, sizeof(float) * 3);
+							out += sizeof(float) * 3;
+						}
+
+						*out++ = static_cast<char>(point.red);
+						*out++ = static_cast<char>(point.blue);
+						*out++ = static_cast<char>(point.green);
+						*out++ = static_cast<char>(point.views);
+					}
+
+					buffer.resize(out - buffer.data());
 				}
 
-			} else
+				// The dependency on the stream serializes the writes, in chunk order
+				#pragma omp task default(shared) firstprivate(c) depend(in: buffer) depend(inout: o)
+				{
+					TraceSpan span("write chunk", "io");
+
+					o.write(buffer.data(), buffer.size());
+					std::vector<char>().swap(buffer);
+
+					progress.local().add(std::min(CHUNK_POINTS, cnt - c * CHUNK_POINTS));
+				}
+			}
+
+			progress.check();
+		}
+
+	private:
+
+		// Points read, decoded or encoded by a task
+		static constexpr size_t CHUNK_POINTS = 65536;
+
+		// The ASCII reader reports its progress (and checks for cancellation) every PROGRESS_MASK + 1 points
+		static constexpr int PROGRESS_MASK = 65535;
+
+		// Body of a binary PLY (x y z red green blue nx ny nz views, 28 bytes per point). One thread reads the
+		// file chunk by chunk while parallel tasks decode (and filter) the chunks already read.
+		// Without a filter the tasks decode straight into the final arrays (sized up front, their pages are only
+		// touched by the decoding). With a filter the size is only known at the end: every chunk keeps its points
+		// until they are gathered, and is freed right after, so the memory stays close to one copy of the cloud
+		void readBinaryBody(std::ifstream& reader, size_t count, const std::function<bool(const float x, const float y, const float z)>& filter) {
+
+			constexpr size_t stride = 28;
+
+			const size_t chunks = (count + CHUNK_POINTS - 1) / CHUNK_POINTS;
+
+			std::vector<std::vector<PlyPoint>> chunkPoints(filter ? chunks : 0);
+			std::vector<std::vector<PlyExtra>> chunkExtras(filter ? chunks : 0);
+
+			if (!filter) {
+				points.resize(count);
+				extras.resize(count);
+			}
+
+			bool truncated = false;
+
+			auto& progress = Progress::get();
+			progress.begin("read", count);
+
+			#pragma omp parallel
+			#pragma omp single
+			for (size_t c = 0; c < chunks; ++c)
 			{
-				for (auto n = 0; n < cnt; n++)
+				if (progress.isCancelled())
+					break;
+
+				const auto n = std::min(CHUNK_POINTS, count - c * CHUNK_POINTS);
+
+				auto buffer = std::make_shared<std::vector<char>>(n * stride);
+
+				TraceSpan readSpan("read chunk", "io");
+
+				reader.read(buffer->data(), buffer->size());
+
+				readSpan.end();
+
+				if (static_cast<size_t>(reader.gcount()) != buffer->size()) {
+					truncated = true;
+					break;
+				}
+
+				#pragma omp task default(shared) firstprivate(c, n, buffer)
 				{
-					const auto point = this->points[n];
+					TraceSpan span("decode");
 
-                    o.write(reinterpret_cast<const char*>(&point.x), sizeof(float));
-                    o.write(reinterpret_cast<const char*>(&point.y), sizeof(float));
-                    o.write(reinterpret_cast<const char*>(&point.z), sizeof(float));
+					PlyPoint* pts = nullptr;
+					PlyExtra* ext = nullptr;
+					size_t kept = 0;
 
-                    o.write(reinterpret_cast<const char*>(&point.red), sizeof(uint8_t));
-                    o.write(reinterpret_cast<const char*>(&point.blue), sizeof(uint8_t));
-                    o.write(reinterpret_cast<const char*>(&point.green), sizeof(uint8_t));
+					if (filter) {
+						chunkPoints[c].resize(n);
+						chunkExtras[c].resize(n);
+						pts = chunkPoints[c].data();
+						ext = chunkExtras[c].data();
+					}
+					else {
+						pts = points.data() + c * CHUNK_POINTS;
+						ext = extras.data() + c * CHUNK_POINTS;
+					}
 
-                    o.write(reinterpret_cast<const char*>(&point.views), sizeof(uint8_t));
+					const char* in = buffer->data();
 
+					for (size_t i = 0; i < n; ++i, in += stride)
+					{
+						float xyz[3], normal[3];
+
+						std::memcpy(xyz, in, sizeof(xyz));
+						std::memcpy(normal, in + 15, sizeof(normal));
+
+						if (filter && !filter(xyz[0], xyz[1], xyz[2]))
+							continue;
+
+						const auto rgb = reinterpret_cast<const uint8_t*>(in + 12);
+
+						pts[kept] = PlyPoint(xyz[0], xyz[1], xyz[2], rgb[0], rgb[1], rgb[2], static_cast<uint8_t>(in[27]));
+						ext[kept] = PlyExtra(normal[0], normal[1], normal[2]);
+						++kept;
+					}
+
+					// Only the kept points stay allocated until the gather
+					if (filter && kept < n) {
+						chunkPoints[c].resize(kept);
+						chunkExtras[c].resize(kept);
+						chunkPoints[c].shrink_to_fit();
+						chunkExtras[c].shrink_to_fit();
+					}
+
+					progress.local().add(n);
 				}
-			}            
+			}
+
+			progress.check();
+
+			if (truncated)
+				throw std::invalid_argument("Invalid PLY file (unexpected end of file)");
+
+			if (!filter)
+				return;
+
+			std::vector<size_t> offsets(chunks + 1, 0);
+			for (size_t c = 0; c < chunks; ++c)
+				offsets[c + 1] = offsets[c] + chunkPoints[c].size();
+
+			const size_t total = offsets[chunks];
 
+			// Sizing does not touch the pages: the gather does, with a static partitioning of the chunks close to
+			// the one of the compute loops, so most pages are placed on the NUMA node of the thread that processes them
+			points.resize(total);
+			extras.resize(total);
+
+			#pragma omp parallel
+			{
+				TraceSpan span("gather");
+
+				#pragma omp for schedule(static)
+				for (long long c = 0; c < chunks; ++c)
+				{
+					std::copy(chunkPoints[c].begin(), chunkPoints[c].end(), points.begin() + offsets[c]);
+					std::copy(chunkExtras[c].begin(), chunkExtras[c].end(), extras.begin() + offsets[c]);
+
+					std::vector<PlyPoint>().swap(chunkPoints[c]);
+					std::vector<PlyExtra>().swap(chunkExtras[c]);
+				}
+			}
 		}
 	};
 }
\ No newline at end of file
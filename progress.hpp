@@ -0,0 +1,278 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "vendor/json.hpp"
+
+namespace FPCFilter {
+
+    // Thrown by a stage that stopped because the run was cancelled
+    class Cancelled : public std::runtime_error {
+    public:
+        Cancelled() : std::runtime_error("Cancelled") {}
+    };
+
+    // Progress of the running stage and cooperative cancellation, shared by the whole process.
+    // The hot loops add the work they complete to a per-thread counter: every counter has its own cache line
+    // and a single writer, so an update is a relaxed load and store (no locked instruction). The per point
+    // loops go through the points by chunks of CHUNK_POINTS, with a single update per chunk. The reporter
+    // sums the counters when it prints a line.
+    // SIGINT / SIGTERM only set the cancellation flag: the loops skip their remaining points or chunks,
+    // then the stage throws Cancelled
+    class Progress {
+
+    public:
+        class alignas(64) Counter {
+            std::atomic<uint64_t> value{ 0 };
+
+            friend class Progress;
+
+        public:
+            void add(uint64_t n)
+            {
+                value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+            }
+        };
+
+        // Points of the chunks of the per point loops: a loop reads the cancellation flag and updates its
+        // counter once per chunk, so the inner loop over the points has no bookkeeping
+        static constexpr size_t CHUNK_POINTS = 1024;
+
+        // Work done by the threads of its scope is not reported (the concurrent jobs of a batch), nor
+        // are the stages they begin
+        class Muted {
+            bool previous;
+
+        public:
+            Muted() : previous(muted()) { muted() = true; }
+            ~Muted() { muted() = previous; }
+        };
+
+    private:
+        static constexpr size_t SLOTS = 256;
+
+        Counter slots[SLOTS];
+        std::atomic<size_t> nextSlot{ 0 };
+
+        std::atomic<bool> cancelled{ false };
+        std::atomic<int> signal{ 0 };
+
+        mutable std::mutex mutex;
+        std::string stage;
+        uint64_t total = 0;
+        uint64_t base = 0;
+        std::chrono::steady_clock::time_point stageStart = std::chrono::steady_clock::now();
+
+        Progress() = default;
+
+        static bool& muted()
+        {
+            thread_local bool value = false;
+            return value;
+        }
+
+        uint64_t sum() const
+        {
+            uint64_t done = 0;
+            for (const auto& slot : slots)
+                done += slot.value.load(std::memory_order_relaxed);
+            return done;
+        }
+
+        static void onSignal(int sig)
+        {
+            auto& progress = get();
+
+            progress.signal.store(sig, std::memory_order_relaxed);
+            progress.cancelled.store(true, std::memory_order_relaxed);
+
+            // A second signal terminates the process right away
+            std::signal(sig, SIG_DFL);
+        }
+
+    public:
+        static Progress& get()
+        {
+            static Progress progress;
+            return progress;
+        }
+
+        // Counter of the calling thread: fetch it once before the loop
+        Counter& local()
+        {
+            thread_local Counter sink;
+            thread_local const size_t slot = nextSlot.fetch_add(1, std::memory_order_relaxed) % SLOTS;
+
+            return muted() ? sink : slots[slot];
+        }
+
+        // Work done so far by every counter (the thread to counter mapping does not change)
+        std::vector<uint64_t> work() const
+        {
+            std::vector<uint64_t> values(SLOTS);
+            for (size_t i = 0; i < SLOTS; ++i)
+                values[i] = slots[i].value.load(std::memory_order_relaxed);
+            return values;
+        }
+
+        // Starts reporting a stage of total units of work (points)
+        void begin(const char* name, uint64_t units)
+        {
+            if (muted())
+                return;
+
+            std::lock_guard<std::mutex> lock(mutex);
+
+            stage = name;
+            total = units;
+            base = sum();
+            stageStart = std::chrono::steady_clock::now();
+        }
+
+        bool isCancelled() const
+        {
+            return cancelled.load(std::memory_order_relaxed);
+        }
+
+        // Throws Cancelled if the run was cancelled: called between the chunks of work, outside of the parallel regions
+        void check() const
+        {
+            if (isCancelled())
+                throw Cancelled();
+        }
+
+        void cancel()
+        {
+            cancelled.store(true, std::memory_order_relaxed);
+        }
+
+        // Signal that cancelled the run (0 if none)
+        int cancelSignal() const
+        {
+            return signal.load(std::memory_order_relaxed);
+        }
+
+        // SIGINT and SIGTERM cancel the run. Blocking system calls are interrupted (no SA_RESTART),
+        // so that the worker mode stops waiting for clients
+        static void installSignalHandlers()
+        {
+            get();
+
+#ifdef _WIN32
+            std::signal(SIGINT, onSignal);
+            std::signal(SIGTERM, onSignal);
+#else
+            struct sigaction action = {};
+            action.sa_handler = onSignal;
+            sigemptyset(&action.sa_mask);
+            action.sa_flags = 0;
+
+            sigaction(SIGINT, &action, nullptr);
+            sigaction(SIGTERM, &action, nullptr);
+#endif
+        }
+
+        nlohmann::json snapshot(const char* state) const
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            auto done = sum() - base;
+            if (total > 0)
+                done = std::min(done, total);
+
+            const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - stageStart;
+
+            return {
+                {"state", state},
+                {"stage", stage},
+                {"done", done},
+                {"total", total},
+                {"progress", total > 0 ? static_cast<double>(done) / total : 0.0},
+                {"stage_time", elapsed.count()}
+            };
+        }
+    };
+
+    // Writes a JSON progress line to a file descriptor at a fixed interval, from its own thread, and a
+    // last line (state done, cancelled or failed) when it is destroyed
+    class ProgressReporter {
+
+        int fd;
+        std::chrono::milliseconds interval;
+
+        std::mutex mutex;
+        std::condition_variable wake;
+        bool isStopping = false;
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        std::thread thread;
+
+        void emit(const char* state)
+        {
+            auto line = Progress::get().snapshot(state);
+
+            const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            line["time"] = elapsed.count();
+
+            const auto text = line.dump() + "\n";
+
+#ifdef _WIN32
+            _write(fd, text.data(), static_cast<unsigned>(text.size()));
+#else
+            size_t written = 0;
+            while (written < text.size())
+            {
+                const auto n = ::write(fd, text.data() + written, text.size() - written);
+                if (n <= 0)
+                    break;
+                written += n;
+            }
+#endif
+        }
+
+    public:
+        explicit ProgressReporter(int fd, std::chrono::milliseconds interval = std::chrono::milliseconds(1000)) : fd(fd), interval(interval)
+        {
+            thread = std::thread([this]() {
+                std::unique_lock<std::mutex> lock(mutex);
+
+                while (!wake.wait_for(lock, this->interval, [this]() { return isStopping; }))
+                    emit("running");
+            });
+        }
+
+        ~ProgressReporter()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                isStopping = true;
+            }
+
+            wake.notify_one();
+            thread.join();
+
+            emit(Progress::get().isCancelled() ? "cancelled" : std::uncaught_exceptions() > 0 ? "failed" : "done");
+        }
+
+        ProgressReporter(const ProgressReporter&) = delete;
+        ProgressReporter& operator=(const ProgressReporter&) = delete;
+    };
+
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <iostream>
+#include <optional>
+#include <vector>
+
+#include "ply.hpp"
+#include "kdtree.hpp"
+#include "spacing.hpp"
+#include "parallel.hpp"
+#include "progress.hpp"
+#include "metrics.hpp"
+
+#define DEFAULT_NEIGHBORS_RADIUS_FACTOR 4.0
+
+namespace FPCFilter {
+
+    // Removes the points that have fewer than minNeighbors neighbors within radius.
+    // When the radius is not specified it defaults to a multiple of the estimated point spacing, which must not be 0
+    class RadiusOutlierFilter {
+
+        int minNeighbors;
+        std::optional<double> radius;
+        uint64_t seed;
+
+        std::ostream& log;
+        bool isVerbose;
+
+        nlohmann::json *stats;
+
+    public:
+        RadiusOutlierFilter(int minNeighbors, std::optional<double> radius, uint64_t seed, std::ostream &logstream, bool isVerbose, nlohmann::json *stats) :
+            minNeighbors(minNeighbors), radius(radius), seed(seed), log(logstream), isVerbose(isVerbose), stats(stats) {}
+
+        // Returns the compaction that removes the outliers. The index must contain the points of the file
+        Compaction run(const PlyFile& file, const KDTree& index) {
+
+            const size_t np = file.points.size();
+
+            if (np == 0)
+                return Compaction({});
+
+            if (!radius.has_value()) {
+
+                const double spacing = estimateSpacing(index, file.points, seed);
+                (*stats)["spacing"] = spacing;
+
+                // The sampled points only have duplicates as nearest neighbors: a radius of 0 would keep the
+                // duplicated points only
+                if (!(spacing > 0))
+                    throw std::invalid_argument("Estimated point spacing is 0 (duplicated points?): the neighbors radius must be given");
+
+                radius = spacing * DEFAULT_NEIGHBORS_RADIUS_FACTOR;
+
+                log << " -> Spacing estimation completed (" << spacing << " meters), using radius " << radius.value() << std::endl << std::endl;
+            }
+
+            const auto radiusSqr = static_cast<float>(radius.value() * radius.value());
+
+            // The query point is counted as well
+            const size_t needed = (size_t)minNeighbors + 1;
+
+            std::vector<uint8_t> keep(np, 0);
+
+            auto start = std::chrono::steady_clock::now();
+
+            auto& progress = Progress::get();
+            progress.begin("radius_filter", np);
+
+            StageMetrics metrics("radius_filter", np);
+
+            #pragma omp parallel
+            {
+                TraceSpan span("radius count");
+
+                auto& counter = progress.local();
+
+                const long long chunks = static_cast<long long>((np + Progress::CHUNK_POINTS - 1) / Progress::CHUNK_POINTS);
+
+                #pragma omp for nowait
+                for (long long c = 0; c < chunks; ++c)
+                {
+                    if (progress.isCancelled())
+                        continue;
+
+                    const size_t begin = c * Progress::CHUNK_POINTS;
+                    const size_t end = std::min(begin + Progress::CHUNK_POINTS, np);
+
+                    for (size_t i = begin; i < end; ++i)
+                    {
+                        const auto& point = file.points[i];
+                        const float pt[3] = { point.x, point.y, point.z };
+
+                        keep[i] = index.radiusCount(pt, radiusSqr, needed) >= needed;
+                    }
+
+                    counter.add(end - begin);
+                }
+            }
+
+            progress.check();
+
+            const std::chrono::duration<double> queryTime = std::chrono::steady_clock::now() - start;
+
+            if (this->isVerbose)
+                log << " ?> Done counting point neighbors in " << queryTime.count() << "s" << std::endl;
+
+            start = std::chrono::steady_clock::now();
+
+            Compaction compaction(std::move(keep));
+            const auto removed = compaction.removed();
+
+            metrics.record(stats, compaction.size(), { {"radius", radius.value()} });
+
+            (*stats)["radius_filter"] = {
+                {"radius", radius.value()},
+                {"min_neighbors", minNeighbors},
+                {"removed", removed},
+                {"query_time", queryTime.count()}
+            };
+
+            if (this->isVerbose) {
+                const std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
+                log << " ?> Done filtering points in " << diff.count() << "s (" << removed << " removed)" << std::endl;
+            }
+
+            return compaction;
+        }
+
+    };
+
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+
+#define DEFAULT_SEED "0"
+
+namespace FPCFilter {
+
+    // SplitMix64 generator (https://prng.di.unimi.it/splitmix64.c).
+    // Its state advances by a constant at every draw, so the i-th value of a sequence can be computed
+    // directly: parallel loops use at(seed, i) to draw the value of item i, independently of which
+    // thread processes it and of the number of threads
+    class SplitMix64 {
+
+        static constexpr uint64_t GOLDEN_GAMMA = 0x9E3779B97F4A7C15ull;
+
+        uint64_t state;
+
+        static uint64_t mix(uint64_t z)
+        {
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            return z ^ (z >> 31);
+        }
+
+    public:
+        explicit SplitMix64(uint64_t seed) : state(seed) {}
+
+        uint64_t next()
+        {
+            state += GOLDEN_GAMMA;
+            return mix(state);
+        }
+
+        // Value in [0, bound). The modulo bias is negligible for the bounds we use (point counts)
+        uint64_t next(uint64_t bound)
+        {
+            return next() % bound;
+        }
+
+        // i-th value (0 based) of the sequence started with seed
+        static uint64_t at(uint64_t seed, uint64_t i)
+        {
+            return mix(seed + (i + 1) * GOLDEN_GAMMA);
+        }
+
+        static uint64_t at(uint64_t seed, uint64_t i, uint64_t bound)
+        {
+            return at(seed, i) % bound;
+        }
+    };
+
+}
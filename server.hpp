@@ -0,0 +1,479 @@
+#pragma once
+
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+
+#ifndef _WIN32
+#include <csignal>
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "ply.hpp"
+#include "kdtree.hpp"
+#include "pipeline.hpp"
+#include "plan.hpp"
+#include "progress.hpp"
+#include "utils.hpp"
+
+namespace fs = std::filesystem;
+
+namespace FPCFilter
+{
+
+	// Clouds read from disk, and their spatial index once a request needs it, evicted in least recently
+	// used order when they take more than the memory limit. An entry is reloaded when its file changes
+	class CloudCache
+	{
+
+	public:
+		struct Entry
+		{
+			std::string key;
+			std::shared_ptr<const PlyFile> cloud;
+			std::shared_ptr<const KDTree> index;
+			size_t bytes = 0;
+		};
+
+	private:
+		// Most recently used first
+		std::list<Entry> entries;
+		std::map<std::string, std::list<Entry>::iterator> lookup;
+
+		size_t limit;
+		size_t used = 0;
+
+		// Working copies of the running job, counted in used
+		size_t working = 0;
+
+		static size_t cloudBytes(const PlyFile& cloud)
+		{
+			return cloud.points.capacity() * sizeof(PlyPoint) + cloud.extras.capacity() * sizeof(PlyExtra);
+		}
+
+		static std::string keyOf(const std::string& path)
+		{
+			const auto canonical = fs::canonical(path).string();
+			const auto mtime = fs::last_write_time(path).time_since_epoch().count();
+
+			return canonical + "|" + std::to_string(fs::file_size(path)) + "|" + std::to_string(mtime);
+		}
+
+		void evict()
+		{
+			while (this->used > this->limit && !this->entries.empty())
+			{
+				const auto& last = this->entries.back();
+
+				this->used -= last.bytes;
+				this->lookup.erase(last.key);
+				this->entries.pop_back();
+			}
+		}
+
+	public:
+		size_t hits = 0;
+		size_t misses = 0;
+
+		explicit CloudCache(size_t limit) : limit(limit) {}
+
+		// Returns the entry of the file, loading it on a miss. The returned copy stays valid after an eviction
+		Entry acquire(const std::string& path, bool& hit)
+		{
+			if (!fs::exists(path))
+				throw std::invalid_argument(string_format("Input file '%s' does not exist", path.c_str()));
+
+			const auto key = keyOf(path);
+			const auto it = this->lookup.find(key);
+
+			if (it != this->lookup.end())
+			{
+				this->entries.splice(this->entries.begin(), this->entries, it->second);
+				this->hits++;
+				hit = true;
+
+				return this->entries.front();
+			}
+
+			this->misses++;
+			hit = false;
+
+			Entry entry;
+			entry.key = key;
+			entry.cloud = std::make_shared<const PlyFile>(path);
+			entry.bytes = cloudBytes(*entry.cloud);
+
+			this->entries.push_front(entry);
+			this->lookup[key] = this->entries.begin();
+			this->used += entry.bytes;
+
+			evict();
+
+			return entry;
+		}
+
+		// Stores the index of a cached cloud
+		void setIndex(const Entry& entry, std::shared_ptr<const KDTree> index)
+		{
+			const auto it = this->lookup.find(entry.key);
+
+			if (it == this->lookup.end())
+				return;
+
+			it->second->index = index;
+			it->second->bytes += index->memoryUsage();
+			this->used += index->memoryUsage();
+
+			evict();
+		}
+
+		// Counts the working copies of the cloud and index of an entry in the memory limit while it lives,
+		// evicting the least recently used entries to make room (the entry itself too, if it does not fit)
+		class Reservation
+		{
+			CloudCache& cache;
+			size_t bytes;
+
+		public:
+			Reservation(CloudCache& cache, const Entry& entry) : cache(cache),
+				bytes(cloudBytes(*entry.cloud) + (entry.index ? entry.index->memoryUsage() : 0))
+			{
+				this->cache.working += this->bytes;
+				this->cache.used += this->bytes;
+				this->cache.evict();
+			}
+
+			~Reservation()
+			{
+				this->cache.working -= this->bytes;
+				this->cache.used -= this->bytes;
+			}
+
+			Reservation(const Reservation&) = delete;
+			Reservation& operator=(const Reservation&) = delete;
+		};
+
+		size_t size() const
+		{
+			return this->entries.size();
+		}
+
+		// Memory of the cached entries (without the working copies of a running job)
+		size_t memoryUsage() const
+		{
+			return this->used - this->working;
+		}
+	};
+
+	// Long running worker answering JSON job requests over a local Unix socket, one request per line:
+	//
+	//   { "input": "cloud.ply", "output": "out.ply", "stages": [ ...pipeline description stages... ] }
+	//   { "command": "stats" }
+	//   { "command": "shutdown" }
+	//
+	// Every request gets a one line JSON response. The clouds and their spatial index stay in a CloudCache,
+	// so repeated requests on the same cloud skip the reading and the index build
+	class Server
+	{
+
+		// The waits for a client or a request wake up this often to check for a shutdown (a signal is not
+		// guaranteed to interrupt the waiting thread once the OpenMP threads exist)
+		static constexpr int POLL_INTERVAL_MS = 200;
+
+		// A client that sends nothing for this long (or does not read its responses) is disconnected, so that
+		// it does not hold the worker: the clients are served one at a time
+		static constexpr int CLIENT_TIMEOUT_SECONDS = 10;
+
+		std::string path;
+		CloudCache cache;
+
+		uint64_t seed;
+		std::ostream& log;
+		bool isVerbose;
+
+		size_t requests = 0;
+		double totalLatency = 0;
+		double maxLatency = 0;
+
+		bool isStopping = false;
+
+		// After a shutdown request or a SIGINT / SIGTERM
+		bool stopping() const
+		{
+			return this->isStopping || Progress::get().isCancelled();
+		}
+
+		nlohmann::json serverStats() const
+		{
+			const auto lookups = this->cache.hits + this->cache.misses;
+
+			return {
+				{"requests", this->requests},
+				{"cache_entries", this->cache.size()},
+				{"cache_memory", this->cache.memoryUsage()},
+				{"cache_hits", this->cache.hits},
+				{"cache_misses", this->cache.misses},
+				{"cache_hit_rate", lookups > 0 ? static_cast<double>(this->cache.hits) / lookups : 0.0},
+				{"mean_latency", this->requests > 0 ? this->totalLatency / this->requests : 0.0},
+				{"max_latency", this->maxLatency}
+			};
+		}
+
+		nlohmann::json runJob(const nlohmann::json& request)
+		{
+			if (!request.contains("input") || !request.contains("output"))
+				throw std::invalid_argument("A job must have an input and an output");
+
+			const auto input = request["input"].get<std::string>();
+			const auto output = request["output"].get<std::string>();
+
+			const Plan plan(request);
+
+			bool hit;
+			auto entry = this->cache.acquire(input, hit);
+
+			if (plan.needsIndex() && !entry.index)
+			{
+				entry.index = std::make_shared<const KDTree>(entry.cloud->points);
+				this->cache.setIndex(entry, entry.index);
+			}
+
+			std::ostream silent(nullptr);
+			std::ostream& out = this->isVerbose ? this->log : silent;
+
+			nlohmann::json stats = nlohmann::json::object();
+
+			// The stages compact the cloud and the index: they work on copies of the cached ones, which take
+			// their share of the memory limit until the job ends
+			const CloudCache::Reservation reservation(this->cache, entry);
+
+			Pipeline pipeline(std::make_unique<PlyFile>(*entry.cloud), out, this->isVerbose, &stats, this->seed,
+				entry.index ? std::make_unique<KDTree>(*entry.index) : nullptr);
+
+			plan.run(pipeline, out, &stats);
+			pipeline.write(output);
+
+			return {
+				{"ok", true},
+				{"cache", hit ? "hit" : "miss"},
+				{"points", pipeline.size()},
+				{"stats", stats}
+			};
+		}
+
+		nlohmann::json handle(const std::string& line)
+		{
+			const auto start = std::chrono::steady_clock::now();
+
+			nlohmann::json response;
+
+			try {
+
+				const auto request = nlohmann::json::parse(line);
+				const auto command = request.value("command", std::string("run"));
+
+				if (command == "run")
+					response = runJob(request);
+				else if (command == "stats")
+					response = { {"ok", true}, {"stats", serverStats()} };
+				else if (command == "shutdown") {
+					this->isStopping = true;
+					response = { {"ok", true} };
+				}
+				else
+					throw std::invalid_argument(string_format("Unknown command '%s'", command.c_str()));
+			}
+			catch (const std::exception& e) {
+				response = { {"ok", false}, {"error", e.what()} };
+			}
+
+			const std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
+
+			this->requests++;
+			this->totalLatency += diff.count();
+			this->maxLatency = std::max(this->maxLatency, diff.count());
+
+			response["latency"] = diff.count();
+
+			log << " ?> Request " << this->requests << " answered in " << diff.count() << "s";
+			if (response.contains("cache"))
+				log << " (cache " << response["cache"].get<std::string>() << ")";
+			if (response.contains("error"))
+				log << ": " << response["error"].get<std::string>();
+			log << std::endl;
+
+			return response;
+		}
+
+#ifndef _WIN32
+		static bool sendAll(int fd, const std::string& data)
+		{
+			size_t sent = 0;
+
+			while (sent < data.size())
+			{
+				const auto n = ::send(fd, data.data() + sent, data.size() - sent, 0);
+
+				if (n < 0 && errno == EINTR)
+					continue;
+
+				if (n <= 0)
+					return false;
+
+				sent += n;
+			}
+
+			return true;
+		}
+
+		// Waits until fd is readable. Returns false on shutdown, error or when the timeout (milliseconds, -1 = none) expires
+		bool waitReadable(int fd, int timeout) const
+		{
+			const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+
+			while (!this->stopping())
+			{
+				pollfd p = { fd, POLLIN, 0 };
+
+				const int ready = ::poll(&p, 1, POLL_INTERVAL_MS);
+
+				if (ready < 0 && errno != EINTR)
+					return false;
+
+				if (ready > 0)
+					return true;
+
+				if (timeout >= 0 && std::chrono::steady_clock::now() >= deadline)
+					return false;
+			}
+
+			return false;
+		}
+
+		// Answers the requests of a client until it disconnects or stays idle for CLIENT_TIMEOUT_SECONDS
+		void serveClient(int fd)
+		{
+			// The responses are sent with the same timeout
+			const timeval sendTimeout = { CLIENT_TIMEOUT_SECONDS, 0 };
+			::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout, sizeof(sendTimeout));
+
+			std::string buffer;
+			char chunk[65536];
+
+			while (!this->stopping())
+			{
+				if (!waitReadable(fd, CLIENT_TIMEOUT_SECONDS * 1000)) {
+					if (!this->stopping() && this->isVerbose)
+						log << " ?> Closing an idle client" << std::endl;
+
+					return;
+				}
+
+				const auto n = ::recv(fd, chunk, sizeof(chunk), 0);
+
+				if (n < 0 && errno == EINTR)
+					continue;
+
+				if (n <= 0)
+					return;
+
+				buffer.append(chunk, n);
+
+				size_t newline;
+				while (!this->stopping() && (newline = buffer.find('\n')) != std::string::npos)
+				{
+					const auto line = buffer.substr(0, newline);
+					buffer.erase(0, newline + 1);
+
+					if (line.find_first_not_of(" \t\r") == std::string::npos)
+						continue;
+
+					if (!sendAll(fd, handle(line).dump() + "\n"))
+						return;
+				}
+			}
+		}
+#endif
+
+	public:
+		Server(const std::string& path, size_t cacheLimit, uint64_t seed, std::ostream& logstream, bool isVerbose) :
+			path(path), cache(cacheLimit), seed(seed), log(logstream), isVerbose(isVerbose) {}
+
+		// Serves the clients one at a time (every request uses all the threads) until a shutdown request
+		// or a SIGINT / SIGTERM (the running job is cancelled). An idle client is disconnected after
+		// CLIENT_TIMEOUT_SECONDS so that the next one gets served
+		void run()
+		{
+#ifdef _WIN32
+			throw std::invalid_argument("Worker mode is not supported on Windows");
+#else
+			sockaddr_un address = {};
+			address.sun_family = AF_UNIX;
+
+			if (this->path.size() >= sizeof(address.sun_path))
+				throw std::invalid_argument(string_format("Socket path '%s' is too long", this->path.c_str()));
+
+			std::strncpy(address.sun_path, this->path.c_str(), sizeof(address.sun_path) - 1);
+
+			// A client disconnecting before its response must not kill the worker
+			std::signal(SIGPIPE, SIG_IGN);
+
+			const int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+
+			if (fd < 0)
+				throw std::runtime_error(string_format("Cannot create socket: %s", std::strerror(errno)));
+
+			// Stale socket of a previous run
+			if (fs::is_socket(this->path))
+				fs::remove(this->path);
+
+			if (::bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || ::listen(fd, 16) < 0) {
+				const auto error = std::string(std::strerror(errno));
+				::close(fd);
+				throw std::runtime_error(string_format("Cannot listen on '%s': %s", this->path.c_str(), error.c_str()));
+			}
+
+			log << " -> Listening on " << this->path << std::endl;
+
+			while (!this->stopping())
+			{
+				// Shutdown or error
+				if (!waitReadable(fd, -1))
+					break;
+
+				const int client = ::accept(fd, nullptr, nullptr);
+
+				if (client < 0) {
+					if (errno == EINTR)
+						continue;
+
+					break;
+				}
+
+				serveClient(client);
+
+				::close(client);
+			}
+
+			::close(fd);
+			fs::remove(this->path);
+
+			const auto stats = serverStats();
+
+			log << " ?> Served " << this->requests << " requests (cache hit rate " << stats["cache_hit_rate"].get<double>()
+				<< ", mean latency " << stats["mean_latency"].get<double>() << "s)" << std::endl;
+#endif
+		}
+	};
+
+}
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define FPCFILTER_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// MSVC lets us use any intrinsic without changing the compilation flags, gcc and clang need the target attribute
+#if defined(FPCFILTER_X86) && (defined(__GNUC__) || defined(__clang__))
+#define FPCFILTER_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#else
+#define FPCFILTER_TARGET_AVX2
+#endif
+
+namespace FPCFilter {
+
+    namespace simd {
+
+        // Computes the squared distances between the query (qx, qy, qz) and n points stored in SoA form
+        typedef void (*SquaredDistancesKernel)(const float* xs, const float* ys, const float* zs, size_t n,
+            float qx, float qy, float qz, float* out);
+
+        inline void squaredDistancesScalar(const float* xs, const float* ys, const float* zs, size_t n,
+            float qx, float qy, float qz, float* out)
+        {
+            for (size_t i = 0; i < n; ++i)
+            {
+                const float dx = xs[i] - qx;
+                const float dy = ys[i] - qy;
+                const float dz = zs[i] - qz;
+
+                out[i] = dx * dx + dy * dy + dz * dz;
+            }
+        }
+
+#ifdef FPCFILTER_X86
+
+        inline void squaredDistancesSSE(const float* xs, const float* ys, const float* zs, size_t n,
+            float qx, float qy, float qz, float* out)
+        {
+            const __m128 vx = _mm_set1_ps(qx);
+            const __m128 vy = _mm_set1_ps(qy);
+            const __m128 vz = _mm_set1_ps(qz);
+
+            size_t i = 0;
+            for (; i + 4 <= n; i += 4)
+            {
+                const __m128 dx = _mm_sub_ps(_mm_loadu_ps(xs + i), vx);
+                const __m128 dy = _mm_sub_ps(_mm_loadu_ps(ys + i), vy);
+                const __m128 dz = _mm_sub_ps(_mm_loadu_ps(zs + i), vz);
+
+                const __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+
+                _mm_storeu_ps(out + i, d);
+            }
+
+            squaredDistancesScalar(xs + i, ys + i, zs + i, n - i, qx, qy, qz, out + i);
+        }
+
+        FPCFILTER_TARGET_AVX2
+        inline void squaredDistancesAVX2(const float* xs, const float* ys, const float* zs, size_t n,
+            float qx, float qy, float qz, float* out)
+        {
+            const __m256 vx = _mm256_set1_ps(qx);
+            const __m256 vy = _mm256_set1_ps(qy);
+            const __m256 vz = _mm256_set1_ps(qz);
+
+            size_t i = 0;
+            for (; i + 8 <= n; i += 8)
+            {
+                const __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(xs + i), vx);
+                const __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(ys + i), vy);
+                const __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(zs + i), vz);
+
+                __m256 d = _mm256_mul_ps(dx, dx);
+                d = _mm256_fmadd_ps(dy, dy, d);
+                d = _mm256_fmadd_ps(dz, dz, d);
+
+                _mm256_storeu_ps(out + i, d);
+            }
+
+            squaredDistancesSSE(xs + i, ys + i, zs + i, n - i, qx, qy, qz, out + i);
+        }
+
+        inline bool cpuSupportsAVX2()
+        {
+#if defined(_MSC_VER)
+            int info[4];
+            __cpuid(info, 1);
+
+            const bool osxsave = (info[2] & (1 << 27)) != 0;
+            const bool avx = (info[2] & (1 << 28)) != 0;
+            const bool fma = (info[2] & (1 << 12)) != 0;
+
+            if (!osxsave || !avx || !fma || (_xgetbv(0) & 6) != 6)
+                return false;
+
+            __cpuidex(info, 7, 0);
+            return (info[1] & (1 << 5)) != 0;
+#else
+            return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+        }
+
+#endif
+
+        struct KernelInfo {
+            SquaredDistancesKernel kernel;
+            const char* name;
+        };
+
+        // Picks the widest kernel supported by the running CPU. The FPCFILTER_SIMD environment variable
+        // (scalar, sse or avx2) can be used to force a narrower one, useful to compare results
+        inline KernelInfo selectKernel()
+        {
+            const char* forced = std::getenv("FPCFILTER_SIMD");
+
+            if (forced != nullptr && std::strcmp(forced, "scalar") == 0)
+                return { squaredDistancesScalar, "scalar" };
+
+#ifdef FPCFILTER_X86
+            if (forced != nullptr && std::strcmp(forced, "sse") == 0)
+                return { squaredDistancesSSE, "SSE" };
+
+            if (cpuSupportsAVX2())
+                return { squaredDistancesAVX2, "AVX2" };
+
+            return { squaredDistancesSSE, "SSE" };
+#else
+            return { squaredDistancesScalar, "scalar" };
+#endif
+        }
+
+        inline const KernelInfo& kernel()
+        {
+            static const KernelInfo info = selectKernel();
+            return info;
+        }
+
+        inline void squaredDistances(const float* xs, const float* ys, const float* zs, size_t n,
+            float qx, float qy, float qz, float* out)
+        {
+            kernel().kernel(xs, ys, zs, n, qx, qy, qz, out);
+        }
+
+    }
+
+}
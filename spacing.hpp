@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cmath>
+#include <limits>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include <omp.h>
+
+#include "ply.hpp"
+#include "kdtree.hpp"
+#include "random.hpp"
+
+namespace FPCFilter {
+
+    // Estimates the point spacing (in meters, rounded up to the centimeter) as the most frequent
+    // average distance to the two closest neighbors over a random sample of the points.
+    // The samples are drawn from the seeded sequence by index and every thread fills its own histogram,
+    // so the estimate is the same across runs and thread counts
+    inline double estimateSpacing(const KDTree& tree, const std::vector<PlyPoint>& points, uint64_t seed)
+    {
+        const size_t np = points.size();
+
+        if (np == 0)
+            return 0;
+
+        std::vector<size_t> indices;
+        std::vector<float> sqr_dists;
+        size_t SAMPLES = std::min<size_t>(np, 10000);
+
+        size_t count = 3;
+
+        std::vector<std::unordered_map<uint64_t, size_t>> histograms(omp_get_max_threads());
+
+        #pragma omp parallel private (indices, sqr_dists)
+        {
+            indices.resize(count);
+            sqr_dists.resize(count);
+
+            auto& dist_map = histograms[omp_get_thread_num()];
+
+            #pragma omp for
+            for (long long i = 0; i < SAMPLES; ++i)
+            {
+                const size_t idx = SplitMix64::at(seed, i, np);
+                const float pt[3] = { points[idx].x, points[idx].y, points[idx].z };
+                tree.knnSearch(pt, count, &indices.front(), &sqr_dists.front());
+
+                double sum = 0.0;
+                for (size_t j = 1; j < count; ++j)
+                {
+                    sum += std::sqrt(sqr_dists[j]);
+                }
+                sum /= count;
+
+                dist_map[static_cast<uint64_t>(std::ceil(sum * 100))]++;
+            }
+        }
+
+        std::map<uint64_t, size_t> dist_map;
+        for (const auto& histogram : histograms)
+            for (const auto& it : histogram)
+                dist_map[it.first] += it.second;
+
+        // Ties are broken by the smallest distance (the map is ordered)
+        size_t max_val = 0;
+        uint64_t d = 0;
+        for (const auto& it : dist_map){
+            if (it.second > max_val){
+                d = it.first;
+                max_val = it.second;
+            }
+        }
+
+        return static_cast<double>(d) / 100.0;
+    }
+
+}
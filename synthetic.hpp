@@ -0,0 +1,471 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <omp.h>
+
+#include "ply.hpp"
+#include "random.hpp"
+
+namespace FPCFilter {
+
+    struct SceneOptions {
+        size_t points = 1000000;
+        uint64_t seed = 0;
+
+        // Points per square meter (on average)
+        double density = 100.0;
+
+        // 0 is a uniform density, otherwise the density varies along x between (1 - v) / (1 + v) and
+        // (1 + v) / (1 - v) times the average (v < 1)
+        double densityVariation = 0.0;
+
+        // Expected number of buildings on the terrain
+        size_t buildings = 0;
+
+        // Shares of the points that are outliers (noise) and exact copies of another point (duplicates)
+        double noise = 0.0;
+        double duplicates = 0.0;
+    };
+
+    // Ground truth of a synthetic point
+    enum class PointLabel : uint8_t { Surface = 0, Noise = 1, Duplicate = 2 };
+
+    enum class SyntheticFormat { Binary, Ascii };
+
+    // Seeded synthetic scene: a rolling terrain heightfield with box buildings, outliers above and below
+    // the surface and exact duplicates. Every point only depends on the seed and its index, so a scene can
+    // be generated by chunks, in parallel, and is the same whatever the number of threads
+    class SyntheticScene {
+
+        // Salts of the independent sequences
+        static constexpr uint64_t LABEL = 0x1AB31ull;
+        static constexpr uint64_t POSITION = 0x9051ull;
+        static constexpr uint64_t SURFACE = 0x5FACEull;
+        static constexpr uint64_t DUPLICATE = 0xD0B1ull;
+        static constexpr uint64_t BUILDING = 0xB11Dull;
+
+        // Share of the points of a building cell that are on its walls
+        static constexpr double WALL_SHARE = 0.2;
+
+        // Points written per task
+        static constexpr size_t CHUNK_POINTS = 1 << 20;
+
+        SceneOptions options;
+
+        double extent;
+        double relief;
+
+        size_t grid = 0;
+        double cellSize = 0;
+        double buildingProbability = 0;
+
+        struct Building {
+            double minX, minY, maxX, maxY;
+            double base, roof;
+        };
+
+        static double uniform(uint64_t seed, uint64_t i)
+        {
+            return (SplitMix64::at(seed, i) >> 11) * (1.0 / 9007199254740992.0);
+        }
+
+        double draw(uint64_t salt, size_t i, size_t k) const
+        {
+            return uniform(options.seed ^ salt, i * 8 + k);
+        }
+
+        // Maps u in [0, 1) to a coordinate whose density varies with the position (monotone for v < 1)
+        double warp(double u) const
+        {
+            constexpr double waves = 3.0;
+            const double twoPi = 2.0 * std::acos(-1.0);
+
+            return extent * (u + options.densityVariation * std::sin(twoPi * waves * u) / (twoPi * waves));
+        }
+
+        double ground(double x, double y) const
+        {
+            const auto f = 6.0 / extent;
+            return relief * (std::sin(x * f) * std::cos(y * f * 0.7) + 0.3 * std::sin((x + 2.0 * y) * f * 3.1));
+        }
+
+        void groundNormal(double x, double y, float* normal) const
+        {
+            constexpr double h = 0.01;
+
+            const auto dx = (ground(x + h, y) - ground(x - h, y)) / (2 * h);
+            const auto dy = (ground(x, y + h) - ground(x, y - h)) / (2 * h);
+            const auto length = std::sqrt(dx * dx + dy * dy + 1.0);
+
+            normal[0] = static_cast<float>(-dx / length);
+            normal[1] = static_cast<float>(-dy / length);
+            normal[2] = static_cast<float>(1.0 / length);
+        }
+
+        // Building of the grid cell, if it has one
+        bool building(size_t cx, size_t cy, Building& b) const
+        {
+            if (grid == 0 || cx >= grid || cy >= grid)
+                return false;
+
+            const auto cell = cy * grid + cx;
+
+            if (draw(BUILDING, cell, 0) >= buildingProbability)
+                return false;
+
+            const auto width = cellSize * (0.3 + 0.4 * draw(BUILDING, cell, 1));
+            const auto depth = cellSize * (0.3 + 0.4 * draw(BUILDING, cell, 2));
+
+            b.minX = cx * cellSize + (cellSize - width) * draw(BUILDING, cell, 3);
+            b.minY = cy * cellSize + (cellSize - depth) * draw(BUILDING, cell, 4);
+            b.maxX = b.minX + width;
+            b.maxY = b.minY + depth;
+
+            b.base = ground((b.minX + b.maxX) / 2, (b.minY + b.maxY) / 2);
+            b.roof = b.base + 3.0 + std::min(cellSize, 30.0) * draw(BUILDING, cell, 5);
+
+            return true;
+        }
+
+        PointLabel label(size_t i) const
+        {
+            const auto u = draw(LABEL, i, 0);
+
+            if (u < options.noise)
+                return PointLabel::Noise;
+
+            if (u < options.noise + options.duplicates)
+                return PointLabel::Duplicate;
+
+            return PointLabel::Surface;
+        }
+
+        void surface(size_t i, PlyPoint& point, PlyExtra& extra) const
+        {
+            auto x = warp(draw(POSITION, i, 0));
+            auto y = draw(POSITION, i, 1) * extent;
+            double z;
+
+            const auto shade = static_cast<uint8_t>(96 + 64 * draw(SURFACE, i, 0));
+            const auto views = static_cast<uint8_t>(2 + SplitMix64::at(options.seed ^ SURFACE, i) % 9);
+
+            const auto cx = static_cast<size_t>(x / cellSize);
+            const auto cy = static_cast<size_t>(y / cellSize);
+
+            Building b;
+
+            if (grid > 0 && building(cx, cy, b) && draw(SURFACE, i, 1) < WALL_SHARE)
+            {
+                // Wall: one of the 4 sides, at any height
+                const auto side = static_cast<int>(draw(SURFACE, i, 2) * 4);
+                const auto along = draw(SURFACE, i, 3);
+
+                float normal[3] = { 0, 0, 0 };
+
+                switch (side) {
+                    case 0: x = b.minX; y = b.minY + along * (b.maxY - b.minY); normal[0] = -1; break;
+                    case 1: x = b.maxX; y = b.minY + along * (b.maxY - b.minY); normal[0] = 1; break;
+                    case 2: y = b.minY; x = b.minX + along * (b.maxX - b.minX); normal[1] = -1; break;
+                    default: y = b.maxY; x = b.minX + along * (b.maxX - b.minX); normal[1] = 1; break;
+                }
+
+                z = b.base + (b.roof - b.base) * draw(SURFACE, i, 4);
+
+                point = PlyPoint(static_cast<float>(x), static_cast<float>(y), static_cast<float>(z), shade, shade, shade, views);
+                extra = PlyExtra(normal[0], normal[1], normal[2]);
+            }
+            else if (grid > 0 && building(cx, cy, b) && x >= b.minX && x <= b.maxX && y >= b.minY && y <= b.maxY)
+            {
+                // Flat roof
+                z = b.roof;
+
+                point = PlyPoint(static_cast<float>(x), static_cast<float>(y), static_cast<float>(z), static_cast<uint8_t>(shade + 60), shade / 2, shade / 2, views);
+                extra = PlyExtra(0.0f, 0.0f, 1.0f);
+            }
+            else
+            {
+                // Terrain, with a few centimeters of measurement noise
+                z = ground(x, y) + 0.02 * (draw(SURFACE, i, 5) - 0.5);
+
+                float normal[3];
+                groundNormal(x, y, normal);
+
+                point = PlyPoint(static_cast<float>(x), static_cast<float>(y), static_cast<float>(z), shade / 2, shade, shade / 3, views);
+                extra = PlyExtra(normal[0], normal[1], normal[2]);
+            }
+        }
+
+    public:
+        explicit SyntheticScene(const SceneOptions& options) : options(options)
+        {
+            if (options.points == 0)
+                throw std::invalid_argument("A scene needs at least one point");
+
+            if (options.density <= 0)
+                throw std::invalid_argument("Density must be greater than 0");
+
+            if (options.densityVariation < 0 || options.densityVariation >= 1)
+                throw std::invalid_argument("Density variation must be in [0, 1)");
+
+            if (options.noise < 0 || options.duplicates < 0 || options.noise + options.duplicates >= 1)
+                throw std::invalid_argument("Noise and duplicates shares must be positive and less than 1 together");
+
+            extent = std::sqrt(options.points / options.density);
+            relief = 0.02 * extent + 1.0;
+
+            if (options.buildings > 0)
+            {
+                // One building at most per cell, a quarter of the cells are built at least
+                grid = static_cast<size_t>(std::ceil(std::sqrt(options.buildings * 4.0)));
+                cellSize = extent / grid;
+                buildingProbability = static_cast<double>(options.buildings) / (grid * grid);
+            }
+        }
+
+        // Side of the square terrain (meters)
+        double side() const
+        {
+            return extent;
+        }
+
+        size_t size() const
+        {
+            return options.points;
+        }
+
+        // Point i. With labelViews, the noise points have 0 views (1 or more otherwise), so that the outliers
+        // left by a filter can be counted in its output
+        PointLabel point(size_t i, PlyPoint& point, PlyExtra& extra, bool labelViews = false) const
+        {
+            const auto l = label(i);
+
+            if (l == PointLabel::Surface) {
+                surface(i, point, extra);
+                return l;
+            }
+
+            if (l == PointLabel::Duplicate)
+            {
+                // Bit identical copy of a surface point
+                for (size_t k = 0; ; ++k)
+                {
+                    const auto j = SplitMix64::at(options.seed ^ DUPLICATE, i * 8 + k, options.points);
+
+                    if (label(j) == PointLabel::Surface || k == 7) {
+                        surface(j, point, extra);
+                        return l;
+                    }
+                }
+            }
+
+            // Noise: above or below the surface, up to 10 meters away
+            const auto x = draw(LABEL, i, 1) * extent;
+            const auto y = draw(LABEL, i, 2) * extent;
+            const auto offset = (draw(LABEL, i, 3) < 0.7 ? 1.0 : -1.0) * (0.5 + 9.5 * draw(LABEL, i, 4));
+
+            const auto shade = static_cast<uint8_t>(255 * draw(LABEL, i, 5));
+
+            point = PlyPoint(static_cast<float>(x), static_cast<float>(y), static_cast<float>(ground(x, y) + offset), shade, shade, shade,
+                labelViews ? 0 : static_cast<uint8_t>(1 + SplitMix64::at(options.seed ^ LABEL, i) % 2));
+            extra = PlyExtra(0.0f, 0.0f, 1.0f);
+
+            return l;
+        }
+
+        // The whole scene in memory
+        std::unique_ptr<PlyFile> cloud(bool labelViews = false) const
+        {
+            std::vector<PlyPoint> points(options.points);
+            std::vector<PlyExtra> extras(options.points);
+
+            #pragma omp parallel for schedule(static)
+            for (long long i = 0; i < options.points; ++i)
+                point(i, points[i], extras[i], labelViews);
+
+            return std::make_unique<PlyFile>(std::move(points), std::move(extras));
+        }
+
+        struct WriteResult {
+            size_t noise = 0;
+            size_t duplicates = 0;
+        };
+
+        // Writes the scene in the layout read by PlyFile: binary (x y z red green blue nx ny nz views) or ASCII
+        // (x y z diffuse_red diffuse_green diffuse_blue views). Without normals the binary records have no nx ny nz,
+        // with normals the ASCII records have nx ny nz after z (PlyFile reads neither).
+        // Parallel tasks generate and encode chunks of points, which are written in order as soon as they are
+        // ready; at most a few chunks per thread are in memory. When labelsPath is set, the label of every point
+        // (a PointLabel byte) is written to that file, in the same order
+        WriteResult write(const std::string& path, SyntheticFormat format, bool normals, const std::string& labelsPath = "", bool labelViews = false) const
+        {
+            std::ofstream writer(path, std::ofstream::binary);
+
+            if (!writer.is_open())
+                throw std::invalid_argument(std::string("Cannot open file ") + path);
+
+            std::ofstream labels;
+
+            if (!labelsPath.empty()) {
+                labels.open(labelsPath, std::ofstream::binary);
+
+                if (!labels.is_open())
+                    throw std::invalid_argument(std::string("Cannot open file ") + labelsPath);
+            }
+
+            const auto binary = format == SyntheticFormat::Binary;
+
+            writer << "ply" << std::endl;
+            writer << (binary ? "format binary_little_endian 1.0" : "format ascii 1.0") << std::endl;
+            writer << "element vertex " << options.points << std::endl;
+
+            const char* floatType = binary ? "float32" : "float";
+            const char* byteType = binary ? "uint8" : "uchar";
+            const char* colorPrefix = binary ? "" : "diffuse_";
+
+            writer << "property " << floatType << " x" << std::endl;
+            writer << "property " << floatType << " y" << std::endl;
+            writer << "property " << floatType << " z" << std::endl;
+
+            if (normals && !binary)
+                writer << "property float nx" << std::endl << "property float ny" << std::endl << "property float nz" << std::endl;
+
+            writer << "property " << byteType << " " << colorPrefix << "red" << std::endl;
+            writer << "property " << byteType << " " << colorPrefix << "green" << std::endl;
+            writer << "property " << byteType << " " << colorPrefix << "blue" << std::endl;
+
+            if (normals && binary)
+                writer << "property float32 nx" << std::endl << "property float32 ny" << std::endl << "property float32 nz" << std::endl;
+
+            writer << "property " << byteType << " views" << std::endl;
+            writer << "end_header" << std::endl;
+
+            const size_t chunks = (options.points + CHUNK_POINTS - 1) / CHUNK_POINTS;
+            const size_t window = 2 * static_cast<size_t>(omp_get_max_threads());
+
+            std::vector<std::vector<char>> buffers(chunks);
+            std::vector<std::vector<uint8_t>> chunkLabels(chunks);
+
+            WriteResult result;
+
+            #pragma omp parallel
+            #pragma omp single
+            for (size_t c = 0; c < chunks; ++c)
+            {
+                // Bounds the memory: the chunks of the previous window are written before the next one starts
+                if (c > 0 && c % window == 0) {
+                    #pragma omp taskwait
+                }
+
+                auto& buffer = buffers[c];
+
+                #pragma omp task default(shared) firstprivate(c) depend(out: buffer)
+                {
+                    const auto begin = c * CHUNK_POINTS;
+                    const auto end = std::min(options.points, begin + CHUNK_POINTS);
+
+                    auto& lbl = chunkLabels[c];
+                    lbl.resize(end - begin);
+
+                    buffer.resize((end - begin) * (binary ? 28 : 160));
+                    char* out = buffer.data();
+
+                    PlyPoint p;
+                    PlyExtra e;
+
+                    for (size_t i = begin; i < end; ++i)
+                    {
+                        lbl[i - begin] = static_cast<uint8_t>(point(i, p, e, labelViews));
+
+                        out = binary ? encodeBinary(out, p, e, normals) : encodeAscii(out, p, e, normals);
+                    }
+
+                    buffer.resize(out - buffer.data());
+                }
+
+                // The dependency on the stream serializes the writes, in chunk order
+                #pragma omp task default(shared) firstprivate(c) depend(in: buffer) depend(inout: writer)
+                {
+                    writer.write(buffer.data(), buffer.size());
+                    std::vector<char>().swap(buffer);
+
+                    auto& lbl = chunkLabels[c];
+
+                    for (const auto l : lbl) {
+                        result.noise += l == static_cast<uint8_t>(PointLabel::Noise);
+                        result.duplicates += l == static_cast<uint8_t>(PointLabel::Duplicate);
+                    }
+
+                    if (labels.is_open())
+                        labels.write(reinterpret_cast<const char*>(lbl.data()), lbl.size());
+
+                    std::vector<uint8_t>().swap(lbl);
+                }
+            }
+
+            if (!writer || (labels.is_open() && !labels))
+                throw std::runtime_error(std::string("Cannot write file ") + path);
+
+            return result;
+        }
+
+    private:
+        static char* encodeBinary(char* out, const PlyPoint& p, const PlyExtra& e, bool normals)
+        {
+            std::memcpy(out, &p.x, sizeof(float) * 3);
+            out += sizeof(float) * 3;
+
+            *out++ = static_cast<char>(p.red);
+            *out++ = static_cast<char>(p.green);
+            *out++ = static_cast<char>(p.blue);
+
+            if (normals) {
+                std::memcpy(out, &e.nx, sizeof(float) * 3);
+                out += sizeof(float) * 3;
+            }
+
+            *out++ = static_cast<char>(p.views);
+
+            return out;
+        }
+
+        static char* encodeFloat(char* out, float value)
+        {
+            // Shortest representation that reads back the same float
+            return std::to_chars(out, out + 32, value).ptr;
+        }
+
+        static char* encodeInt(char* out, int value)
+        {
+            return std::to_chars(out, out + 8, value).ptr;
+        }
+
+        static char* encodeAscii(char* out, const PlyPoint& p, const PlyExtra& e, bool normals)
+        {
+            out = encodeFloat(out, p.x); *out++ = ' ';
+            out = encodeFloat(out, p.y); *out++ = ' ';
+            out = encodeFloat(out, p.z); *out++ = ' ';
+
+            if (normals) {
+                out = encodeFloat(out, e.nx); *out++ = ' ';
+                out = encodeFloat(out, e.ny); *out++ = ' ';
+                out = encodeFloat(out, e.nz); *out++ = ' ';
+            }
+
+            out = encodeInt(out, p.red); *out++ = ' ';
+            out = encodeInt(out, p.green); *out++ = ' ';
+            out = encodeInt(out, p.blue); *out++ = ' ';
+            out = encodeInt(out, p.views); *out++ = '\n';
+
+            return out;
+        }
+    };
+
+}
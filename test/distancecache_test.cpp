@@ -0,0 +1,120 @@
+#include <gtest/gtest.h>
+#include "../distancecache.hpp"
+
+#include <cstdio>
+#include <filesystem>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+static std::vector<FPCFilter::PlyPoint> makePoints(size_t count) {
+
+	std::vector<FPCFilter::PlyPoint> points;
+	for (size_t i = 0; i < count; ++i)
+		points.emplace_back(i * 0.1f, (i % 7) * 0.3f, (i % 13) * 0.05f, 0, 0, 0, 1);
+
+	return points;
+}
+
+static std::string cachePath(const char* name) {
+	const auto path = fs::temp_directory_path() / (std::string("fpcfilter_") + name + ".dist");
+	fs::remove(path);
+	return path.string();
+}
+
+TEST(DistanceCacheTest, RoundTrip) {
+
+	const auto path = cachePath("roundtrip");
+
+	// More than one hash block
+	const auto points = makePoints(150000);
+
+	std::vector<double> distances(points.size());
+	for (size_t i = 0; i < distances.size(); ++i)
+		distances[i] = i * 0.001;
+
+	const auto key = FPCFilter::DistanceCache::key(points, 16, 0);
+	FPCFilter::DistanceCache::save(path, key, distances, 0.25);
+
+	std::vector<double> loaded(points.size(), -1.0);
+	double spacing = 0;
+
+	ASSERT_TRUE(FPCFilter::DistanceCache::load(path, key, loaded, spacing));
+	EXPECT_EQ(loaded, distances);
+	EXPECT_EQ(spacing, 0.25);
+
+	fs::remove(path);
+}
+
+TEST(DistanceCacheTest, KeyChanges) {
+
+	auto points = makePoints(1000);
+
+	const auto key = FPCFilter::DistanceCache::key(points, 16, 0);
+
+	EXPECT_EQ(FPCFilter::DistanceCache::key(points, 16, 0), key);
+	EXPECT_NE(FPCFilter::DistanceCache::key(points, 8, 0), key);
+	EXPECT_NE(FPCFilter::DistanceCache::key(points, 16, 0.5), key);
+
+	points[500].z += 0.001f;
+	EXPECT_NE(FPCFilter::DistanceCache::key(points, 16, 0), key);
+
+	points.pop_back();
+	EXPECT_NE(FPCFilter::DistanceCache::key(points, 16, 0), key);
+}
+
+TEST(DistanceCacheTest, RejectsMismatch) {
+
+	const auto path = cachePath("mismatch");
+
+	const auto points = makePoints(1000);
+	const std::vector<double> distances(points.size(), 1.0);
+
+	const auto key = FPCFilter::DistanceCache::key(points, 16, 0);
+	FPCFilter::DistanceCache::save(path, key, distances, 0.5);
+
+	double spacing = 0;
+
+	// Other parameters
+	std::vector<double> loaded(points.size());
+	EXPECT_FALSE(FPCFilter::DistanceCache::load(path, FPCFilter::DistanceCache::key(points, 8, 0), loaded, spacing));
+
+	// Other size
+	std::vector<double> shorter(points.size() - 1);
+	EXPECT_FALSE(FPCFilter::DistanceCache::load(path, key, shorter, spacing));
+
+	EXPECT_EQ(spacing, 0);
+
+	// Truncated file
+	fs::resize_file(path, fs::file_size(path) - sizeof(double));
+	EXPECT_FALSE(FPCFilter::DistanceCache::load(path, key, loaded, spacing));
+
+	// Missing file
+	fs::remove(path);
+	EXPECT_FALSE(FPCFilter::DistanceCache::load(path, key, loaded, spacing));
+}
+
+TEST(DistanceCacheTest, FailedSaveKeepsPrevious) {
+
+	const auto path = cachePath("failed");
+
+	const auto points = makePoints(1000);
+	const std::vector<double> distances(points.size(), 1.0);
+
+	const auto key = FPCFilter::DistanceCache::key(points, 16, 0);
+	FPCFilter::DistanceCache::save(path, key, distances, 0.5);
+
+	// The temporary file cannot be created: a directory is in the way
+	fs::create_directory(path + ".tmp");
+	EXPECT_THROW(FPCFilter::DistanceCache::save(path, key, std::vector<double>(points.size(), 2.0), 0.5), std::invalid_argument);
+	fs::remove(path + ".tmp");
+
+	std::vector<double> loaded(points.size());
+	double spacing = 0;
+
+	ASSERT_TRUE(FPCFilter::DistanceCache::load(path, key, loaded, spacing));
+	EXPECT_EQ(loaded, distances);
+	EXPECT_FALSE(fs::exists(path + ".tmp"));
+
+	fs::remove(path);
+}
@@ -0,0 +1,102 @@
+#include <gtest/gtest.h>
+#include "../duplicatefilter.hpp"
+#include "../synthetic.hpp"
+
+#include <map>
+#include <sstream>
+#include <tuple>
+#include <vector>
+
+static std::unique_ptr<FPCFilter::PlyFile> makeScene(size_t points) {
+
+	FPCFilter::SceneOptions options;
+	options.points = points;
+	options.seed = 42;
+	options.buildings = 4;
+	options.noise = 0.01;
+	options.duplicates = 0.05;
+
+	return FPCFilter::SyntheticScene(options).cloud();
+}
+
+static FPCFilter::Compaction dedup(FPCFilter::PlyFile& file, FPCFilter::DedupMethod method, bool merge) {
+
+	std::ostringstream log;
+	nlohmann::json stats;
+
+	return FPCFilter::DuplicateFilter(method, merge, log, false, &stats).run(file);
+}
+
+// First occurrence of every location (0 and -0 are the same)
+static std::vector<uint8_t> bruteForceKeep(const std::vector<FPCFilter::PlyPoint>& points) {
+
+	std::map<std::tuple<float, float, float>, size_t> seen;
+	std::vector<uint8_t> keep(points.size());
+
+	for (size_t i = 0; i < points.size(); ++i)
+		keep[i] = seen.emplace(std::make_tuple(points[i].x + 0.0f, points[i].y + 0.0f, points[i].z + 0.0f), i).second;
+
+	return keep;
+}
+
+TEST(DuplicateFilterTest, HashAndSortMatchBruteForce) {
+
+	// More than one partition, so that the sort mode runs several passes
+	auto hashFile = makeScene(300000);
+	auto sortFile = makeScene(300000);
+
+	const auto expected = bruteForceKeep(hashFile->points);
+
+	const auto hash = dedup(*hashFile, FPCFilter::DedupMethod::Hash, false);
+	const auto sort = dedup(*sortFile, FPCFilter::DedupMethod::Sort, false);
+
+	EXPECT_GT(hash.removed(), 0);
+	EXPECT_EQ(hash.mask(), expected);
+	EXPECT_EQ(sort.mask(), expected);
+}
+
+TEST(DuplicateFilterTest, MergeAgrees) {
+
+	auto hashFile = makeScene(100000);
+	auto sortFile = makeScene(100000);
+
+	const auto hash = dedup(*hashFile, FPCFilter::DedupMethod::Hash, true);
+	const auto sort = dedup(*sortFile, FPCFilter::DedupMethod::Sort, true);
+
+	ASSERT_EQ(hash.mask(), sort.mask());
+
+	for (size_t i = 0; i < hashFile->points.size(); ++i) {
+		const auto& a = hashFile->points[i];
+		const auto& b = sortFile->points[i];
+
+		ASSERT_EQ(a.red, b.red) << "point " << i;
+		ASSERT_EQ(a.green, b.green) << "point " << i;
+		ASSERT_EQ(a.blue, b.blue) << "point " << i;
+		ASSERT_EQ(a.views, b.views) << "point " << i;
+	}
+}
+
+TEST(DuplicateFilterTest, MergeSumsViews) {
+
+	std::vector<FPCFilter::PlyPoint> points = {
+		{ 1, 2, 3, 10, 20, 30, 1 },
+		{ 4, 5, 6, 0, 0, 0, 1 },
+		{ 1, 2, 3, 20, 40, 60, 2 },
+		{ -0.0f, 0, 0, 0, 0, 0, 200 },
+		{ 0, 0, 0, 0, 0, 0, 200 }
+	};
+
+	FPCFilter::PlyFile file(points, {});
+
+	const auto compaction = dedup(file, FPCFilter::DedupMethod::Hash, true);
+
+	EXPECT_EQ(compaction.mask(), std::vector<uint8_t>({ 1, 1, 0, 1, 0 }));
+
+	EXPECT_EQ(file.points[0].red, 15);
+	EXPECT_EQ(file.points[0].green, 30);
+	EXPECT_EQ(file.points[0].blue, 45);
+	EXPECT_EQ(file.points[0].views, 3);
+
+	// Capped
+	EXPECT_EQ(file.points[3].views, 255);
+}
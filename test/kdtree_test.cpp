@@ -0,0 +1,161 @@
+#include <gtest/gtest.h>
+#include "../kdtree.hpp"
+#include "../random.hpp"
+
+#include <algorithm>
+#include <vector>
+
+// Uniform random points in a 10 m cube, with a dense cluster so that some leaves are full of close points
+static std::vector<FPCFilter::PlyPoint> makePoints(size_t count, uint64_t seed) {
+
+	std::vector<FPCFilter::PlyPoint> points;
+
+	const auto coordinate = [seed](uint64_t i, float extent) {
+		return static_cast<float>(FPCFilter::SplitMix64::at(seed, i) >> 40) / static_cast<float>(1 << 24) * extent;
+	};
+
+	for (size_t i = 0; i < count; ++i) {
+		const float extent = i % 4 == 0 ? 0.5f : 10.0f;
+		points.emplace_back(coordinate(i * 3, extent), coordinate(i * 3 + 1, extent), coordinate(i * 3 + 2, extent), 0, 0, 0, 1);
+	}
+
+	return points;
+}
+
+static float squaredDistance(const FPCFilter::PlyPoint& p, const float* q) {
+	const float dx = p.x - q[0], dy = p.y - q[1], dz = p.z - q[2];
+	return dx * dx + dy * dy + dz * dz;
+}
+
+// Squared distances of the k nearest points, by brute force
+static std::vector<float> bruteForceKnn(const std::vector<FPCFilter::PlyPoint>& points, const float* q, size_t k) {
+
+	std::vector<float> dists;
+	for (const auto& p : points)
+		dists.push_back(squaredDistance(p, q));
+
+	std::partial_sort(dists.begin(), dists.begin() + k, dists.end());
+	dists.resize(k);
+
+	return dists;
+}
+
+static void expectKnnMatches(const FPCFilter::KDTree& tree, const std::vector<FPCFilter::PlyPoint>& points, size_t k) {
+
+	std::vector<size_t> indices(k);
+	std::vector<float> dists(k);
+
+	for (size_t i = 0; i < points.size(); i += 37) {
+
+		const float q[3] = { points[i].x + 0.01f, points[i].y - 0.02f, points[i].z };
+
+		tree.knnSearch(q, k, indices.data(), dists.data());
+
+		const auto expected = bruteForceKnn(points, q, k);
+
+		for (size_t j = 0; j < k; ++j) {
+			EXPECT_NEAR(dists[j], expected[j], 1e-5f * std::max(1.0f, expected[j])) << "query " << i << ", neighbor " << j;
+
+			ASSERT_LT(indices[j], points.size());
+			EXPECT_NEAR(squaredDistance(points[indices[j]], q), dists[j], 1e-5f * std::max(1.0f, dists[j]));
+		}
+	}
+}
+
+TEST(KDTreeTest, KnnMatchesBruteForce) {
+
+	const auto points = makePoints(5000, 1);
+
+	for (const size_t leafSize : { 1, 8, 64 }) {
+		const FPCFilter::KDTree tree(points, leafSize);
+
+		EXPECT_EQ(tree.size(), points.size());
+		expectKnnMatches(tree, points, 17);
+	}
+}
+
+TEST(KDTreeTest, RadiusCountMatchesBruteForce) {
+
+	const auto points = makePoints(5000, 2);
+	const FPCFilter::KDTree tree(points);
+
+	for (const float radius : { 0.05f, 0.3f, 2.0f }) {
+
+		const float radiusSqr = radius * radius;
+
+		for (size_t i = 0; i < points.size(); i += 53) {
+
+			const float q[3] = { points[i].x, points[i].y, points[i].z };
+
+			size_t expected = 0;
+			for (const auto& p : points)
+				expected += squaredDistance(p, q) <= radiusSqr;
+
+			EXPECT_EQ(tree.radiusCount(q, radiusSqr, points.size()), expected) << "radius " << radius << ", query " << i;
+
+			// Capped
+			EXPECT_EQ(tree.radiusCount(q, radiusSqr, 3), std::min<size_t>(expected, 3));
+		}
+	}
+}
+
+TEST(KDTreeTest, RadiusAnyMatchesBruteForce) {
+
+	const auto points = makePoints(3000, 3);
+	const FPCFilter::KDTree tree(points);
+
+	const float radiusSqr = 0.2f * 0.2f;
+
+	for (size_t i = 0; i < points.size(); i += 29) {
+
+		const float q[3] = { points[i].x, points[i].y, points[i].z };
+
+		// Only the ids multiple of 7 (other than the query) match
+		const auto match = [i](size_t id) { return id != i && id % 7 == 0; };
+
+		bool expected = false;
+		for (size_t j = 0; j < points.size(); ++j)
+			expected |= match(j) && squaredDistance(points[j], q) <= radiusSqr;
+
+		EXPECT_EQ(tree.radiusAny(q, radiusSqr, match), expected) << "query " << i;
+	}
+}
+
+TEST(KDTreeTest, CompactMatchesRebuild) {
+
+	auto points = makePoints(5000, 4);
+	FPCFilter::KDTree tree(points);
+
+	std::vector<uint8_t> keep(points.size());
+	for (size_t i = 0; i < keep.size(); ++i)
+		keep[i] = i % 3 != 0;
+
+	const FPCFilter::Compaction compaction(keep);
+
+	compaction.apply(points);
+	tree.compact(compaction);
+
+	ASSERT_EQ(tree.size(), points.size());
+
+	// The ids are renumbered to the positions in the compacted points
+	expectKnnMatches(tree, points, 9);
+
+	// Compacting again, down to nothing
+	const FPCFilter::Compaction none(std::vector<uint8_t>(points.size(), 0));
+
+	none.apply(points);
+	tree.compact(none);
+
+	EXPECT_EQ(tree.size(), 0);
+
+	const float q[3] = { 1, 1, 1 };
+	EXPECT_EQ(tree.radiusCount(q, 100.0f, 10), 0);
+}
+
+TEST(KDTreeTest, CompactSizeMismatch) {
+
+	const auto points = makePoints(100, 5);
+	FPCFilter::KDTree tree(points);
+
+	EXPECT_THROW(tree.compact(FPCFilter::Compaction(std::vector<uint8_t>(99, 1))), std::invalid_argument);
+}
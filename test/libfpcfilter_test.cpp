@@ -0,0 +1,199 @@
+#include <gtest/gtest.h>
+#include "../libfpcfilter.h"
+
+#include <cmath>
+#include <thread>
+#include <vector>
+
+// Regular grid on the z = 0 plane plus a few points far above it
+static std::vector<float> makeCloud(size_t side, size_t outliers) {
+
+	std::vector<float> xyz;
+
+	for (size_t i = 0; i < side; ++i)
+		for (size_t j = 0; j < side; ++j) {
+			xyz.push_back(i * 0.1f);
+			xyz.push_back(j * 0.1f);
+			xyz.push_back(0.0f);
+		}
+
+	for (size_t k = 0; k < outliers; ++k) {
+		xyz.push_back(k * 1.7f);
+		xyz.push_back(k * 0.9f);
+		xyz.push_back(50.0f + k * 10.0f);
+	}
+
+	return xyz;
+}
+
+TEST(LibFPCFilterTest, FilterInPlace) {
+
+	auto xyz = makeCloud(100, 5);
+	std::vector<uint8_t> views(xyz.size() / 3);
+	for (size_t i = 0; i < views.size(); ++i)
+		views[i] = static_cast<uint8_t>(i % 251);
+
+	fpcfilter_cloud cloud = {};
+	cloud.count = xyz.size() / 3;
+	cloud.xyz = xyz.data();
+	cloud.views = views.data();
+
+	fpcfilter_options options;
+	fpcfilter_default_options(&options);
+	options.std = 2.5;
+	options.meank = 16;
+
+	size_t* survivors = nullptr;
+	char* stats = nullptr;
+
+	ASSERT_EQ(fpcfilter_run(&cloud, &options, &survivors, &stats), FPCFILTER_OK) << fpcfilter_last_error();
+
+	EXPECT_EQ(cloud.count, 100 * 100);
+	EXPECT_NE(std::string(stats).find("statistical_filter"), std::string::npos);
+
+	for (size_t i = 0; i < cloud.count; ++i) {
+		EXPECT_EQ(xyz[i * 3 + 2], 0.0f);
+		EXPECT_EQ(views[i], survivors[i] % 251);
+	}
+
+	fpcfilter_free(survivors);
+	fpcfilter_free(stats);
+}
+
+TEST(LibFPCFilterTest, Crop) {
+
+	auto xyz = makeCloud(100, 0);
+
+	fpcfilter_cloud cloud = {};
+	cloud.count = xyz.size() / 3;
+	cloud.xyz = xyz.data();
+
+	const double boundary[] = { -1, -1, 4.95, -1, 4.95, 20, -1, 20 };
+
+	fpcfilter_options options;
+	fpcfilter_default_options(&options);
+	options.boundary = boundary;
+	options.boundary_count = 4;
+
+	ASSERT_EQ(fpcfilter_run(&cloud, &options, nullptr, nullptr), FPCFILTER_OK) << fpcfilter_last_error();
+
+	EXPECT_EQ(cloud.count, 50 * 100);
+
+	for (size_t i = 0; i < cloud.count; ++i)
+		EXPECT_LT(xyz[i * 3], 4.95f);
+}
+
+TEST(LibFPCFilterTest, InvalidArguments) {
+
+	fpcfilter_cloud cloud = {};
+	cloud.count = 10;
+
+	fpcfilter_options options;
+	fpcfilter_default_options(&options);
+
+	EXPECT_EQ(fpcfilter_run(&cloud, &options, nullptr, nullptr), FPCFILTER_ERROR_INVALID_ARGUMENT);
+	EXPECT_STRNE(fpcfilter_last_error(), "");
+}
+
+TEST(LibFPCFilterTest, ClearsLastError) {
+
+	fpcfilter_cloud invalid = {};
+	invalid.count = 10;
+
+	fpcfilter_options options;
+	fpcfilter_default_options(&options);
+
+	ASSERT_EQ(fpcfilter_run(&invalid, &options, nullptr, nullptr), FPCFILTER_ERROR_INVALID_ARGUMENT);
+
+	auto xyz = makeCloud(10, 0);
+
+	fpcfilter_cloud cloud = {};
+	cloud.count = xyz.size() / 3;
+	cloud.xyz = xyz.data();
+
+	ASSERT_EQ(fpcfilter_run(&cloud, &options, nullptr, nullptr), FPCFILTER_OK);
+	EXPECT_STREQ(fpcfilter_last_error(), "");
+}
+
+TEST(LibFPCFilterTest, CopiesBackEveryBuffer) {
+
+	auto xyz = makeCloud(100, 0);
+	const auto count = xyz.size() / 3;
+
+	std::vector<uint8_t> rgb(count * 3), views(count);
+	std::vector<float> normals(count * 3);
+
+	for (size_t i = 0; i < count; ++i) {
+		for (size_t c = 0; c < 3; ++c) {
+			rgb[i * 3 + c] = static_cast<uint8_t>((i + c) % 256);
+			normals[i * 3 + c] = i + c * 0.5f;
+		}
+		views[i] = static_cast<uint8_t>(i % 7);
+	}
+
+	fpcfilter_cloud cloud = { count, xyz.data(), rgb.data(), normals.data(), views.data() };
+
+	const double boundary[] = { 2.95, -1, 20, -1, 20, 20, 2.95, 20 };
+
+	fpcfilter_options options;
+	fpcfilter_default_options(&options);
+	options.boundary = boundary;
+	options.boundary_count = 4;
+
+	size_t* survivors = nullptr;
+
+	ASSERT_EQ(fpcfilter_run(&cloud, &options, &survivors, nullptr), FPCFILTER_OK) << fpcfilter_last_error();
+	ASSERT_EQ(cloud.count, 70 * 100);
+
+	for (size_t k = 0; k < cloud.count; ++k) {
+		const auto i = survivors[k];
+
+		ASSERT_EQ(xyz[k * 3], (i / 100) * 0.1f);
+		ASSERT_EQ(xyz[k * 3 + 1], (i % 100) * 0.1f);
+
+		for (size_t c = 0; c < 3; ++c) {
+			ASSERT_EQ(rgb[k * 3 + c], static_cast<uint8_t>((i + c) % 256));
+			ASSERT_EQ(normals[k * 3 + c], i + c * 0.5f);
+		}
+
+		ASSERT_EQ(views[k], i % 7);
+	}
+
+	fpcfilter_free(survivors);
+}
+
+TEST(LibFPCFilterTest, ConcurrentCalls) {
+
+	constexpr size_t callers = 4;
+
+	std::vector<std::vector<float>> clouds(callers, makeCloud(60, 5));
+	std::vector<size_t> counts(callers);
+	std::vector<int> results(callers);
+
+	std::vector<std::thread> threads;
+
+	for (size_t t = 0; t < callers; ++t)
+		threads.emplace_back([&, t]() {
+
+			fpcfilter_cloud cloud = {};
+			cloud.count = clouds[t].size() / 3;
+			cloud.xyz = clouds[t].data();
+
+			fpcfilter_options options;
+			fpcfilter_default_options(&options);
+			options.std = 2.5;
+			options.meank = 16;
+
+			results[t] = fpcfilter_run(&cloud, &options, nullptr, nullptr);
+			counts[t] = cloud.count;
+		});
+
+	for (auto& thread : threads)
+		thread.join();
+
+	for (size_t t = 0; t < callers; ++t) {
+		EXPECT_EQ(results[t], FPCFILTER_OK);
+		EXPECT_EQ(counts[t], 60 * 60);
+		EXPECT_EQ(clouds[t], clouds[0]);
+	}
+}
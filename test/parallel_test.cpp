@@ -0,0 +1,123 @@
+#include <gtest/gtest.h>
+#include "../parallel.hpp"
+#include "../random.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <numeric>
+#include <vector>
+
+static std::vector<uint8_t> makeMask(size_t size, uint64_t seed, uint64_t keepOneIn) {
+
+	std::vector<uint8_t> keep(size);
+	for (size_t i = 0; i < size; ++i)
+		keep[i] = FPCFilter::SplitMix64::at(seed, i, keepOneIn) == 0;
+
+	return keep;
+}
+
+TEST(CompactionTest, ApplyKeepsOrder) {
+
+	// Large enough for several blocks per thread
+	for (const uint64_t keepOneIn : { 1, 2, 5, 1000 }) {
+
+		const auto keep = makeMask(300000, keepOneIn, keepOneIn);
+		const FPCFilter::Compaction compaction(keep);
+
+		std::vector<size_t> values(keep.size());
+		std::iota(values.begin(), values.end(), 0);
+
+		std::vector<size_t> expected;
+		for (size_t i = 0; i < keep.size(); ++i)
+			if (keep[i])
+				expected.push_back(i);
+
+		compaction.apply(values);
+
+		EXPECT_EQ(values, expected);
+		EXPECT_EQ(compaction.size(), expected.size());
+		EXPECT_EQ(compaction.removed(), keep.size() - expected.size());
+
+		const auto map = compaction.indexMap();
+
+		for (size_t i = 0; i < keep.size(); ++i) {
+			if (keep[i])
+				ASSERT_EQ(expected[map[i]], i);
+			else
+				ASSERT_EQ(map[i], FPCFilter::Compaction::REMOVED);
+		}
+	}
+}
+
+TEST(CompactionTest, ReleasesCapacity) {
+
+	const auto keep = makeMask(100000, 7, 5);
+	const FPCFilter::Compaction compaction(keep);
+
+	std::vector<double> values(keep.size(), 1.0);
+	compaction.apply(values);
+
+	// More than half removed
+	EXPECT_EQ(values.capacity(), values.size());
+
+	// Less than half removed: the buffer is kept
+	const FPCFilter::Compaction few(makeMask(100000, 8, 1));
+	std::vector<double> all(100000, 1.0);
+	const auto capacity = all.capacity();
+	few.apply(all);
+
+	EXPECT_EQ(all.size(), 100000);
+	EXPECT_EQ(all.capacity(), capacity);
+}
+
+TEST(CompactionTest, Edges) {
+
+	const FPCFilter::Compaction empty({});
+	std::vector<int> none;
+	empty.apply(none);
+	EXPECT_TRUE(none.empty());
+
+	const FPCFilter::Compaction removeAll(std::vector<uint8_t>(1000, 0));
+	std::vector<int> values(1000, 1);
+	removeAll.apply(values);
+	EXPECT_TRUE(values.empty());
+
+	std::vector<int> mismatch(999, 1);
+	EXPECT_THROW(removeAll.apply(mismatch), std::invalid_argument);
+}
+
+TEST(ParallelSelectTest, MatchesNthElement) {
+
+	std::vector<double> values(200000);
+	for (size_t i = 0; i < values.size(); ++i)
+		values[i] = static_cast<double>(FPCFilter::SplitMix64::at(11, i) >> 11) / (1ull << 53);
+
+	// Duplicates, a narrow cluster and infinities
+	for (size_t i = 0; i < values.size(); i += 10)
+		values[i] = 0.5;
+	for (size_t i = 5; i < values.size(); i += 100)
+		values[i] = 0.25 + i * 1e-12;
+	for (size_t i = 3; i < values.size(); i += 1000)
+		values[i] = std::numeric_limits<double>::infinity();
+
+	auto sorted = values;
+	std::sort(sorted.begin(), sorted.end());
+
+	for (const size_t k : { size_t(0), size_t(1), size_t(12345), values.size() / 2, values.size() - 250, values.size() - 1 })
+		EXPECT_EQ(FPCFilter::parallelSelect(values, k), sorted[k]) << "k = " << k;
+
+	const auto n = values.size();
+	EXPECT_EQ(FPCFilter::parallelMedian(values), (sorted[n / 2 - 1] + sorted[n / 2]) / 2.0);
+}
+
+TEST(ParallelSelectTest, SmallAndConstant) {
+
+	const std::vector<double> one = { 3.0 };
+	EXPECT_EQ(FPCFilter::parallelSelect(one, 0), 3.0);
+
+	const std::vector<double> constant(50000, 2.0);
+	EXPECT_EQ(FPCFilter::parallelSelect(constant, 25000), 2.0);
+
+	const std::vector<double> odd = { 5.0, 1.0, 4.0, 2.0, 3.0 };
+	EXPECT_EQ(FPCFilter::parallelMedian(odd), 3.0);
+}
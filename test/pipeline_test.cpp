@@ -142,7 +142,7 @@ TEST(Pipeline, Filter) {
 
 	FPCFilter::Pipeline pipeline(path.generic_string());
 
-	pipeline.filter(2.5, 16);
+	pipeline.filter({ 2.5 }, 16);
 
 	const auto destPath = (ta.getFolder() / "out.ply").generic_string();
 
@@ -0,0 +1,55 @@
+#include <gtest/gtest.h>
+#include "../plan.hpp"
+
+#include <sstream>
+
+static std::string printed(const nlohmann::json& spec) {
+
+	std::ostringstream out;
+	FPCFilter::Plan(spec).print(out);
+
+	return out.str();
+}
+
+TEST(PlanTest, FusesPerPointStages) {
+
+	const auto plan = printed(nlohmann::json::parse(R"([
+		{ "type": "bbox", "min": [0, 0, 0], "max": [1, 1, 1] },
+		{ "type": "project", "normals": false },
+		{ "type": "filter", "std": 2.5, "meank": 16 },
+		{ "type": "bbox", "min": [0, 0, 0], "max": [1, 1, 1] },
+		{ "type": "project", "normals": false }
+	])"));
+
+	EXPECT_NE(plan.find("1. bbox + project (read time)"), std::string::npos) << plan;
+	EXPECT_NE(plan.find("3. bbox + project (fused)"), std::string::npos) << plan;
+}
+
+TEST(PlanTest, ProjectionAloneIsNotReadTime) {
+
+	const auto plan = printed(nlohmann::json::parse(R"([
+		{ "type": "project", "normals": false },
+		{ "type": "filter", "std": 2.5, "meank": 16 }
+	])"));
+
+	EXPECT_NE(plan.find("1. project\n"), std::string::npos) << plan;
+	EXPECT_EQ(plan.find("read time"), std::string::npos) << plan;
+}
+
+TEST(PlanTest, MultipleOutputsMustBeLast) {
+
+	EXPECT_THROW(FPCFilter::Plan(nlohmann::json::parse(R"([
+		{ "type": "filter", "std": [2, 3], "meank": 16 },
+		{ "type": "bbox", "min": [0, 0, 0], "max": [1, 1, 1] }
+	])")), std::invalid_argument);
+
+	EXPECT_THROW(FPCFilter::Plan(nlohmann::json::parse(R"([
+		{ "type": "sample", "radius": [0.1, 0.2] },
+		{ "type": "radius_filter", "min_neighbors": 4 }
+	])")), std::invalid_argument);
+
+	EXPECT_NO_THROW(FPCFilter::Plan(nlohmann::json::parse(R"([
+		{ "type": "sample", "radius": 0.1 },
+		{ "type": "filter", "std": [2, 3], "meank": 16 }
+	])")));
+}
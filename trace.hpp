@@ -0,0 +1,197 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace FPCFilter {
+
+    // Timeline of the stages and of the chunks of work of every thread, written in the Chrome trace event
+    // format (chrome://tracing, https://ui.perfetto.dev). Every thread appends the spans it completes to its
+    // own buffer; when tracing is off a span costs a relaxed load and a branch
+    class Trace {
+
+        struct Event {
+            const char* name;
+            const char* category;
+            int64_t start;
+            int64_t end;
+        };
+
+        struct Buffer {
+            size_t tid;
+            std::vector<Event> events;
+        };
+
+        std::atomic<bool> isEnabled{ false };
+        std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+
+        std::mutex mutex;
+        std::vector<std::unique_ptr<Buffer>> buffers;
+
+        Trace() = default;
+
+        Buffer& local()
+        {
+            thread_local Buffer* buffer = nullptr;
+
+            if (buffer == nullptr) {
+                std::lock_guard<std::mutex> lock(mutex);
+
+                buffers.push_back(std::make_unique<Buffer>());
+                buffer = buffers.back().get();
+                buffer->tid = buffers.size() - 1;
+            }
+
+            return *buffer;
+        }
+
+        static void writeString(std::ostream& o, const char* s)
+        {
+            o << '"';
+            for (; *s; ++s) {
+                if (*s == '"' || *s == '\\')
+                    o << '\\';
+                o << *s;
+            }
+            o << '"';
+        }
+
+    public:
+        static Trace& get()
+        {
+            static Trace trace;
+            return trace;
+        }
+
+        static bool enabled()
+        {
+            return get().isEnabled.load(std::memory_order_relaxed);
+        }
+
+        // Microseconds since the trace was enabled
+        int64_t now() const
+        {
+            return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - origin).count();
+        }
+
+        // The calling thread is shown first (thread 0)
+        void enable()
+        {
+            origin = std::chrono::steady_clock::now();
+            local();
+            isEnabled.store(true, std::memory_order_relaxed);
+        }
+
+        void add(const char* name, const char* category, int64_t start, int64_t end)
+        {
+            local().events.push_back({ name, category, start, end });
+        }
+
+        // Must not run concurrently with the traced work
+        void write(std::ostream& o)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            o << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+            bool first = true;
+
+            for (const auto& buffer : buffers)
+            {
+                o << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->tid
+                    << ",\"args\":{\"name\":\"" << (buffer->tid == 0 ? std::string("main") : "thread " + std::to_string(buffer->tid)) << "\"}}";
+                first = false;
+
+                for (const auto& event : buffer->events)
+                {
+                    o << ",\n{\"name\":";
+                    writeString(o, event.name);
+                    o << ",\"cat\":";
+                    writeString(o, event.category);
+                    o << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->tid << ",\"ts\":" << event.start << ",\"dur\":" << event.end - event.start << "}";
+                }
+            }
+
+            o << "\n]}\n";
+        }
+    };
+
+    // Span of the calling thread, from its construction to end (or its destruction). The name and
+    // category must be string literals
+    class TraceSpan {
+
+        const char* name;
+        const char* category;
+        int64_t start = -1;
+
+    public:
+        explicit TraceSpan(const char* name, const char* category = "chunk") : name(name), category(category)
+        {
+            if (Trace::enabled())
+                start = Trace::get().now();
+        }
+
+        ~TraceSpan()
+        {
+            end();
+        }
+
+        void end()
+        {
+            if (start < 0)
+                return;
+
+            auto& trace = Trace::get();
+            trace.add(name, category, start, trace.now());
+
+            start = -1;
+        }
+
+        TraceSpan(const TraceSpan&) = delete;
+        TraceSpan& operator=(const TraceSpan&) = delete;
+    };
+
+    // Enables the trace and writes it to the file when destroyed. The file is opened (and truncated) right
+    // away, so that a bad path fails the run before any work; a failure of the final write is reported on
+    // the standard error, since it happens after the run
+    class TraceFile {
+
+        std::string path;
+        std::ofstream stream;
+
+    public:
+        explicit TraceFile(const std::string& path) : path(path), stream(path)
+        {
+            if (!stream.is_open())
+                throw std::invalid_argument(std::string("Cannot open file ") + path);
+
+            Trace::get().enable();
+        }
+
+        ~TraceFile()
+        {
+            try {
+                Trace::get().write(stream);
+                stream.close();
+            }
+            catch (...) {
+                stream.setstate(std::ios::failbit);
+            }
+
+            if (stream.fail())
+                std::cerr << "Error: cannot write the trace file " << path << std::endl;
+        }
+
+        TraceFile(const TraceFile&) = delete;
+        TraceFile& operator=(const TraceFile&) = delete;
+    };
+
+}
@@ -8,8 +8,10 @@
 #endif
 
 #include <memory>
+#include <set>
 #include <string>
 #include <stdexcept>
+#include <vector>
 
 // Ref https://stackoverflow.com/a/26221725
 template<typename ... Args>
@@ -23,3 +25,16 @@ std::string string_format(const std::string& format, Args ... args)
 	return std::string(buf.get(), buf.get() + size - 1); // We don't want the '\0' inside
 }
 
+
+// True when two of the values are printed the same with format (outputs named after them would be the same file)
+template<typename T>
+bool hasFormattedDuplicates(const std::vector<T>& values, const std::string& format)
+{
+	std::set<std::string> formatted;
+
+	for (const auto& value : values)
+		if (!formatted.insert(string_format(format, value)).second)
+			return true;
+
+	return false;
+}